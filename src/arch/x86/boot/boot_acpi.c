@@ -0,0 +1,316 @@
+/**
+ * Boot stage ACPI tables parsing, for NUMA topology only now.
+ *
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#include <closureos/types.h>
+#include <closureos/err.h>
+#include <boot/multiboot2.h>
+#include <boot/acpi.h>
+#include <boot/tty.h>
+
+/**
+ * NOTE: ACPI tables are accessed by their physical addresses directly,
+ * as the booting stage page table maps the first 512 GB identically.
+*/
+
+struct boot_numa_info boot_numa_info;
+
+static bool boot_acpi_checksum_ok(const void *table, uint64_t len)
+{
+    const uint8_t *p = table;
+    uint8_t sum = 0;
+
+    for (uint64_t i = 0; i < len; i++) {
+        sum += p[i];
+    }
+
+    return sum == 0;
+}
+
+static bool boot_acpi_signature_match(const char *sig, const char *expected, int len)
+{
+    for (int i = 0; i < len; i++) {
+        if (sig[i] != expected[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static struct acpi_rsdp *boot_acpi_find_rsdp(multiboot_uint8_t *mbi)
+{
+    struct multiboot_tag *tag;
+    struct acpi_rsdp *rsdp = NULL;
+
+    for (tag = (struct multiboot_tag *) (mbi + 8);
+         tag->type != MULTIBOOT_TAG_TYPE_END;
+         tag = (struct multiboot_tag *)
+               ((multiboot_uint8_t *) tag + ((tag->size + 7) & ~7))) {
+        /* prefer the new one, as it has the XSDT */
+        if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW) {
+            return (struct acpi_rsdp*) ((struct multiboot_tag_new_acpi*) tag)->rsdp;
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD) {
+            rsdp = (struct acpi_rsdp*) ((struct multiboot_tag_old_acpi*) tag)->rsdp;
+        }
+    }
+
+    return rsdp;
+}
+
+/* find a table with the signature in the RSDT or XSDT */
+static struct acpi_sdt_header *boot_acpi_find_table(struct acpi_rsdp *rsdp, const char *sig)
+{
+    struct acpi_sdt_header *root, *table;
+    uint64_t entry_sz, entry_nr, addr;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+        root = (struct acpi_sdt_header*) rsdp->xsdt_address;
+        entry_sz = sizeof(uint64_t);
+    } else {
+        root = (struct acpi_sdt_header*) (uint64_t) rsdp->rsdt_address;
+        entry_sz = sizeof(uint32_t);
+    }
+
+    if (!boot_acpi_checksum_ok(root, root->length)) {
+        return NULL;
+    }
+
+    entry_nr = (root->length - sizeof(*root)) / entry_sz;
+
+    for (uint64_t i = 0; i < entry_nr; i++) {
+        uint8_t *entry = (uint8_t*) root + sizeof(*root) + i * entry_sz;
+
+        /* entries are not naturally aligned in XSDT */
+        addr = 0;
+        for (uint64_t j = 0; j < entry_sz; j++) {
+            addr |= (uint64_t) entry[j] << (j * 8);
+        }
+
+        table = (struct acpi_sdt_header*) addr;
+        if (boot_acpi_signature_match(table->signature, sig, 4)
+            && boot_acpi_checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+/* map the proximity domain to a node id, allocating a new one if not seen */
+static int boot_numa_pxm_to_node(uint32_t pxm)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+
+    for (uint32_t i = 0; i < info->node_nr; i++) {
+        if (info->pxm[i] == pxm) {
+            return i;
+        }
+    }
+
+    if (info->node_nr == BOOT_NUMA_MAX_NODES) {
+        return -ENOMEM;
+    }
+
+    info->pxm[info->node_nr] = pxm;
+
+    return info->node_nr++;
+}
+
+static int boot_numa_add_cpu(uint32_t apic_id, uint32_t pxm)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+    int node;
+
+    if ((node = boot_numa_pxm_to_node(pxm)) < 0) {
+        return node;
+    }
+
+    if (info->cpu_cnt == BOOT_NUMA_MAX_CPUS) {
+        return -ENOMEM;
+    }
+
+    info->cpus[info->cpu_cnt].apic_id = apic_id;
+    info->cpus[info->cpu_cnt].node = node;
+    info->cpu_cnt++;
+
+    return 0;
+}
+
+static int boot_numa_add_memblk(uint64_t base, uint64_t size, uint32_t pxm)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+    int node;
+
+    if (!size) {
+        return 0;
+    }
+
+    if ((node = boot_numa_pxm_to_node(pxm)) < 0) {
+        return node;
+    }
+
+    if (info->memblk_cnt == BOOT_NUMA_MAX_MEMBLKS) {
+        return -ENOMEM;
+    }
+
+    info->memblks[info->memblk_cnt].base = base;
+    info->memblks[info->memblk_cnt].size = size;
+    info->memblks[info->memblk_cnt].node = node;
+    info->memblk_cnt++;
+
+    return 0;
+}
+
+static int boot_acpi_parse_srat(struct acpi_srat *srat)
+{
+    struct acpi_srat_entry_header *entry;
+    uint8_t *curr = (uint8_t*) srat + sizeof(*srat);
+    uint8_t *end = (uint8_t*) srat + srat->header.length;
+    int ret = 0;
+
+    for (; (curr + sizeof(*entry)) <= end; curr += entry->length) {
+        entry = (struct acpi_srat_entry_header*) curr;
+        if (!entry->length || (curr + entry->length) > end) {
+            return -EINVAL;
+        }
+
+        switch (entry->type) {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+            struct acpi_srat_cpu_affinity *cpu = (void*) entry;
+
+            if (cpu->flags & ACPI_SRAT_CPU_ENABLED) {
+                ret = boot_numa_add_cpu(cpu->apic_id,
+                                        cpu->proximity_domain_lo
+                                        | (cpu->proximity_domain_hi[0] << 8)
+                                        | (cpu->proximity_domain_hi[1] << 16)
+                                        | (cpu->proximity_domain_hi[2] << 24));
+            }
+            break;
+        }
+        case ACPI_SRAT_TYPE_MEM_AFFINITY: {
+            struct acpi_srat_mem_affinity *mem = (void*) entry;
+
+            if (mem->flags & ACPI_SRAT_MEM_ENABLED) {
+                ret = boot_numa_add_memblk(mem->base_address,
+                                           mem->length,
+                                           mem->proximity_domain);
+            }
+            break;
+        }
+        case ACPI_SRAT_TYPE_X2APIC_AFFINITY: {
+            struct acpi_srat_x2apic_affinity *cpu = (void*) entry;
+
+            if (cpu->flags & ACPI_SRAT_CPU_ENABLED) {
+                ret = boot_numa_add_cpu(cpu->x2apic_id, cpu->proximity_domain);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* SLIT is indexed by proximity domains, which are translated to node ids */
+static void boot_acpi_parse_slit(struct acpi_slit *slit)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+    uint64_t from, to;
+
+    if ((sizeof(*slit) + slit->locality_nr * slit->locality_nr) > slit->header.length) {
+        return ;
+    }
+
+    for (uint32_t i = 0; i < info->node_nr; i++) {
+        for (uint32_t j = 0; j < info->node_nr; j++) {
+            from = info->pxm[i];
+            to = info->pxm[j];
+
+            if (from >= slit->locality_nr || to >= slit->locality_nr) {
+                continue;
+            }
+
+            info->distance[i][j] = slit->entries[from * slit->locality_nr + to];
+        }
+    }
+}
+
+static void boot_numa_default_distance(void)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+
+    for (uint32_t i = 0; i < BOOT_NUMA_MAX_NODES; i++) {
+        for (uint32_t j = 0; j < BOOT_NUMA_MAX_NODES; j++) {
+            info->distance[i][j] = (i == j) ? BOOT_NUMA_LOCAL_DISTANCE
+                                            : BOOT_NUMA_REMOTE_DISTANCE;
+        }
+    }
+}
+
+/**
+ * Collect NUMA topology from ACPI tables, falling back to a single node
+ * if there's no valid SRAT.
+*/
+int boot_acpi_numa_init(multiboot_uint8_t *mbi)
+{
+    struct boot_numa_info *info = &boot_numa_info;
+    struct acpi_rsdp *rsdp;
+    struct acpi_srat *srat;
+    struct acpi_slit *slit;
+    int ret;
+
+    info->node_nr = 0;
+    info->memblk_cnt = 0;
+    info->cpu_cnt = 0;
+    boot_numa_default_distance();
+
+    rsdp = boot_acpi_find_rsdp(mbi);
+    if (!rsdp || !boot_acpi_signature_match(rsdp->signature, "RSD PTR ", 8)) {
+        boot_puts("[!] No ACPI RSDP found, assuming a single NUMA node.");
+        goto no_numa;
+    }
+
+    srat = (struct acpi_srat*) boot_acpi_find_table(rsdp, "SRAT");
+    if (!srat) {
+        goto no_numa;
+    }
+
+    if ((ret = boot_acpi_parse_srat(srat)) < 0 || !info->memblk_cnt) {
+        boot_puts("[!] Invalid ACPI SRAT, assuming a single NUMA node.");
+        goto no_numa;
+    }
+
+    slit = (struct acpi_slit*) boot_acpi_find_table(rsdp, "SLIT");
+    if (slit) {
+        boot_acpi_parse_slit(slit);
+    }
+
+    boot_printstr("[*] ACPI SRAT: ");
+    boot_printnum(info->node_nr);
+    boot_printstr(" NUMA nodes, ");
+    boot_printnum(info->memblk_cnt);
+    boot_printstr(" memory affinity ranges");
+    boot_puts(slit ? ", with SLIT." : ", without SLIT.");
+
+    return 0;
+
+no_numa:
+    info->node_nr = 1;
+    info->pxm[0] = 0;
+    info->memblk_cnt = 0;
+    info->cpu_cnt = 0;
+    boot_numa_default_distance();
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+/**
+ * Boot stage region-based memory allocator.
+ *
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#include <closureos/types.h>
+#include <closureos/err.h>
+#include <boot/memblock.h>
+#include <asm/page_types.h>
+
+/**
+ * Available memory (from multiboot memory map) and reserved memory (allocated,
+ * or used by kernel image, multiboot info, etc.) are recorded in two arrays.
+ * Memory that is in the first but not in the second is free.
+*/
+struct boot_memblock_type boot_memblock_memory;
+struct boot_memblock_type boot_memblock_reserved;
+
+static int boot_memblock_insert(struct boot_memblock_type *type,
+                                uint64_t idx,
+                                uint64_t base,
+                                uint64_t size)
+{
+    if (type->cnt == BOOT_MEMBLOCK_MAX_REGIONS) {
+        return -ENOMEM;
+    }
+
+    for (uint64_t i = type->cnt; i > idx; i--) {
+        type->regions[i] = type->regions[i - 1];
+    }
+
+    type->regions[idx].base = base;
+    type->regions[idx].size = size;
+    type->cnt++;
+
+    return 0;
+}
+
+static void boot_memblock_remove_at(struct boot_memblock_type *type,
+                                    uint64_t idx,
+                                    uint64_t nr)
+{
+    for (uint64_t i = idx; (i + nr) < type->cnt; i++) {
+        type->regions[i] = type->regions[i + nr];
+    }
+
+    type->cnt -= nr;
+}
+
+/* add a range to the type, merging with overlapped or adjacent regions */
+static int boot_memblock_add_range(struct boot_memblock_type *type,
+                                   uint64_t base,
+                                   uint64_t size)
+{
+    uint64_t end = base + size;
+    uint64_t i, j;
+
+    if (!size) {
+        return 0;
+    }
+
+    if (end < base) {
+        return -EINVAL;
+    }
+
+    /* skip regions ending before us */
+    for (i = 0; i < type->cnt; i++) {
+        if ((type->regions[i].base + type->regions[i].size) >= base) {
+            break;
+        }
+    }
+
+    /* regions in [i, j) should be merged with us */
+    for (j = i; j < type->cnt; j++) {
+        uint64_t r_base = type->regions[j].base;
+        uint64_t r_end = r_base + type->regions[j].size;
+
+        if (r_base > end) {
+            break;
+        }
+
+        base = (r_base < base) ? r_base : base;
+        end = (r_end > end) ? r_end : end;
+    }
+
+    if (i == j) {
+        return boot_memblock_insert(type, i, base, end - base);
+    }
+
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+    boot_memblock_remove_at(type, i + 1, j - i - 1);
+
+    return 0;
+}
+
+/* remove a range from the type, splitting regions if necessary */
+static int boot_memblock_remove_range(struct boot_memblock_type *type,
+                                      uint64_t base,
+                                      uint64_t size)
+{
+    uint64_t end = base + size;
+    uint64_t i = 0;
+
+    if (end < base) {
+        return -EINVAL;
+    }
+
+    while (i < type->cnt) {
+        struct boot_memblock_region *r = &type->regions[i];
+        uint64_t r_base = r->base;
+        uint64_t r_end = r_base + r->size;
+
+        if (r_end <= base) {
+            i++;
+            continue;
+        }
+
+        if (r_base >= end) {
+            break;
+        }
+
+        if (r_base < base && r_end > end) {
+            r->size = base - r_base;
+            return boot_memblock_insert(type, i + 1, end, r_end - end);
+        } else if (r_base < base) {
+            r->size = base - r_base;
+            i++;
+        } else if (r_end > end) {
+            r->base = end;
+            r->size = r_end - end;
+            i++;
+        } else {
+            boot_memblock_remove_at(type, i, 1);
+        }
+    }
+
+    return 0;
+}
+
+static bool boot_memblock_search(struct boot_memblock_type *type, uint64_t addr)
+{
+    uint64_t left = 0, right = type->cnt;
+
+    while (left < right) {
+        uint64_t mid = (left + right) / 2;
+        struct boot_memblock_region *r = &type->regions[mid];
+
+        if (addr < r->base) {
+            right = mid;
+        } else if (addr >= (r->base + r->size)) {
+            left = mid + 1;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int boot_memblock_add(uint64_t base, uint64_t size)
+{
+    return boot_memblock_add_range(&boot_memblock_memory, base, size);
+}
+
+/**
+ * Reserved ranges are widened to whole pages, as memory is handed over to the
+ * kernel in pages, a partly reserved page must not be taken as free.
+*/
+int boot_memblock_reserve(uint64_t base, uint64_t size)
+{
+    uint64_t end = PAGE_ALIGN(base + size);
+
+    if (!size) {
+        return 0;
+    }
+
+    base &= PAGE_MASK;
+
+    return boot_memblock_add_range(&boot_memblock_reserved, base, end - base);
+}
+
+int boot_memblock_free(uint64_t base, uint64_t size)
+{
+    return boot_memblock_remove_range(&boot_memblock_reserved, base, size);
+}
+
+bool boot_memblock_is_free(uint64_t addr)
+{
+    return boot_memblock_search(&boot_memblock_memory, addr)
+        && !boot_memblock_search(&boot_memblock_reserved, addr);
+}
+
+/**
+ * Find the next free range [start, end) that begins at or after *cursor,
+ * the cursor will be moved to the end of found range.
+ * Set *cursor to 0 to start a new iteration.
+*/
+bool boot_memblock_next_free_range(uint64_t *cursor,
+                                   uint64_t *start,
+                                   uint64_t *end)
+{
+    for (uint64_t i = 0; i < boot_memblock_memory.cnt; i++) {
+        uint64_t m_base = boot_memblock_memory.regions[i].base;
+        uint64_t m_end = m_base + boot_memblock_memory.regions[i].size;
+        uint64_t curr = (m_base > *cursor) ? m_base : *cursor;
+
+        if (curr >= m_end) {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < boot_memblock_reserved.cnt; j++) {
+            uint64_t r_base = boot_memblock_reserved.regions[j].base;
+            uint64_t r_end = r_base + boot_memblock_reserved.regions[j].size;
+
+            if (r_end <= curr) {
+                continue;
+            }
+
+            if (r_base >= m_end) {
+                break;
+            }
+
+            if (r_base > curr) {
+                break;
+            }
+
+            curr = r_end;
+        }
+
+        if (curr >= m_end) {
+            continue;
+        }
+
+        *start = curr;
+        *end = m_end;
+
+        /* clip by next reserved region */
+        for (uint64_t j = 0; j < boot_memblock_reserved.cnt; j++) {
+            uint64_t r_base = boot_memblock_reserved.regions[j].base;
+
+            if (r_base > curr && r_base < *end) {
+                *end = r_base;
+                break;
+            }
+        }
+
+        *cursor = *end;
+
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Allocate a contiguous block with specific alignment (power of 2) from the
+ * top of free memory, to leave low memory for devices with address limit.
+ * Note that the result could be physical 0, an ERR_PTR() will be returned
+ * for failure.
+*/
+uint64_t boot_memblock_alloc(uint64_t size, uint64_t align)
+{
+    uint64_t cursor = 0, start, end, candidate, found = 0;
+    bool has_found = false;
+
+    if (!size || !align || (align & (align - 1))) {
+        return (uint64_t) ERR_PTR(-EINVAL);
+    }
+
+    while (boot_memblock_next_free_range(&cursor, &start, &end)) {
+        if (end > BOOT_MEMBLOCK_ALLOC_LIMIT) {
+            end = BOOT_MEMBLOCK_ALLOC_LIMIT;
+        }
+
+        if (end <= start || (end - start) < size) {
+            continue;
+        }
+
+        candidate = (end - size) & ~(align - 1);
+        if (candidate < start) {
+            continue;
+        }
+
+        if (!has_found || candidate > found) {
+            found = candidate;
+            has_found = true;
+        }
+    }
+
+    if (!has_found) {
+        return (uint64_t) ERR_PTR(-ENOMEM);
+    }
+
+    if (boot_memblock_reserve(found, size) < 0) {
+        return (uint64_t) ERR_PTR(-ENOMEM);
+    }
+
+    return found;
+}
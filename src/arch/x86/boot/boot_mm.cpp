@@ -18,84 +18,79 @@ extern "C" {
 #include <boot/tty.h>
 #include <boot/string.h>
 #include <asm/page_types.h>
+#include <asm/cpuid.h>
+#include <boot/memblock.h>
+#include <boot/acpi.h>
 
 }
 
 static struct multiboot_tag_mmap *mmap_tag = nullptr;
 static uint32_t mmap_entry_nr;
 
-struct multiboot_mmap_entry *curr_entry = nullptr;
-int curr_entry_idx = -1;
-mm::phys_addr_t curr_avail, curr_end;
+static struct multiboot_tag_elf_sections *elf_info_tag = nullptr;
+mm::phys_addr_t multiboot_tag_start, multiboot_tag_end;
 
 /**
- * Linear allocator without releasing, alloc a page each time.
+ * Page allocator for booting stage, backed by the memblock allocator.
  * Note that the result could be physical 0, NULL should not be use as failure,
  * but a -EMOMEM or some other error number should be returned.
 */
-static auto boot_mm_page_alloc_internal(void) -> void*
+static auto boot_mm_page_alloc(void) -> void*
 {
-    void *res;
-
-    /* initialization */
-    if (!curr_entry) {
-        for (int i = (curr_entry_idx + 1); i < mmap_entry_nr; i++) {
-            if (mmap_tag->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
-                mm::phys_addr_t base = mmap_tag->entries[i].addr;
-                mm::phys_addr_t end = base + mmap_tag->entries[i].len;
-
-                if (base > end) {
-                    boot_puts("[x] FATAL ERROR: "
-                              "integeter overflow at parsing multiboot tags");
-                    asm volatile (" hlt; ");
-                }
-
-                /**
-                 * we'd like to give up the first and last partial page,
-                 * as it's not enough for use to use
-                */
-                base = PAGE_ALIGN(base);
-                end &= PAGE_MASK;
-                
-                /* available region may be less than 1 page, ignore */
-                if ((end < base) || ((end - base) < PAGE_SIZE)) {
-                    continue;
-                }
+    uint64_t res = boot_memblock_alloc(PAGE_SIZE, PAGE_SIZE);
 
-                curr_avail = base;
-                curr_end = end;
-                curr_entry = &mmap_tag->entries[i];
-                curr_entry_idx = i;
-                break;
-            }
-        }
-    }
-
-    if (!curr_entry) {
+    if (IS_ERR_PTR((void*) res)) {
         boot_puts("[x] FATAL ERROR: NO MEMORY AVAILABLE!");
-        return ERR_PTR(-ENOMEM);
     }
 
-    res = (void*) curr_avail;
-    curr_avail += PAGE_SIZE;
-
-    if (curr_avail == curr_end) {
-        curr_entry = nullptr;
-    }
-
-    return res;
+    return (void*) res;
 }
 
-static struct multiboot_tag_elf_sections *elf_info_tag = nullptr;
-mm::phys_addr_t multiboot_tag_start, multiboot_tag_end;
-
-static auto addr_is_in_used_range(mm::phys_addr_t addr) -> bool
+/**
+ * Build memblock from multiboot memory map, and reserve memory in use
+*/
+static auto boot_mm_memblock_init(void) -> int
 {
     struct elf64_shdr *shdr;
     void *shdr_end;
     mm::phys_addr_t seg_start, seg_end;
+    int ret;
+
+    for (int i = 0; i < mmap_entry_nr; i++) {
+        mm::phys_addr_t base = mmap_tag->entries[i].addr;
+        mm::phys_addr_t end = base + mmap_tag->entries[i].len;
+
+        if (mmap_tag->entries[i].type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
 
-    /* in ELF range */
+        if (base > end) {
+            boot_puts("[x] FATAL ERROR: "
+                      "integeter overflow at parsing multiboot tags");
+            asm volatile (" hlt; ");
+        }
+
+        /**
+         * we'd like to give up the first and last partial page,
+         * as it's not enough for use to use
+        */
+        base = PAGE_ALIGN(base);
+        end &= PAGE_MASK;
+
+        /* available region may be less than 1 page, ignore */
+        if ((end < base) || ((end - base) < PAGE_SIZE)) {
+            continue;
+        }
+
+        if ((ret = boot_memblock_add(base, end - base)) < 0) {
+            return ret;
+        }
+    }
+
+    /**
+     * kernel ELF, the first page of the image is ELF header that is not loaded,
+     * we reserve one more page at both ends to make sure to cover it all
+    */
     shdr_end = (void*) ((mm::phys_addr_t) &elf_info_tag->sections
                + elf_info_tag->num * sizeof(*shdr));
 
@@ -108,40 +103,36 @@ static auto addr_is_in_used_range(mm::phys_addr_t addr) -> bool
             continue;
         }
 
-        seg_start = 0x100000 + shdr->sh_offset;
-        seg_end = PAGE_ALIGN(seg_start + shdr->sh_size);
+        seg_start = 0x100000 + shdr->sh_offset - PAGE_SIZE;
+        seg_end = PAGE_ALIGN(seg_start + shdr->sh_size) + PAGE_SIZE;
 
-        if (addr >= seg_start && addr < seg_end) {
-            return true;
+        if ((ret = boot_memblock_reserve(seg_start, seg_end - seg_start)) < 0) {
+            return ret;
         }
     }
 
-    /* in frame buffer */
+    /* frame buffer */
     if (boot_tty_has_fb()) {
-        if ((addr >= (mm::phys_addr_t) boot_fb_base)
-            && (addr <= (mm::phys_addr_t) boot_fb_end)) {
-            return true;
+        seg_start = ((mm::phys_addr_t) boot_fb_base) & PAGE_MASK;
+        seg_end = PAGE_ALIGN((mm::phys_addr_t) boot_fb_end + 1);
+
+        if ((ret = boot_memblock_reserve(seg_start, seg_end - seg_start)) < 0) {
+            return ret;
         }
     }
 
-    /* in multiboot tags */
-    if ((addr >= multiboot_tag_start) && (addr <= multiboot_tag_end)) {
-        return true;
+    /* multiboot tags */
+    ret = boot_memblock_reserve(multiboot_tag_start,
+                                multiboot_tag_end - multiboot_tag_start);
+    if (ret < 0) {
+        return ret;
     }
 
-    return false;
+    return 0;
 }
 
-static auto boot_mm_page_alloc(void) -> void*
-{
-    void *res;
-
-    do {
-        res = boot_mm_page_alloc_internal();
-    } while (addr_is_in_used_range((mm::phys_addr_t) res));
-
-    return res;
-}
+/* number of pages allocated for page table */
+static base::size_t boot_pgtable_page_nr = 0;
 
 /**
  * map a single page on page table,
@@ -171,6 +162,7 @@ static auto boot_mm_pgtable_map(mm::phys_addr_t pgtable,
 
         boot_memset((void*) ((mm::phys_addr_t) pgd[pgd_i]), 0 ,PAGE_SIZE);
         pgd[pgd_i] |= PDE_DEFAULT;
+        boot_pgtable_page_nr++;
     }
 
     pud = (pud_t*) (pgd[pgd_i] & PAGE_MASK);
@@ -183,6 +175,10 @@ static auto boot_mm_pgtable_map(mm::phys_addr_t pgtable,
 
         boot_memset((void*) ((mm::phys_addr_t) pud[pud_i]), 0 ,PAGE_SIZE);
         pud[pud_i] |= PDE_DEFAULT;
+        boot_pgtable_page_nr++;
+    } else if (pud[pud_i] & PDE_ATTR_PS) {
+        /* already covered by a 1 GB page, only for direct mapping area */
+        return 0;
     }
 
     pmd = (pmd_t*) (pud[pud_i] & PAGE_MASK);
@@ -195,6 +191,10 @@ static auto boot_mm_pgtable_map(mm::phys_addr_t pgtable,
 
         boot_memset((void*) ((mm::phys_addr_t) pmd[pmd_i]), 0 ,PAGE_SIZE);
         pmd[pmd_i] |= PDE_DEFAULT;
+        boot_pgtable_page_nr++;
+    } else if (pmd[pmd_i] & PDE_ATTR_PS) {
+        /* already covered by a 2 MB page, only for direct mapping area */
+        return 0;
     }
 
     pte = (pte_t*) (pmd[pmd_i] & PAGE_MASK);
@@ -203,6 +203,381 @@ static auto boot_mm_pgtable_map(mm::phys_addr_t pgtable,
     return 0;
 }
 
+/**
+ * map a 1 GB (PUD_PAGE_SIZE) or 2 MB (PMD_PAGE_SIZE) page on page table,
+ * -EEXIST will be returned if there is already a page table in the slot.
+*/
+static auto boot_mm_pgtable_map_large(mm::phys_addr_t pgtable,
+                                      mm::virt_addr_t va,
+                                      mm::phys_addr_t pa,
+                                      mm::page_attr_t attr,
+                                      base::size_t page_sz) -> int
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+    int pgd_i = PGD_ENTRY(va);
+    int pud_i = PUD_ENTRY(va);
+    int pmd_i = PMD_ENTRY(va);
+
+    pgd = (pgd_t*) pgtable;
+    if (!pgd[pgd_i]) {
+        pgd[pgd_i] = (pgd_t) boot_mm_page_alloc();
+        if (IS_ERR_PTR((void*) pgd[pgd_i])) {
+            pgd[pgd_i] = (pgd_t) nullptr;
+            return -ENOMEM;
+        }
+
+        boot_memset((void*) ((mm::phys_addr_t) pgd[pgd_i]), 0 ,PAGE_SIZE);
+        pgd[pgd_i] |= PDE_DEFAULT;
+        boot_pgtable_page_nr++;
+    }
+
+    pud = (pud_t*) (pgd[pgd_i] & PAGE_MASK);
+    if (page_sz == PUD_PAGE_SIZE) {
+        if (pud[pud_i]) {
+            return -EEXIST;
+        }
+
+        pud[pud_i] = pa | attr | PDE_ATTR_PS;
+        return 0;
+    }
+
+    if (!pud[pud_i]) {
+        pud[pud_i] = (pud_t) boot_mm_page_alloc();
+        if (IS_ERR_PTR((void*) pud[pud_i])) {
+            pud[pud_i] = (pud_t) nullptr;
+            return -ENOMEM;
+        }
+
+        boot_memset((void*) ((mm::phys_addr_t) pud[pud_i]), 0 ,PAGE_SIZE);
+        pud[pud_i] |= PDE_DEFAULT;
+        boot_pgtable_page_nr++;
+    } else if (pud[pud_i] & PDE_ATTR_PS) {
+        return -EEXIST;
+    }
+
+    pmd = (pmd_t*) (pud[pud_i] & PAGE_MASK);
+    if (pmd[pmd_i]) {
+        return -EEXIST;
+    }
+
+    pmd[pmd_i] = pa | attr | PDE_ATTR_PS;
+
+    return 0;
+}
+
+/**
+ * map [base, end) of physical memory to direct mapping area,
+ * with the largest page size that both the CPU and the alignment allow.
+*/
+static base::size_t direct_map_nr_1g, direct_map_nr_2m, direct_map_nr_4k;
+
+static auto boot_mm_direct_map_range(mm::phys_addr_t pgtable,
+                                     mm::phys_addr_t base,
+                                     mm::phys_addr_t end,
+                                     bool has_gbpages) -> int
+{
+    mm::virt_addr_t vaddr = base + mm::KERN_DIRECT_MAP_REGION_BASE;
+    int ret;
+
+    while (base < end) {
+        if (vaddr > mm::KERN_DIRECT_MAP_REGION_END) {   /* out of 64TB */
+            break;
+        }
+
+        if (has_gbpages && !(base & (PUD_PAGE_SIZE - 1))
+            && (end - base) >= PUD_PAGE_SIZE) {
+            ret = boot_mm_pgtable_map_large(pgtable, vaddr, base,
+                                            PDE_ATTR_P | PDE_ATTR_RW,
+                                            PUD_PAGE_SIZE);
+            if (ret == 0) {
+                direct_map_nr_1g++;
+                base += PUD_PAGE_SIZE;
+                vaddr += PUD_PAGE_SIZE;
+                continue;
+            } else if (ret != -EEXIST) {
+                return ret;
+            }
+        }
+
+        if (!(base & (PMD_PAGE_SIZE - 1)) && (end - base) >= PMD_PAGE_SIZE) {
+            ret = boot_mm_pgtable_map_large(pgtable, vaddr, base,
+                                            PDE_ATTR_P | PDE_ATTR_RW,
+                                            PMD_PAGE_SIZE);
+            if (ret == 0) {
+                direct_map_nr_2m++;
+                base += PMD_PAGE_SIZE;
+                vaddr += PMD_PAGE_SIZE;
+                continue;
+            } else if (ret != -EEXIST) {
+                return ret;
+            }
+        }
+
+        ret = boot_mm_pgtable_map(pgtable, vaddr, base, PTE_ATTR_P | PTE_ATTR_RW);
+        if (ret < 0) {
+            return ret;
+        }
+
+        direct_map_nr_4k++;
+        base += PAGE_SIZE;
+        vaddr += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* whether a virtual address has been mapped on the page table */
+static auto boot_mm_pgtable_is_mapped(mm::phys_addr_t pgtable, mm::virt_addr_t va) -> bool
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    pgd = (pgd_t*) pgtable;
+    if (!pgd[PGD_ENTRY(va)]) {
+        return false;
+    }
+
+    pud = (pud_t*) (pgd[PGD_ENTRY(va)] & PAGE_MASK);
+    if (!pud[PUD_ENTRY(va)]) {
+        return false;
+    } else if (pud[PUD_ENTRY(va)] & PDE_ATTR_PS) {
+        return true;
+    }
+
+    pmd = (pmd_t*) (pud[PUD_ENTRY(va)] & PAGE_MASK);
+    if (!pmd[PMD_ENTRY(va)]) {
+        return false;
+    } else if (pmd[PMD_ENTRY(va)] & PDE_ATTR_PS) {
+        return true;
+    }
+
+    pte = (pte_t*) (pmd[PMD_ENTRY(va)] & PAGE_MASK);
+
+    return !!pte[PTE_ENTRY(va)];
+}
+
+/* whether the PMD slot for a virtual address has nothing mapped */
+static auto boot_mm_pgtable_pmd_is_none(mm::phys_addr_t pgtable, mm::virt_addr_t va) -> bool
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+
+    pgd = (pgd_t*) pgtable;
+    if (!pgd[PGD_ENTRY(va)]) {
+        return true;
+    }
+
+    pud = (pud_t*) (pgd[PGD_ENTRY(va)] & PAGE_MASK);
+    if (!pud[PUD_ENTRY(va)]) {
+        return true;
+    } else if (pud[PUD_ENTRY(va)] & PDE_ATTR_PS) {
+        return false;
+    }
+
+    pmd = (pmd_t*) (pud[PUD_ENTRY(va)] & PAGE_MASK);
+
+    return !pmd[PMD_ENTRY(va)];
+}
+
+static auto boot_mm_zeroed_page_alloc(void) -> void*
+{
+    void *page = boot_mm_page_alloc();
+
+    if (!IS_ERR_PTR(page)) {
+        boot_memset(page, 0, PAGE_SIZE);
+    }
+
+    return page;
+}
+
+/**
+ * Page database is populated only for memory that really exists (sparse),
+ * the holes are mapped to a shared zero page READ-ONLY, so that `type` for a
+ * non-existed page reads as `PAGE_NON_EXISTED` without costing any memory.
+ * A whole unmapped PMD/PUD slot is filled with a shared zero table, so that
+ * it costs only 3 pages in total for all the holes.
+*/
+static mm::phys_addr_t pgdb_zero_page, pgdb_zero_pte, pgdb_zero_pmd;
+
+static auto boot_mm_pgdb_zero_tables_init(void) -> int
+{
+    void *page;
+
+    page = boot_mm_zeroed_page_alloc();
+    if (IS_ERR_PTR(page)) {
+        return PTR_ERR(page);
+    }
+    pgdb_zero_page = (mm::phys_addr_t) page;
+
+    page = boot_mm_zeroed_page_alloc();
+    if (IS_ERR_PTR(page)) {
+        return PTR_ERR(page);
+    }
+    pgdb_zero_pte = (mm::phys_addr_t) page;
+
+    page = boot_mm_zeroed_page_alloc();
+    if (IS_ERR_PTR(page)) {
+        return PTR_ERR(page);
+    }
+    pgdb_zero_pmd = (mm::phys_addr_t) page;
+
+    for (int i = 0; i < 512; i++) {
+        ((pte_t*) pgdb_zero_pte)[i] = pgdb_zero_page | PTE_ATTR_P;
+        ((pmd_t*) pgdb_zero_pmd)[i] = pgdb_zero_pte | PDE_ATTR_P;
+    }
+
+    boot_pgtable_page_nr += 2;
+
+    return 0;
+}
+
+static auto boot_mm_pgdb_fill_holes(mm::phys_addr_t pgtable,
+                                    mm::virt_addr_t va,
+                                    mm::virt_addr_t end) -> int
+{
+    pgd_t *pgd;
+    pud_t *pud;
+    pmd_t *pmd;
+    pte_t *pte;
+
+    pgd = (pgd_t*) pgtable;
+
+    while (va < end) {
+        if (!pgd[PGD_ENTRY(va)]) {
+            void *page = boot_mm_zeroed_page_alloc();
+
+            if (IS_ERR_PTR(page)) {
+                return PTR_ERR(page);
+            }
+
+            pgd[PGD_ENTRY(va)] = (pgd_t) page | PDE_DEFAULT;
+            boot_pgtable_page_nr++;
+        }
+
+        pud = (pud_t*) (pgd[PGD_ENTRY(va)] & PAGE_MASK);
+        if (!pud[PUD_ENTRY(va)]) {
+            pud[PUD_ENTRY(va)] = pgdb_zero_pmd | PDE_ATTR_P;
+            va = (va + PUD_PAGE_SIZE) & ~(PUD_PAGE_SIZE - 1);
+            continue;
+        }
+
+        pmd = (pmd_t*) (pud[PUD_ENTRY(va)] & PAGE_MASK);
+        if (!pmd[PMD_ENTRY(va)]) {
+            pmd[PMD_ENTRY(va)] = pgdb_zero_pte | PDE_ATTR_P;
+            va = (va + PMD_PAGE_SIZE) & ~(PMD_PAGE_SIZE - 1);
+            continue;
+        }
+
+        pte = (pte_t*) (pmd[PMD_ENTRY(va)] & PAGE_MASK);
+        if (!pte[PTE_ENTRY(va)]) {
+            pte[PTE_ENTRY(va)] = pgdb_zero_page | PTE_ATTR_P;
+        }
+
+        va += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* allocate `struct Page` only for pages described by memory map */
+static auto boot_mm_pgdb_init(mm::phys_addr_t pgtable,
+                              mm::Page *pgdb_base,
+                              base::size_t pgdb_page_nr) -> int
+{
+    base::size_t populated_nr = 0, total_nr;
+    int ret;
+
+    for (int i = 0; i < mmap_entry_nr; i++) {
+        /* pageblock type is stored at its first page, which must exist */
+        mm::pfn_t start_pfn = (mmap_tag->entries[i].addr / PAGE_SIZE) & ~(mm::PAGEBLOCK_PAGES - 1);
+        mm::pfn_t end_pfn = PAGE_ALIGN(mmap_tag->entries[i].addr
+                                       + mmap_tag->entries[i].len) / PAGE_SIZE;
+        mm::virt_addr_t va = ((mm::virt_addr_t) &pgdb_base[start_pfn]) & PAGE_MASK;
+        mm::virt_addr_t va_end = PAGE_ALIGN((mm::virt_addr_t) &pgdb_base[end_pfn]);
+
+        if (va_end > mm::KERN_PAGE_DATABASE_REGION_END) {   /* out of 8TB */
+            va_end = mm::KERN_PAGE_DATABASE_REGION_END + 1;
+        }
+
+        while (va < va_end) {
+            void *new_page;
+            uint64_t new_block;
+
+            if (boot_mm_pgtable_is_mapped(pgtable, va)) {
+                va += PAGE_SIZE;
+                continue;
+            }
+
+            /* back a whole 2 MB slot with a large page if possible */
+            if (!(va & (PMD_PAGE_SIZE - 1)) && (va_end - va) >= PMD_PAGE_SIZE
+                && boot_mm_pgtable_pmd_is_none(pgtable, va)) {
+                new_block = boot_memblock_alloc(PMD_PAGE_SIZE, PMD_PAGE_SIZE);
+
+                if (!IS_ERR_PTR((void*) new_block)) {
+                    boot_memset((void*) new_block, 0, PMD_PAGE_SIZE);
+                    ret = boot_mm_pgtable_map_large(pgtable,
+                                                    va,
+                                                    new_block,
+                                                    PDE_ATTR_P | PDE_ATTR_RW,
+                                                    PMD_PAGE_SIZE);
+                    if (ret < 0) {
+                        return ret;
+                    }
+
+                    populated_nr += PMD_PAGE_SIZE / PAGE_SIZE;
+                    va += PMD_PAGE_SIZE;
+                    continue;
+                }
+            }
+
+            new_page = boot_mm_zeroed_page_alloc();
+            if (IS_ERR_PTR(new_page)) {
+                return PTR_ERR(new_page);
+            }
+
+            ret = boot_mm_pgtable_map(pgtable,
+                                      va,
+                                      (mm::phys_addr_t) new_page,
+                                      PTE_ATTR_P | PTE_ATTR_RW);
+            if (ret < 0) {
+                return ret;
+            }
+
+            populated_nr++;
+            va += PAGE_SIZE;
+        }
+    }
+
+    if ((ret = boot_mm_pgdb_zero_tables_init()) < 0) {
+        return ret;
+    }
+
+    ret = boot_mm_pgdb_fill_holes(pgtable,
+                                  (mm::virt_addr_t) pgdb_base,
+                                  PAGE_ALIGN((mm::virt_addr_t) &pgdb_base[pgdb_page_nr]));
+    if (ret < 0) {
+        return ret;
+    }
+
+    total_nr = PAGE_ALIGN(pgdb_page_nr * sizeof(mm::Page)) / PAGE_SIZE;
+
+    boot_printstr("[*] page database: ");
+    boot_printnum(populated_nr);
+    boot_printstr(" of ");
+    boot_printnum(total_nr);
+    boot_printstr(" pages populated, ");
+    boot_printnum(total_nr > (populated_nr + 3)
+                  ? (total_nr - populated_nr - 3) * (PAGE_SIZE / 1024) : 0);
+    boot_puts(" KB saved for holes.");
+
+    return 0;
+}
+
 mm::phys_addr_t boot_kern_pgtable;
 
 static auto boot_mm_load_pgtable(mm::phys_addr_t pgtable) -> void
@@ -227,7 +602,8 @@ static auto boot_mm_pgtable_init(void) -> int
     mm::page_attr_t pte_attr;
     mm::phys_addr_t physmem_start, physmem_end;
     mm::Page *pgdb_base;
-    base::size_t pgdb_page_nr;
+    base::size_t pgdb_page_nr, pgtable_page_nr;
+    bool has_gbpages;
     int ret;
 
     boot_kern_pgtable = (mm::phys_addr_t) boot_mm_page_alloc();
@@ -236,6 +612,7 @@ static auto boot_mm_pgtable_init(void) -> int
         return -ENOMEM;
     }
     boot_memset((void*) boot_kern_pgtable, 0, PAGE_SIZE);
+    boot_pgtable_page_nr++;
 
     /* map kernel ELF */
     shdr_end = (void*) ((mm::phys_addr_t) &elf_info_tag->sections
@@ -324,6 +701,8 @@ static auto boot_mm_pgtable_init(void) -> int
 
     /* map for direct mapping area */
     physmem_start = physmem_end = 0x0000000000000000;
+    has_gbpages = cpu_has_gbpages();
+    pgtable_page_nr = boot_pgtable_page_nr;
 
     for (int i = 0; i < mmap_entry_nr; i++) {
         mm::phys_addr_t base = mmap_tag->entries[i].addr & PAGE_MASK;
@@ -341,43 +720,29 @@ static auto boot_mm_pgtable_init(void) -> int
             asm volatile(" hlt ");
         }
 
-        while (base < end) {
-            if (vaddr > mm::KERN_DIRECT_MAP_REGION_END) {   /* out of 64TB */
-                break;
-            }
-
-            ret = boot_mm_pgtable_map(boot_kern_pgtable,
-                                vaddr,
-                                base,
-                                PTE_ATTR_P | PTE_ATTR_RW);
-            if (ret < 0) {
-                return ret;
-            }
-
-            base += PAGE_SIZE;
-            vaddr += PAGE_SIZE;
+        ret = boot_mm_direct_map_range(boot_kern_pgtable, base, end, has_gbpages);
+        if (ret < 0) {
+            return ret;
         }
     }
 
+    boot_printstr("[*] direct mapping area: ");
+    boot_printnum(direct_map_nr_1g);
+    boot_printstr(" 1G pages, ");
+    boot_printnum(direct_map_nr_2m);
+    boot_printstr(" 2M pages, ");
+    boot_printnum(direct_map_nr_4k);
+    boot_printstr(" 4K pages, with ");
+    boot_printnum(boot_pgtable_page_nr - pgtable_page_nr);
+    boot_puts(" page table pages.");
+
     /* map for page database (`struct page` array) */
     pgdb_base = (mm::Page*) mm::KERN_PAGE_DATABASE_REGION_BASE;
     pgdb_page_nr = (physmem_end - physmem_start) / PAGE_SIZE;
 
-    for (base::size_t i = 0; i < pgdb_page_nr; i += mm::PGDB_PG_PAGE_NR) {
-        void *new_page = boot_mm_page_alloc();
-
-        if(IS_ERR_PTR(new_page)) {
-            return PTR_ERR(new_page);
-        }
-
-        boot_memset((void*) new_page, 0, PAGE_SIZE);
-        ret = boot_mm_pgtable_map(boot_kern_pgtable,
-                                  (mm::virt_addr_t) &pgdb_base[i],
-                                  (mm::phys_addr_t) new_page,
-                                  PTE_ATTR_P | PTE_ATTR_RW);
-        if (ret < 0) {
-            return ret;
-        }
+    ret = boot_mm_pgdb_init(boot_kern_pgtable, pgdb_base, pgdb_page_nr);
+    if (ret < 0) {
+        return ret;
     }
 
     /* load the new page table now! */
@@ -413,7 +778,6 @@ static auto boot_mm_page_database_init(void) -> int
         while (base < end) {
             pfn = base / PAGE_SIZE;
             /* initialized value for every page */
-            mm::pgdb_base[pfn].migrate_type = mm::MIGRATE_UNMOVABLE;    /* temporarily only this only */
             mm::pgdb_base[pfn].lock.Reset();
             mm::pgdb_base[pfn].kc = nullptr;
             mm::pgdb_base[pfn].pool = nullptr;
@@ -425,7 +789,7 @@ static auto boot_mm_page_database_init(void) -> int
             case MULTIBOOT_MEMORY_AVAILABLE:
                 mm::pgdb_base[pfn].type = mm::PAGE_NORMAL_MEM;
 
-                if (base < curr_avail || addr_is_in_used_range(base)) {
+                if (!boot_memblock_is_free(base & PAGE_MASK)) {
                     /* used page */
                     lib::atomic::atomic_set(&mm::pgdb_base[pfn].ref_count, 0);
                 } else {
@@ -469,6 +833,96 @@ static auto boot_mm_page_database_init(void) -> int
     return 0;
 }
 
+/**
+ * Hand leftover free memory over to the kernel, which will be seeded into
+ * the buddy system directly. No more boot allocation should happen after that.
+*/
+static auto boot_mm_free_ranges_handover(void) -> void
+{
+    uint64_t cursor = 0, start, end;
+    base::size_t nr = 0;
+
+    while (boot_memblock_next_free_range(&cursor, &start, &end)) {
+        if (nr == mm::BOOT_FREE_RANGE_MAX_NR) {
+            boot_puts("[!] Warning: too many free memory ranges, some are dropped.");
+            break;
+        }
+
+        /* memory regions might not be page-aligned, only take whole pages */
+        start = PAGE_ALIGN(start);
+        end &= PAGE_MASK;
+        if (start >= end) {
+            continue;
+        }
+
+        mm::boot_free_ranges[nr].start = start / PAGE_SIZE;
+        mm::boot_free_ranges[nr].end = end / PAGE_SIZE;
+        nr++;
+    }
+
+    mm::boot_free_range_nr = nr;
+
+    boot_printstr("[*] memblock: ");
+    boot_printnum(boot_memblock_memory.cnt);
+    boot_printstr(" memory regions, ");
+    boot_printnum(boot_memblock_reserved.cnt);
+    boot_printstr(" reserved regions, ");
+    boot_printnum(nr);
+    boot_puts(" free ranges handed over.");
+}
+
+/* initial APIC ID of the BSP, from CPUID.01H:EBX[31:24] */
+static auto boot_mm_bsp_apic_id(void) -> uint32_t
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    return ebx >> 24;
+}
+
+/* hand NUMA topology collected from ACPI over to the kernel */
+static auto boot_mm_numa_handover(void) -> void
+{
+    uint32_t bsp_apic_id = boot_mm_bsp_apic_id();
+    base::size_t nr = 0;
+
+    mm::numa_node_nr = boot_numa_info.node_nr;
+
+    for (uint32_t i = 0; i < boot_numa_info.memblk_cnt; i++) {
+        struct boot_numa_memblk *blk = &boot_numa_info.memblks[i];
+
+        if (nr == mm::NUMA_NODE_RANGE_MAX_NR) {
+            boot_puts("[!] Warning: too many NUMA memory ranges, some are dropped.");
+            break;
+        }
+
+        mm::numa_node_ranges[nr].start = PAGE_ALIGN(blk->base) / PAGE_SIZE;
+        mm::numa_node_ranges[nr].end = ((blk->base + blk->size) & PAGE_MASK) / PAGE_SIZE;
+        mm::numa_node_ranges[nr].nid = blk->node;
+
+        if (mm::numa_node_ranges[nr].start < mm::numa_node_ranges[nr].end) {
+            nr++;
+        }
+    }
+
+    mm::numa_node_range_nr = nr;
+
+    for (uint32_t i = 0; i < BOOT_NUMA_MAX_NODES && i < mm::MAX_NUMNODES; i++) {
+        for (uint32_t j = 0; j < BOOT_NUMA_MAX_NODES && j < mm::MAX_NUMNODES; j++) {
+            mm::numa_distance[i][j] = boot_numa_info.distance[i][j];
+        }
+    }
+
+    /* only the BSP is running now, other CPUs will be set at SMP bring-up */
+    for (uint32_t i = 0; i < boot_numa_info.cpu_cnt; i++) {
+        if (boot_numa_info.cpus[i].apic_id == bsp_apic_id) {
+            mm::numa_cpu_node[0] = boot_numa_info.cpus[i].node;
+            break;
+        }
+    }
+}
+
 auto boot_mm_init(multiboot_uint8_t *mbi) -> int
 {
     struct multiboot_tag *tag;
@@ -506,7 +960,17 @@ auto boot_mm_init(multiboot_uint8_t *mbi) -> int
         /* just do nothing*/
     }
 
-    multiboot_tag_end = PAGE_ALIGN((page_attr_t) tag);
+    multiboot_tag_end = PAGE_ALIGN((page_attr_t) tag + sizeof(*tag));
+
+    /* no NUMA info is not fatal, we just take all memory as on node 0 */
+    boot_acpi_numa_init(mbi);
+
+    if ((ret = boot_mm_memblock_init()) < 0) {
+        boot_printstr("[x] FAILED to initialize memblock, errno: ");
+        boot_printnum(ret);
+        boot_putchar('\n');
+        return ret;
+    }
 
     if ((ret = boot_mm_pgtable_init()) < 0) {
         boot_printstr("[x] FAILED to initialize page table, errno: ");
@@ -520,6 +984,9 @@ auto boot_mm_init(multiboot_uint8_t *mbi) -> int
         boot_putchar('\n');
     }
 
+    boot_mm_free_ranges_handover();
+    boot_mm_numa_handover();
+
     auto val = mm::KERN_DIRECT_MAP_REGION_BASE;
 
     return val;
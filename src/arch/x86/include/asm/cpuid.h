@@ -0,0 +1,51 @@
+/**
+ * CPUID instruction and feature bits
+ * 
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#ifndef X86_ASM_CPUID_H
+#define X86_ASM_CPUID_H
+
+#include <closureos/types.h>
+#include <closureos/compiler.h>
+
+/* CPUID leaves */
+
+#define CPUID_LEAF_EXT_MAX      0x80000000
+#define CPUID_LEAF_EXT_FEATURE  0x80000001
+
+/* CPUID.80000001H:EDX */
+
+#define CPUID_EXT_EDX_NX        (1 << 20)
+#define CPUID_EXT_EDX_PDPE1GB   (1 << 26)
+
+static __always_inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                                  uint32_t *eax, uint32_t *ebx,
+                                  uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile(
+        "cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "a" (leaf), "c" (subleaf)
+    );
+}
+
+/* whether 1 GB pages are supported */
+static __always_inline bool cpu_has_gbpages(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(CPUID_LEAF_EXT_MAX, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < CPUID_LEAF_EXT_FEATURE) {
+        return false;
+    }
+
+    cpuid(CPUID_LEAF_EXT_FEATURE, 0, &eax, &ebx, &ecx, &edx);
+
+    return !!(edx & CPUID_EXT_EDX_PDPE1GB);
+}
+
+#endif // X86_ASM_CPUID_H
@@ -0,0 +1,64 @@
+/**
+ * Page operations
+ * 
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#ifndef X86_ASM_PAGE_H
+#define X86_ASM_PAGE_H
+
+#include <closureos/types.h>
+#include <closureos/compiler.h>
+
+/**
+ * NOTE: <asm/page_types.h> is not included there, as kernel.mm includes it
+ * inside its namespace, so the page size is written directly.
+ */
+static __always_inline void clear_page(void *page)
+{
+    uint64_t cnt = 4096 / sizeof(uint64_t);
+
+    asm volatile(
+        "rep stosq"
+        : "+D" (page), "+c" (cnt)
+        : "a" (0)
+        : "memory"
+    );
+}
+
+/* clear the page with non-temporal stores, so that caches are not polluted */
+static __always_inline void clear_page_nt(void *page)
+{
+    uint64_t *p = (uint64_t*) page, *end = p + 4096 / sizeof(uint64_t);
+
+    for (; p < end; p += 4) {
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :
+            : "r" (p), "r" ((uint64_t) 0)
+            : "memory"
+        );
+    }
+
+    /* make them visible before the page is handed out */
+    asm volatile("sfence" : : : "memory");
+}
+
+static __always_inline void copy_page(void *to, void *from)
+{
+    uint64_t cnt = 4096 / sizeof(uint64_t);
+
+    asm volatile(
+        "rep movsq"
+        : "+D" (to), "+S" (from), "+c" (cnt)
+        :
+        : "memory"
+    );
+}
+
+#endif // X86_ASM_PAGE_H
@@ -24,6 +24,11 @@
 #define PDE_ATTR_PS    (1 << 7)
 #define PDE_DEFAULT     (PDE_ATTR_P | PDE_ATTR_RW)
 
+/* large page size */
+
+#define PMD_PAGE_SIZE (1UL << 21)   /* 2 MB */
+#define PUD_PAGE_SIZE (1UL << 30)   /* 1 GB */
+
 /* page table entry */
 
 #define PTE_OFFSET 12
@@ -42,6 +47,11 @@
 #define PUD_ENTRY(addr) ((addr >> PUD_OFFSET) & PT_ENTRY_MASK)
 #define PGD_ENTRY(addr) ((addr >> PGD_OFFSET) & PT_ENTRY_MASK)
 
+#define PT_ENTRY_NR     512
+
+/* physical address bits in an entry, the rest are attributes */
+#define PTE_PFN_MASK    0x000FFFFFFFFFF000UL
+
 /* for C code */
 
 #ifndef ASM_FILE
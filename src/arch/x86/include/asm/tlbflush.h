@@ -0,0 +1,76 @@
+/**
+ * TLB flushing operations
+ * 
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#ifndef X86_ASM_TLBFLUSH_H
+#define X86_ASM_TLBFLUSH_H
+
+#include <closureos/types.h>
+#include <closureos/compiler.h>
+
+#ifdef CONFIG_HOSTED
+
+/**
+ * Hosted builds (e.g. tools/mmsim) have no paging of their own, page tables
+ * are only built in the fake physical memory, with the root set by the host.
+ */
+#ifdef __cplusplus
+extern "C" uint64_t hosted_cr3;
+#else
+extern uint64_t hosted_cr3;
+#endif
+
+static __always_inline uint64_t read_cr3(void)
+{
+    return hosted_cr3;
+}
+
+static __always_inline void write_cr3(uint64_t cr3)
+{
+    hosted_cr3 = cr3;
+}
+
+static __always_inline void flush_tlb_one(uint64_t addr)
+{
+    (void) addr;
+}
+
+static __always_inline void flush_tlb_all(void)
+{
+}
+
+#else
+
+static __always_inline uint64_t read_cr3(void)
+{
+    uint64_t cr3;
+
+    asm volatile("mov %%cr3, %0" : "=r" (cr3) : : "memory");
+
+    return cr3;
+}
+
+static __always_inline void write_cr3(uint64_t cr3)
+{
+    asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+/* invalidate TLB entries (and paging-structure caches) for one address */
+static __always_inline void flush_tlb_one(uint64_t addr)
+{
+    asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+/* reloading CR3 flushes all non-global TLB entries */
+static __always_inline void flush_tlb_all(void)
+{
+    write_cr3(read_cr3());
+}
+
+#endif // CONFIG_HOSTED
+
+#endif // X86_ASM_TLBFLUSH_H
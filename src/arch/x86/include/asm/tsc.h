@@ -0,0 +1,24 @@
+/**
+ * Time Stamp Counter operations
+ * 
+ * Copyright (c) 2024 arttnba3 <arttnba3@outlook.com>
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+*/
+
+#ifndef X86_ASM_TSC_H
+#define X86_ASM_TSC_H
+
+#include <closureos/types.h>
+#include <closureos/compiler.h>
+
+static __always_inline uint64_t rdtsc(void)
+{
+    uint32_t low, high;
+
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+
+    return ((uint64_t) high << 32) | low;
+}
+
+#endif // X86_ASM_TSC_H
@@ -0,0 +1,137 @@
+#ifndef X86_BOOT_ACPI_H
+#define X86_BOOT_ACPI_H
+
+#include <closureos/types.h>
+#include <boot/multiboot2.h>
+
+/**
+ * ACPI tables we need at booting stage, see ACPI Specification 6.5
+ * Chapter 5.2 for details.
+ */
+
+struct acpi_rsdp {
+    char signature[8];      /* "RSD PTR " */
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    /* fields below exist only for revision >= 2 */
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+/* System Resource Affinity Table */
+
+struct acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+#define ACPI_SRAT_TYPE_CPU_AFFINITY     0
+#define ACPI_SRAT_TYPE_MEM_AFFINITY     1
+#define ACPI_SRAT_TYPE_X2APIC_AFFINITY  2
+
+struct acpi_srat_entry_header {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+#define ACPI_SRAT_CPU_ENABLED   (1 << 0)
+
+struct acpi_srat_cpu_affinity {
+    struct acpi_srat_entry_header header;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+#define ACPI_SRAT_MEM_ENABLED   (1 << 0)
+
+struct acpi_srat_mem_affinity {
+    struct acpi_srat_entry_header header;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity {
+    struct acpi_srat_entry_header header;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+/* System Locality Information Table */
+
+struct acpi_slit {
+    struct acpi_sdt_header header;
+    uint64_t locality_nr;
+    uint8_t entries[0];     /* locality_nr * locality_nr distances */
+} __attribute__((packed));
+
+/**
+ * NUMA topology collected from SRAT and SLIT, proximity domains are mapped to
+ * node ids in the order they appear. All memory is on node 0 without SRAT.
+ */
+
+#define BOOT_NUMA_MAX_NODES     8
+#define BOOT_NUMA_MAX_MEMBLKS   64
+#define BOOT_NUMA_MAX_CPUS      64
+
+#define BOOT_NUMA_LOCAL_DISTANCE    10
+#define BOOT_NUMA_REMOTE_DISTANCE   20
+
+struct boot_numa_memblk {
+    uint64_t base;
+    uint64_t size;
+    uint32_t node;
+};
+
+struct boot_numa_cpu {
+    uint32_t apic_id;
+    uint32_t node;
+};
+
+struct boot_numa_info {
+    uint32_t node_nr;
+    uint32_t pxm[BOOT_NUMA_MAX_NODES];  /* proximity domain of each node */
+
+    uint32_t memblk_cnt;
+    struct boot_numa_memblk memblks[BOOT_NUMA_MAX_MEMBLKS];
+
+    uint32_t cpu_cnt;
+    struct boot_numa_cpu cpus[BOOT_NUMA_MAX_CPUS];
+
+    uint8_t distance[BOOT_NUMA_MAX_NODES][BOOT_NUMA_MAX_NODES];
+};
+
+extern struct boot_numa_info boot_numa_info;
+
+extern int boot_acpi_numa_init(multiboot_uint8_t *mbi);
+
+#endif // X86_BOOT_ACPI_H
@@ -0,0 +1,37 @@
+#ifndef X86_BOOT_MEMBLOCK_H
+#define X86_BOOT_MEMBLOCK_H
+
+#include <closureos/types.h>
+
+/* max number of regions for each type, enough for a general machine */
+#define BOOT_MEMBLOCK_MAX_REGIONS   128
+
+/* booting stage page table only maps first 512 GB memory */
+#define BOOT_MEMBLOCK_ALLOC_LIMIT   (512UL << 30)
+
+struct boot_memblock_region {
+    uint64_t base;
+    uint64_t size;
+};
+
+/* regions are sorted by base address and never overlap with each other */
+struct boot_memblock_type {
+    uint64_t cnt;
+    struct boot_memblock_region regions[BOOT_MEMBLOCK_MAX_REGIONS];
+};
+
+extern struct boot_memblock_type boot_memblock_memory;
+extern struct boot_memblock_type boot_memblock_reserved;
+
+extern int boot_memblock_add(uint64_t base, uint64_t size);
+extern int boot_memblock_reserve(uint64_t base, uint64_t size);
+extern int boot_memblock_free(uint64_t base, uint64_t size);
+
+extern uint64_t boot_memblock_alloc(uint64_t size, uint64_t align);
+
+extern bool boot_memblock_is_free(uint64_t addr);
+extern bool boot_memblock_next_free_range(uint64_t *cursor,
+                                          uint64_t *start,
+                                          uint64_t *end);
+
+#endif // X86_BOOT_MEMBLOCK_H
@@ -13,7 +13,7 @@ int __cxa_atexit(void (*destructor) (void *), void *arg, void *__dso_handle)
 {
     struct dtor_info *new_info;
     
-    new_info = new struct dtor_info;
+    new_info = (struct dtor_info*) mm::kmalloc<sizeof(struct dtor_info)>();
     if (new_info == nullptr) {
         return -ENOMEM;
     }
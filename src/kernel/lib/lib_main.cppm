@@ -2,3 +2,5 @@ export module kernel.lib;
 export import kernel.lib.atomic;
 export import kernel.lib.container;
 export import kernel.lib.list;
+export import kernel.lib.percpu;
+export import kernel.lib.rbtree;
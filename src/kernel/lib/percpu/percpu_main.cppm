@@ -0,0 +1,118 @@
+export module kernel.lib.percpu;
+
+import kernel.base;
+
+#include <closureos/compiler.h>
+
+export namespace lib {
+
+/**
+ * CPU-local primitives
+ */
+
+inline constexpr base::size_t NR_CPUS = 64;
+inline constexpr base::size_t CACHE_LINE_SIZE = 64;
+
+#ifdef CONFIG_HOSTED
+/**
+ * Hosted builds (e.g. tools/mmsim) take each thread as a CPU, which should
+ * set its own index before calling into the kernel code.
+ */
+auto hosted_cpu_id(void) -> base::size_t&;
+
+__always_inline auto smp_processor_id(void) -> base::size_t
+{
+    return hosted_cpu_id();
+}
+#else
+/**
+ * Index of the CPU we are running on.
+ *
+ * NOTE: only the BSP is running now, this should be replaced by a %gs-relative
+ * read after the SMP bring-up has been done.
+ */
+__always_inline auto smp_processor_id(void) -> base::size_t
+{
+    return 0;
+}
+#endif
+
+/* disable local interrupts, returning the old RFLAGS for restoring */
+__always_inline auto local_irq_save(void) -> base::size_t
+{
+    base::size_t flags;
+
+#ifdef CONFIG_HOSTED
+    /* no interrupts in a hosted process, and cli is privileged there */
+    flags = 0;
+#else
+
+    asm volatile (
+        "pushf;"
+        "pop    %0;"
+        "cli;"
+        : "=rm" (flags)
+        :
+        : "memory"
+    );
+#endif
+
+    return flags;
+}
+
+__always_inline auto local_irq_restore(base::size_t flags) -> void
+{
+#ifdef CONFIG_HOSTED
+    (void) flags;
+#else
+    asm volatile (
+        "push   %0;"
+        "popf;"
+        :
+        : "g" (flags)
+        : "memory", "cc"
+    );
+#endif
+}
+
+/**
+ * Per-CPU variable, each CPU owns a cache-line aligned copy of the data.
+ *
+ * Accessing the local copy is safe only when interrupts are disabled
+ * (and the task won't be migrated), as no lock is held there.
+ */
+template <typename DataType>
+class PerCPU {
+public:
+    __always_inline auto This(void) -> DataType*
+    {
+        return &this->slots[smp_processor_id()].data;
+    }
+
+    __always_inline auto Of(base::size_t cpu) -> DataType*
+    {
+        return &this->slots[cpu].data;
+    }
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        DataType data;
+    };
+
+    Slot slots[NR_CPUS];
+};
+
+};
+
+#ifdef CONFIG_HOSTED
+namespace lib {
+
+static thread_local base::size_t hosted_cpu;
+
+auto hosted_cpu_id(void) -> base::size_t&
+{
+    return hosted_cpu;
+}
+
+};
+#endif
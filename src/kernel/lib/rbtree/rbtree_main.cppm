@@ -0,0 +1,511 @@
+export module kernel.lib.rbtree;
+
+import kernel.base;
+import kernel.lib.container;
+
+#include <closureos/compiler.h>
+
+export namespace lib {
+
+/**
+ * Intrusive red-black tree.
+ *
+ * The color is stored in the lowest bit of the parent pointer. Users search
+ * for the place and link the node with rb_link_node() by themselves, and then
+ * call rb_insert_color() to rebalance the tree.
+ *
+ * Augmented trees keep extra data on each node that is computed from its
+ * subtrees (e.g. the max value in the subtree), which is maintained through
+ * the RBAugmentCallbacks during rebalancing.
+ */
+
+struct RBNode {
+    base::size_t parent_color;
+    RBNode *right;
+    RBNode *left;
+};
+
+struct RBRoot {
+    RBNode *node;
+};
+
+inline constexpr base::size_t RB_RED = 0;
+inline constexpr base::size_t RB_BLACK = 1;
+
+struct RBAugmentCallbacks {
+    /* recompute from `node` up to (but not including) `stop` */
+    void (*propagate)(RBNode *node, RBNode *stop);
+    /* `new_node` takes the place of `old_node` */
+    void (*copy)(RBNode *old_node, RBNode *new_node);
+    /* `new_node` is rotated to be the parent of `old_node` */
+    void (*rotate)(RBNode *old_node, RBNode *new_node);
+};
+
+__always_inline auto rb_parent(const RBNode *node) -> RBNode*
+{
+    return (RBNode*) (node->parent_color & ~3UL);
+}
+
+__always_inline auto rb_is_red(const RBNode *node) -> bool
+{
+    return !(node->parent_color & RB_BLACK);
+}
+
+__always_inline auto rb_is_black(const RBNode *node) -> bool
+{
+    return node->parent_color & RB_BLACK;
+}
+
+__always_inline auto rb_root_init(RBRoot *root) -> void
+{
+    root->node = nullptr;
+}
+
+__always_inline auto rb_empty(RBRoot *root) -> bool
+{
+    return root->node == nullptr;
+}
+
+/* link the node as a red leaf at `link`, which is a child pointer of `parent` */
+__always_inline auto rb_link_node(RBNode *node, RBNode *parent, RBNode **link) -> void
+{
+    node->parent_color = (base::size_t) parent;
+    node->left = node->right = nullptr;
+    *link = node;
+}
+
+template <typename NodePtrType, typename ContainerType, typename MemberType>
+__always_inline auto rb_entry(NodePtrType *ptr, const MemberType ContainerType::* member) -> ContainerType*
+{
+    return container_of(ptr, member);
+}
+
+/* internal helpers */
+
+__always_inline auto __rb_set_parent(RBNode *node, RBNode *parent) -> void
+{
+    node->parent_color = (node->parent_color & RB_BLACK) | (base::size_t) parent;
+}
+
+__always_inline auto __rb_set_parent_color(RBNode *node, RBNode *parent, base::size_t color) -> void
+{
+    node->parent_color = (base::size_t) parent | color;
+}
+
+__always_inline auto __rb_change_child(RBNode *old_node, RBNode *new_node, RBNode *parent, RBRoot *root) -> void
+{
+    if (parent) {
+        if (parent->left == old_node) {
+            parent->left = new_node;
+        } else {
+            parent->right = new_node;
+        }
+    } else {
+        root->node = new_node;
+    }
+}
+
+/* `new_node` takes the parent and the color of `old_node`, which becomes its child */
+__always_inline auto __rb_rotate_set_parents(RBNode *old_node, RBNode *new_node, RBRoot *root, base::size_t color) -> void
+{
+    RBNode *parent = rb_parent(old_node);
+
+    new_node->parent_color = old_node->parent_color;
+    __rb_set_parent_color(old_node, new_node, color);
+    __rb_change_child(old_node, new_node, parent, root);
+}
+
+static auto __rb_dummy_propagate(RBNode *node, RBNode *stop) -> void {}
+static auto __rb_dummy_copy(RBNode *old_node, RBNode *new_node) -> void {}
+static auto __rb_dummy_rotate(RBNode *old_node, RBNode *new_node) -> void {}
+
+const RBAugmentCallbacks rb_dummy_callbacks = {
+    .propagate = __rb_dummy_propagate,
+    .copy = __rb_dummy_copy,
+    .rotate = __rb_dummy_rotate,
+};
+
+/* rebalance after inserting the red `node` */
+auto __rb_insert(RBNode *node, RBRoot *root, void (*augment_rotate)(RBNode*, RBNode*)) -> void
+{
+    RBNode *parent = rb_parent(node), *gparent, *tmp;
+
+    while (true) {
+        /* the root is always black */
+        if (!parent) {
+            __rb_set_parent_color(node, nullptr, RB_BLACK);
+            break;
+        }
+
+        if (rb_is_black(parent)) {
+            break;
+        }
+
+        gparent = rb_parent(parent);
+
+        tmp = gparent->right;
+        if (parent != tmp) {    /* parent == gparent->left */
+            /* uncle is red: flip colors and go up */
+            if (tmp && rb_is_red(tmp)) {
+                __rb_set_parent_color(tmp, gparent, RB_BLACK);
+                __rb_set_parent_color(parent, gparent, RB_BLACK);
+                node = gparent;
+                parent = rb_parent(node);
+                __rb_set_parent_color(node, parent, RB_RED);
+                continue;
+            }
+
+            /* node is the right child: left rotate at parent */
+            tmp = parent->right;
+            if (node == tmp) {
+                tmp = node->left;
+                parent->right = tmp;
+                node->left = parent;
+                if (tmp) {
+                    __rb_set_parent_color(tmp, parent, RB_BLACK);
+                }
+                __rb_set_parent_color(parent, node, RB_RED);
+                augment_rotate(parent, node);
+                parent = node;
+                tmp = node->right;
+            }
+
+            /* right rotate at gparent */
+            gparent->left = tmp;
+            parent->right = gparent;
+            if (tmp) {
+                __rb_set_parent_color(tmp, gparent, RB_BLACK);
+            }
+            __rb_rotate_set_parents(gparent, parent, root, RB_RED);
+            augment_rotate(gparent, parent);
+            break;
+        } else {
+            tmp = gparent->left;
+            if (tmp && rb_is_red(tmp)) {
+                __rb_set_parent_color(tmp, gparent, RB_BLACK);
+                __rb_set_parent_color(parent, gparent, RB_BLACK);
+                node = gparent;
+                parent = rb_parent(node);
+                __rb_set_parent_color(node, parent, RB_RED);
+                continue;
+            }
+
+            tmp = parent->left;
+            if (node == tmp) {
+                tmp = node->right;
+                parent->left = tmp;
+                node->right = parent;
+                if (tmp) {
+                    __rb_set_parent_color(tmp, parent, RB_BLACK);
+                }
+                __rb_set_parent_color(parent, node, RB_RED);
+                augment_rotate(parent, node);
+                parent = node;
+                tmp = node->left;
+            }
+
+            gparent->right = tmp;
+            parent->left = gparent;
+            if (tmp) {
+                __rb_set_parent_color(tmp, gparent, RB_BLACK);
+            }
+            __rb_rotate_set_parents(gparent, parent, root, RB_RED);
+            augment_rotate(gparent, parent);
+            break;
+        }
+    }
+}
+
+/* rebalance after a black node is removed under `parent` */
+auto __rb_erase_color(RBNode *parent, RBRoot *root, void (*augment_rotate)(RBNode*, RBNode*)) -> void
+{
+    RBNode *node = nullptr, *sibling, *tmp1, *tmp2;
+
+    while (true) {
+        sibling = parent->right;
+        if (node != sibling) {  /* node == parent->left */
+            /* red sibling: left rotate at parent */
+            if (rb_is_red(sibling)) {
+                tmp1 = sibling->left;
+                parent->right = tmp1;
+                sibling->left = parent;
+                __rb_set_parent_color(tmp1, parent, RB_BLACK);
+                __rb_rotate_set_parents(parent, sibling, root, RB_RED);
+                augment_rotate(parent, sibling);
+                sibling = tmp1;
+            }
+
+            tmp1 = sibling->right;
+            if (!tmp1 || rb_is_black(tmp1)) {
+                tmp2 = sibling->left;
+                /* both nephews are black: recolor and go up */
+                if (!tmp2 || rb_is_black(tmp2)) {
+                    __rb_set_parent_color(sibling, parent, RB_RED);
+                    if (rb_is_red(parent)) {
+                        parent->parent_color |= RB_BLACK;
+                    } else {
+                        node = parent;
+                        parent = rb_parent(node);
+                        if (parent) {
+                            continue;
+                        }
+                    }
+                    break;
+                }
+
+                /* right rotate at sibling */
+                tmp1 = tmp2->right;
+                sibling->left = tmp1;
+                tmp2->right = sibling;
+                parent->right = tmp2;
+                if (tmp1) {
+                    __rb_set_parent_color(tmp1, sibling, RB_BLACK);
+                }
+                augment_rotate(sibling, tmp2);
+                tmp1 = sibling;
+                sibling = tmp2;
+            }
+
+            /* left rotate at parent */
+            tmp2 = sibling->left;
+            parent->right = tmp2;
+            sibling->left = parent;
+            __rb_set_parent_color(tmp1, sibling, RB_BLACK);
+            if (tmp2) {
+                __rb_set_parent(tmp2, parent);
+            }
+            __rb_rotate_set_parents(parent, sibling, root, RB_BLACK);
+            augment_rotate(parent, sibling);
+            break;
+        } else {
+            sibling = parent->left;
+            if (rb_is_red(sibling)) {
+                tmp1 = sibling->right;
+                parent->left = tmp1;
+                sibling->right = parent;
+                __rb_set_parent_color(tmp1, parent, RB_BLACK);
+                __rb_rotate_set_parents(parent, sibling, root, RB_RED);
+                augment_rotate(parent, sibling);
+                sibling = tmp1;
+            }
+
+            tmp1 = sibling->left;
+            if (!tmp1 || rb_is_black(tmp1)) {
+                tmp2 = sibling->right;
+                if (!tmp2 || rb_is_black(tmp2)) {
+                    __rb_set_parent_color(sibling, parent, RB_RED);
+                    if (rb_is_red(parent)) {
+                        parent->parent_color |= RB_BLACK;
+                    } else {
+                        node = parent;
+                        parent = rb_parent(node);
+                        if (parent) {
+                            continue;
+                        }
+                    }
+                    break;
+                }
+
+                tmp1 = tmp2->left;
+                sibling->right = tmp1;
+                tmp2->left = sibling;
+                parent->left = tmp2;
+                if (tmp1) {
+                    __rb_set_parent_color(tmp1, sibling, RB_BLACK);
+                }
+                augment_rotate(sibling, tmp2);
+                tmp1 = sibling;
+                sibling = tmp2;
+            }
+
+            tmp2 = sibling->right;
+            parent->left = tmp2;
+            sibling->right = parent;
+            __rb_set_parent_color(tmp1, sibling, RB_BLACK);
+            if (tmp2) {
+                __rb_set_parent(tmp2, parent);
+            }
+            __rb_rotate_set_parents(parent, sibling, root, RB_BLACK);
+            augment_rotate(parent, sibling);
+            break;
+        }
+    }
+}
+
+/* unlink the node, returning where the rebalancing should start from */
+auto __rb_erase_augmented(RBNode *node, RBRoot *root, const RBAugmentCallbacks *augment) -> RBNode*
+{
+    RBNode *child = node->right, *tmp = node->left;
+    RBNode *parent, *rebalance;
+    base::size_t pc;
+
+    if (!tmp) {
+        /* at most one (right) child, it must be red if it exists */
+        pc = node->parent_color;
+        parent = (RBNode*) (pc & ~3UL);
+        __rb_change_child(node, child, parent, root);
+        if (child) {
+            child->parent_color = pc;
+            rebalance = nullptr;
+        } else {
+            rebalance = (pc & RB_BLACK) ? parent : nullptr;
+        }
+        tmp = parent;
+    } else if (!child) {
+        /* only the left child, which must be red */
+        tmp->parent_color = pc = node->parent_color;
+        parent = (RBNode*) (pc & ~3UL);
+        __rb_change_child(node, tmp, parent, root);
+        rebalance = nullptr;
+        tmp = parent;
+    } else {
+        /* replace the node with its successor */
+        RBNode *successor = child, *child2;
+
+        tmp = child->left;
+        if (!tmp) {
+            parent = successor;
+            child2 = successor->right;
+            augment->copy(node, successor);
+        } else {
+            do {
+                parent = successor;
+                successor = tmp;
+                tmp = tmp->left;
+            } while (tmp);
+
+            child2 = successor->right;
+            parent->left = child2;
+            successor->right = child;
+            __rb_set_parent(child, successor);
+            augment->copy(node, successor);
+            augment->propagate(parent, successor);
+        }
+
+        tmp = node->left;
+        successor->left = tmp;
+        __rb_set_parent(tmp, successor);
+
+        pc = node->parent_color;
+        tmp = (RBNode*) (pc & ~3UL);
+        __rb_change_child(node, successor, tmp, root);
+
+        if (child2) {
+            __rb_set_parent_color(child2, parent, RB_BLACK);
+            rebalance = nullptr;
+        } else {
+            rebalance = rb_is_black(successor) ? parent : nullptr;
+        }
+
+        successor->parent_color = pc;
+        tmp = successor;
+    }
+
+    augment->propagate(tmp, nullptr);
+
+    return rebalance;
+}
+
+/**
+ * Augmented insertion, the caller should have set the augmented data of the
+ * node and propagated it to its ancestors before calling this.
+ */
+auto rb_insert_augmented(RBNode *node, RBRoot *root, const RBAugmentCallbacks *augment) -> void
+{
+    __rb_insert(node, root, augment->rotate);
+}
+
+auto rb_erase_augmented(RBNode *node, RBRoot *root, const RBAugmentCallbacks *augment) -> void
+{
+    RBNode *rebalance = __rb_erase_augmented(node, root, augment);
+
+    if (rebalance) {
+        __rb_erase_color(rebalance, root, augment->rotate);
+    }
+}
+
+auto rb_insert_color(RBNode *node, RBRoot *root) -> void
+{
+    __rb_insert(node, root, rb_dummy_callbacks.rotate);
+}
+
+auto rb_erase(RBNode *node, RBRoot *root) -> void
+{
+    rb_erase_augmented(node, root, &rb_dummy_callbacks);
+}
+
+/* in-order iteration */
+
+auto rb_first(const RBRoot *root) -> RBNode*
+{
+    RBNode *node = root->node;
+
+    if (!node) {
+        return nullptr;
+    }
+
+    while (node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+auto rb_last(const RBRoot *root) -> RBNode*
+{
+    RBNode *node = root->node;
+
+    if (!node) {
+        return nullptr;
+    }
+
+    while (node->right) {
+        node = node->right;
+    }
+
+    return node;
+}
+
+auto rb_next(const RBNode *node) -> RBNode*
+{
+    RBNode *parent;
+
+    /* the leftmost node of the right subtree */
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+
+        return (RBNode*) node;
+    }
+
+    /* or the first ancestor that we're on the left of */
+    while ((parent = rb_parent(node)) && node == parent->right) {
+        node = parent;
+    }
+
+    return parent;
+}
+
+auto rb_prev(const RBNode *node) -> RBNode*
+{
+    RBNode *parent;
+
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+
+        return (RBNode*) node;
+    }
+
+    while ((parent = rb_parent(node)) && node == parent->left) {
+        node = parent;
+    }
+
+    return parent;
+}
+
+};
@@ -36,6 +36,11 @@ auto main(multiboot_uint8_t *mbi) -> void
     }
 
     while (1) {
+        /* do background jobs before we fall asleep */
+        mm::balance_page_pools();
+        mm::refill_zeroed_pages();
+        mm::kmalloc_adapt_size_classes();
+
         boot_puts("[x] No work todo, hlting...");
         asm volatile ("hlt");
     }
@@ -0,0 +1,742 @@
+export module kernel.mm:dma;
+
+import :heap;
+import :layout;
+import :pages;
+import :types;
+import kernel.base;
+import kernel.lib;
+
+#include <closureos/compiler.h>
+#include <closureos/errno.h>
+#include <asm/page.h>
+#include <asm/page_types.h>
+
+export namespace mm {
+
+/**
+ * DMA mapping for devices.
+ *
+ * - there's no IOMMU support yet, devices see physical addresses directly,
+ *   so mapping is only translating and checking against the device's mask,
+ *   and a request out of the mask fails as we don't have bounce buffers
+ * - DMA on x86 is coherent with CPU caches, so nothing is synchronized
+ * - large coherent buffers come from the CMA area, which lends its pages to
+ *   movable allocations and migrates them out on demand, so that they don't
+ *   depend on the buddy system being unfragmented
+ * - small coherent blocks, e.g. descriptors of rings, are carved from pages
+ *   of DMA pools
+ */
+
+enum dma_data_direction {
+    DMA_BIDIRECTIONAL = 0,
+    DMA_TO_DEVICE,
+    DMA_FROM_DEVICE,
+    DMA_NONE,
+};
+
+inline constexpr dma_addr_t DMA_MAPPING_ERROR = ~0UL;
+
+__always_inline constexpr auto dma_bit_mask(base::size_t n) -> base::uint64_t
+{
+    return (n >= 64) ? ~0ULL : ((1ULL << n) - 1);
+}
+
+/* what the DMA API needs to know about a device, embedded by drivers */
+struct DMADevice {
+    base::uint64_t dma_mask;            /* for streaming mappings */
+    base::uint64_t coherent_dma_mask;   /* for coherent buffers */
+    base::size_t max_segment_size;      /* of merged sg segments, 0 for no limit */
+    base::size_t nid;                   /* node the device is attached to */
+};
+
+/* coherent buffers of this order or larger are taken from the CMA area first */
+inline constexpr base::size_t DMA_CMA_MIN_ORDER = PCP_MAX_ORDER + 1;
+
+/* CMA ranges are aligned to their orders, but not beyond this */
+inline constexpr base::size_t CMA_ALIGN_MAX_ORDER = 8;
+
+/* the default CMA area, which is never larger than 1/8 of the memory */
+inline constexpr base::size_t CMA_DEFAULT_PAGES = ((16UL << 20) >> PAGE_SHIFT);
+inline constexpr base::size_t CMA_MAX_RATIO_SHIFT = 3;
+
+struct CMAStat {
+    pfn_t base_pfn;
+    base::size_t count;
+    base::size_t used;
+};
+
+/**
+ * A range of CMA pageblocks of a pool, of which ranges taken by us are
+ * tracked in a bitmap. A range is marked before pages in it are taken, so
+ * that the lock isn't held while migrating.
+ */
+class CMAArea {
+public:
+    auto Init(PagePool *pool, pfn_t base_pfn, base::size_t count) -> int;
+
+    auto Alloc(base::size_t count, base::size_t align_order) -> Page*;
+    auto Free(Page *page, base::size_t count) -> bool;
+    auto GetStat(CMAStat *stat) -> void;
+
+private:
+    PagePool *pool;
+    pfn_t base_pfn;
+    base::size_t count;
+    base::size_t used;
+    base::size_t *bitmap;
+    lib::atomic::SpinLock lock;
+
+    auto __find_range(base::size_t start, base::size_t count, base::size_t mask) -> base::size_t;
+    auto __set_range(base::size_t start, base::size_t count, bool used) -> void;
+};
+
+/* to avoid calling global initializer, we manually point it to mem */
+base::uint8_t GloblCMAAreaMem[sizeof(CMAArea)];
+CMAArea *GloblCMAArea = (CMAArea*) &GloblCMAAreaMem;
+
+inline constexpr base::size_t BITS_PER_WORD = (sizeof(base::size_t) * 8);
+
+auto CMAArea::Init(PagePool *pool, pfn_t base_pfn, base::size_t count) -> int
+{
+    base::size_t words = (count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    this->bitmap = (base::size_t*) GloblKHeapPool->Malloc(words * sizeof(base::size_t));
+    if (!this->bitmap) {
+        return -ENOMEM;
+    }
+
+    for (base::size_t i = 0; i < words; i++) {
+        this->bitmap[i] = 0;
+    }
+
+    this->pool = pool;
+    this->base_pfn = base_pfn;
+    this->count = count;
+    this->used = 0;
+    this->lock.Reset();
+
+    return 0;
+}
+
+/* the first range of free bits at or after `start`, aligned to `mask + 1` */
+auto CMAArea::__find_range(base::size_t start, base::size_t count, base::size_t mask) -> base::size_t
+{
+    base::size_t i, found = 0;
+
+    start = (start + mask) & ~mask;
+
+    for (i = start; i < this->count && found < count; i++) {
+        if (this->bitmap[i / BITS_PER_WORD] & (1UL << (i % BITS_PER_WORD))) {
+            found = 0;
+            i |= mask;
+        } else {
+            found++;
+        }
+    }
+
+    return (found == count) ? (i - count) : this->count;
+}
+
+auto CMAArea::__set_range(base::size_t start, base::size_t count, bool used) -> void
+{
+    for (base::size_t i = start; i < start + count; i++) {
+        if (used) {
+            this->bitmap[i / BITS_PER_WORD] |= (1UL << (i % BITS_PER_WORD));
+        } else {
+            this->bitmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+        }
+    }
+
+    if (used) {
+        this->used += count;
+    } else {
+        this->used -= count;
+    }
+}
+
+/**
+ * Take `count` contiguous pages aligned to `align_order`, returned as the
+ * first of them. Ranges with busy pages are skipped, so it may sleep for a
+ * while on migrating, and must not be called in atomic context.
+ */
+auto CMAArea::Alloc(base::size_t count, base::size_t align_order) -> Page*
+{
+    base::size_t mask, start = 0, flags;
+    int ret;
+
+    if (!this->count || !count || count > this->count) {
+        return nullptr;
+    }
+
+    /* the area is aligned to CMA_BLOCK_PAGES, so are offsets in it */
+    if (align_order > CMA_ALIGN_MAX_ORDER) {
+        align_order = CMA_ALIGN_MAX_ORDER;
+    }
+    mask = (1UL << align_order) - 1;
+
+    for (;;) {
+        flags = lib::local_irq_save();
+        this->lock.Lock();
+
+        start = this->__find_range(start, count, mask);
+        if (start == this->count) {
+            this->lock.UnLock();
+            lib::local_irq_restore(flags);
+            return nullptr;
+        }
+
+        this->__set_range(start, count, true);
+
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+
+        ret = this->pool->AllocContigRange(this->base_pfn + start, this->base_pfn + start + count);
+        if (ret == 0) {
+            return pfn_to_page(this->base_pfn + start);
+        }
+
+        flags = lib::local_irq_save();
+        this->lock.Lock();
+        this->__set_range(start, count, false);
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+
+        if (ret != -EBUSY) {
+            return nullptr;
+        }
+
+        /* some pages in the range are pinned, try the next one */
+        start += mask + 1;
+    }
+}
+
+/* give back pages from Alloc(), returning false if they're not ours */
+auto CMAArea::Free(Page *page, base::size_t count) -> bool
+{
+    pfn_t pfn = page_to_pfn(page);
+    base::size_t flags;
+
+    if (pfn < this->base_pfn || (pfn + count) > (this->base_pfn + this->count)) {
+        return false;
+    }
+
+    this->pool->FreeContigRange(pfn, pfn + count);
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+    this->__set_range(pfn - this->base_pfn, count, false);
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return true;
+}
+
+/* it's just statistics, so we don't take the lock */
+auto CMAArea::GetStat(CMAStat *stat) -> void
+{
+    stat->base_pfn = this->base_pfn;
+    stat->count = this->count;
+    stat->used = this->used;
+}
+
+/**
+ * Reserve the CMA area at booting stage, from memory below 4GB if possible
+ * so that it could serve devices with 32-bit masks as well.
+ */
+auto cma_init(base::size_t nr) -> int
+{
+    PagePool *pools[] = {
+        node_page_pool(0, PAGE_POOL_TYPE_DMA32),
+        node_page_pool(0, PAGE_POOL_TYPE_NORMAL),
+    };
+    base::size_t count;
+    pfn_t base_pfn;
+
+    for (auto pool : pools) {
+        count = pool->ManagedPages() >> CMA_MAX_RATIO_SHIFT;
+        count = (nr < count) ? nr : count;
+        count &= ~(CMA_BLOCK_PAGES - 1);
+
+        if (count && pool->ReserveCMA(count, &base_pfn) == 0) {
+            return GloblCMAArea->Init(pool, base_pfn, count);
+        }
+    }
+
+    return -ENOMEM;
+}
+
+/* a coherent buffer fits the mask only if all its bytes fit */
+__always_inline auto dma_capable(base::uint64_t mask, dma_addr_t addr, base::size_t size) -> bool
+{
+    return (addr + size - 1) <= mask;
+}
+
+__always_inline auto dma_size_order(base::size_t size) -> base::size_t
+{
+    base::size_t order = 0;
+
+    while ((PAGE_SIZE << order) < size) {
+        order++;
+    }
+
+    return order;
+}
+
+/**
+ * Allocate a zeroed buffer for both of the CPU and the device, returning
+ * its virtual address, and the address for the device through `handle`.
+ */
+auto dma_alloc_coherent(DMADevice *dev, base::size_t size, dma_addr_t *handle, gfp_t flags = GFP_KERNEL) -> void*
+{
+    base::size_t order, nr;
+    Page *page = nullptr;
+
+    /* we don't have a zone for devices that can't even reach 4GB */
+    if (!size || dev->coherent_dma_mask < dma_bit_mask(32)) {
+        return nullptr;
+    }
+
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    nr = size >> PAGE_SHIFT;
+    order = dma_size_order(size);
+
+    /* CMA pages are only for us, never ask the buddy for them */
+    flags &= ~(__GFP_MOVABLE | __GFP_RECLAIMABLE);
+    if (dev->coherent_dma_mask == dma_bit_mask(32)) {
+        flags |= __GFP_DMA32;
+    }
+
+    if (order >= DMA_CMA_MIN_ORDER && !(flags & __GFP_ATOMIC)) {
+        page = GloblCMAArea->Alloc(nr, order);
+
+        if (page && !dma_capable(dev->coherent_dma_mask, page_to_phys(page), size)) {
+            GloblCMAArea->Free(page, nr);
+            page = nullptr;
+        }
+
+        if (page) {
+            for (base::size_t i = 0; i < nr; i++) {
+                clear_page((void*) page_to_virt(&page[i]));
+            }
+        }
+    }
+
+    if (!page) {
+        page = alloc_pages_node(dev->nid, order, flags | __GFP_ZERO);
+
+        /* the mask is wider than 4GB but still can't reach all memory */
+        if (page && !dma_capable(dev->coherent_dma_mask, page_to_phys(page), size)) {
+            free_pages(page, order);
+            page = (flags & __GFP_DMA32) ? nullptr
+                                         : alloc_pages_node(dev->nid, order, flags | __GFP_DMA32 | __GFP_ZERO);
+        }
+    }
+
+    if (!page) {
+        return nullptr;
+    }
+
+    *handle = page_to_phys(page);
+
+    return (void*) page_to_virt(page);
+}
+
+auto dma_free_coherent(DMADevice *dev, base::size_t size, void *cpu_addr, dma_addr_t handle) -> void
+{
+    Page *page = virt_to_page((virt_addr_t) cpu_addr);
+    base::size_t nr;
+
+    (void) dev;
+    (void) handle;
+
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    nr = size >> PAGE_SHIFT;
+
+    if (!GloblCMAArea->Free(page, nr)) {
+        free_pages(page, dma_size_order(size));
+    }
+}
+
+/**
+ * Pools of small coherent blocks of the same size, carved from coherent
+ * chunks. Free blocks of a chunk are linked by offsets stored in them, and
+ * no block crosses `boundary`, as some devices require.
+ */
+struct DMAPoolChunk {
+    lib::ListHead list;
+    void *vaddr;
+    dma_addr_t dma;
+    base::size_t in_use;
+    base::size_t free_offset;   /* of the first free block, chunk size if none */
+};
+
+class DMAPool {
+public:
+    auto Init(const char *name, DMADevice *dev, base::size_t size, base::size_t align, base::size_t boundary) -> int;
+    auto Destroy(void) -> int;
+
+    auto Alloc(gfp_t flags, dma_addr_t *handle) -> void*;
+    auto Free(void *vaddr, dma_addr_t dma) -> void;
+
+private:
+    const char *name;
+    DMADevice *dev;
+    base::size_t size;
+    base::size_t chunk_size;
+    base::size_t boundary;
+    lib::ListHead chunk_list;
+    lib::atomic::SpinLock lock;
+
+    auto __alloc_chunk(gfp_t flags) -> DMAPoolChunk*;
+    auto __find_chunk(virt_addr_t addr) -> DMAPoolChunk*;
+};
+
+auto DMAPool::Init(const char *name, DMADevice *dev, base::size_t size, base::size_t align, base::size_t boundary) -> int
+{
+    if (!size || (align & (align - 1)) || (boundary & (boundary - 1))) {
+        return -EINVAL;
+    }
+
+    /* a free block holds the offset of the next one */
+    if (align < sizeof(base::size_t)) {
+        align = sizeof(base::size_t);
+    }
+    size = (size + align - 1) & ~(align - 1);
+
+    this->chunk_size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (!boundary) {
+        boundary = this->chunk_size;
+    } else if (boundary < size) {
+        return -EINVAL;
+    }
+
+    this->name = name;
+    this->dev = dev;
+    this->size = size;
+    this->boundary = (boundary < this->chunk_size) ? boundary : this->chunk_size;
+    lib::list_head_init(&this->chunk_list);
+    this->lock.Reset();
+
+    return 0;
+}
+
+/* a new chunk with all blocks free, allocated without the lock held */
+auto DMAPool::__alloc_chunk(gfp_t flags) -> DMAPoolChunk*
+{
+    base::size_t offset = 0, next, next_boundary = this->boundary;
+    DMAPoolChunk *chunk;
+
+    chunk = (DMAPoolChunk*) kmalloc<sizeof(DMAPoolChunk)>();
+    if (!chunk) {
+        return nullptr;
+    }
+
+    chunk->vaddr = dma_alloc_coherent(this->dev, this->chunk_size, &chunk->dma, flags);
+    if (!chunk->vaddr) {
+        GloblKHeapPool->Free(chunk);
+        return nullptr;
+    }
+
+    do {
+        next = offset + this->size;
+        if ((next + this->size) > next_boundary) {
+            next = next_boundary;
+            next_boundary += this->boundary;
+        }
+
+        *(base::size_t*) ((virt_addr_t) chunk->vaddr + offset) = next;
+        offset = next;
+    } while (offset < this->chunk_size);
+
+    chunk->in_use = 0;
+    chunk->free_offset = 0;
+
+    return chunk;
+}
+
+auto DMAPool::__find_chunk(virt_addr_t addr) -> DMAPoolChunk*
+{
+    for (lib::ListHead *l = this->chunk_list.next; l != &this->chunk_list; l = l->next) {
+        DMAPoolChunk *chunk = lib::list_entry(l, &DMAPoolChunk::list);
+
+        if (addr >= (virt_addr_t) chunk->vaddr && addr < ((virt_addr_t) chunk->vaddr + this->chunk_size)) {
+            return chunk;
+        }
+    }
+
+    return nullptr;
+}
+
+auto DMAPool::Alloc(gfp_t flags, dma_addr_t *handle) -> void*
+{
+    DMAPoolChunk *chunk = nullptr, *new_chunk = nullptr;
+    base::size_t offset, irq_flags;
+
+    irq_flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    for (lib::ListHead *l = this->chunk_list.next; l != &this->chunk_list; l = l->next) {
+        chunk = lib::list_entry(l, &DMAPoolChunk::list);
+        if (chunk->free_offset < this->chunk_size) {
+            break;
+        }
+        chunk = nullptr;
+    }
+
+    if (!chunk) {
+        this->lock.UnLock();
+        lib::local_irq_restore(irq_flags);
+
+        new_chunk = this->__alloc_chunk(flags);
+        if (!new_chunk) {
+            return nullptr;
+        }
+
+        irq_flags = lib::local_irq_save();
+        this->lock.Lock();
+
+        chunk = new_chunk;
+        lib::list_add_next(&this->chunk_list, &chunk->list);
+    }
+
+    offset = chunk->free_offset;
+    chunk->free_offset = *(base::size_t*) ((virt_addr_t) chunk->vaddr + offset);
+    chunk->in_use++;
+
+    this->lock.UnLock();
+    lib::local_irq_restore(irq_flags);
+
+    *handle = chunk->dma + offset;
+
+    return (void*) ((virt_addr_t) chunk->vaddr + offset);
+}
+
+/* chunks are kept until the pool is destroyed, as the device is still alive */
+auto DMAPool::Free(void *vaddr, dma_addr_t dma) -> void
+{
+    base::size_t offset, irq_flags;
+    DMAPoolChunk *chunk;
+
+    irq_flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    chunk = this->__find_chunk((virt_addr_t) vaddr);
+    if (!chunk) {
+        this->lock.UnLock();
+        lib::local_irq_restore(irq_flags);
+        return;
+    }
+
+    offset = (virt_addr_t) vaddr - (virt_addr_t) chunk->vaddr;
+    (void) dma;
+
+    *(base::size_t*) vaddr = chunk->free_offset;
+    chunk->free_offset = offset;
+    chunk->in_use--;
+
+    this->lock.UnLock();
+    lib::local_irq_restore(irq_flags);
+}
+
+/* release all chunks, fails with -EBUSY if any block is still in use */
+auto DMAPool::Destroy(void) -> int
+{
+    DMAPoolChunk *chunk;
+
+    for (lib::ListHead *l = this->chunk_list.next; l != &this->chunk_list; l = l->next) {
+        if (lib::list_entry(l, &DMAPoolChunk::list)->in_use) {
+            return -EBUSY;
+        }
+    }
+
+    while (!lib::list_empty(&this->chunk_list)) {
+        chunk = lib::list_entry(this->chunk_list.next, &DMAPoolChunk::list);
+        lib::list_del(&chunk->list);
+
+        dma_free_coherent(this->dev, this->chunk_size, chunk->vaddr, chunk->dma);
+        GloblKHeapPool->Free(chunk);
+    }
+
+    return 0;
+}
+
+auto dma_pool_create(const char *name, DMADevice *dev, base::size_t size, base::size_t align, base::size_t boundary = 0) -> DMAPool*
+{
+    DMAPool *pool = (DMAPool*) kmalloc<sizeof(DMAPool)>();
+
+    if (pool && pool->Init(name, dev, size, align, boundary) < 0) {
+        GloblKHeapPool->Free(pool);
+        pool = nullptr;
+    }
+
+    return pool;
+}
+
+auto dma_pool_destroy(DMAPool *pool) -> int
+{
+    int ret;
+
+    if (!pool) {
+        return 0;
+    }
+
+    ret = pool->Destroy();
+    if (ret == 0) {
+        GloblKHeapPool->Free(pool);
+    }
+
+    return ret;
+}
+
+auto dma_pool_alloc(DMAPool *pool, gfp_t flags, dma_addr_t *handle) -> void*
+{
+    return pool->Alloc(flags, handle);
+}
+
+auto dma_pool_free(DMAPool *pool, void *vaddr, dma_addr_t dma) -> void
+{
+    pool->Free(vaddr, dma);
+}
+
+/**
+ * Scatter-gather lists are plain arrays of entries. On mapping, entries
+ * physically next to each other are merged into one DMA segment, so there
+ * may be fewer segments than entries.
+ */
+struct ScatterList {
+    Page *page;
+    base::uint32_t offset;
+    base::uint32_t length;
+    dma_addr_t dma_address;     /* set by dma_map_sg() */
+    base::uint32_t dma_length;
+};
+
+__always_inline auto sg_init_table(ScatterList *sgl, base::size_t nents) -> void
+{
+    for (base::size_t i = 0; i < nents; i++) {
+        sgl[i].page = nullptr;
+        sgl[i].offset = sgl[i].length = 0;
+        sgl[i].dma_address = DMA_MAPPING_ERROR;
+        sgl[i].dma_length = 0;
+    }
+}
+
+__always_inline auto sg_set_page(ScatterList *sg, Page *page, base::uint32_t length, base::uint32_t offset) -> void
+{
+    sg->page = page;
+    sg->offset = offset;
+    sg->length = length;
+}
+
+/* the buffer must be in the direct mapping, use sg_set_page() for vmalloc() */
+__always_inline auto sg_set_buf(ScatterList *sg, const void *buf, base::uint32_t length) -> void
+{
+    sg_set_page(sg, virt_to_page((virt_addr_t) buf), length, (virt_addr_t) buf & ~PAGE_MASK);
+}
+
+__always_inline auto sg_phys(ScatterList *sg) -> phys_addr_t
+{
+    return page_to_phys(sg->page) + sg->offset;
+}
+
+__always_inline auto sg_virt(ScatterList *sg) -> void*
+{
+    return (void*) (page_to_virt(sg->page) + sg->offset);
+}
+
+__always_inline auto sg_dma_address(ScatterList *sg) -> dma_addr_t
+{
+    return sg->dma_address;
+}
+
+__always_inline auto sg_dma_len(ScatterList *sg) -> base::uint32_t
+{
+    return sg->dma_length;
+}
+
+__always_inline auto dma_mapping_error(DMADevice *dev, dma_addr_t addr) -> bool
+{
+    (void) dev;
+
+    return addr == DMA_MAPPING_ERROR;
+}
+
+auto dma_map_page(DMADevice *dev, Page *page, base::size_t offset, base::size_t size, dma_data_direction dir) -> dma_addr_t
+{
+    dma_addr_t addr = page_to_phys(page) + offset;
+
+    (void) dir;
+
+    if (!dma_capable(dev->dma_mask, addr, size)) {
+        return DMA_MAPPING_ERROR;
+    }
+
+    return addr;
+}
+
+auto dma_unmap_page(DMADevice *dev, dma_addr_t addr, base::size_t size, dma_data_direction dir) -> void
+{
+    /* nothing to tear down without an IOMMU or bounce buffers */
+    (void) dev;
+    (void) addr;
+    (void) size;
+    (void) dir;
+}
+
+auto dma_map_single(DMADevice *dev, void *ptr, base::size_t size, dma_data_direction dir) -> dma_addr_t
+{
+    return dma_map_page(dev, virt_to_page((virt_addr_t) ptr), (virt_addr_t) ptr & ~PAGE_MASK, size, dir);
+}
+
+auto dma_unmap_single(DMADevice *dev, dma_addr_t addr, base::size_t size, dma_data_direction dir) -> void
+{
+    dma_unmap_page(dev, addr, size, dir);
+}
+
+/**
+ * Map entries of the list, returning the number of DMA segments, or 0 if
+ * any of them is out of the device's mask.
+ */
+auto dma_map_sg(DMADevice *dev, ScatterList *sgl, base::size_t nents, dma_data_direction dir) -> base::size_t
+{
+    base::size_t max_seg = dev->max_segment_size ? dev->max_segment_size : ~0U;
+    ScatterList *seg = nullptr;
+    base::size_t seg_nr = 0;
+    dma_addr_t addr;
+
+    for (base::size_t i = 0; i < nents; i++) {
+        addr = dma_map_page(dev, sgl[i].page, sgl[i].offset, sgl[i].length, dir);
+        if (addr == DMA_MAPPING_ERROR) {
+            return 0;
+        }
+
+        if (seg && (seg->dma_address + seg->dma_length) == addr
+            && (seg->dma_length + sgl[i].length) <= max_seg) {
+            seg->dma_length += sgl[i].length;
+            continue;
+        }
+
+        seg = &sgl[seg_nr++];
+        seg->dma_address = addr;
+        seg->dma_length = sgl[i].length;
+    }
+
+    /* entries left are not segments */
+    for (base::size_t i = seg_nr; i < nents; i++) {
+        sgl[i].dma_address = DMA_MAPPING_ERROR;
+        sgl[i].dma_length = 0;
+    }
+
+    return seg_nr;
+}
+
+/* `nents` is what was passed to dma_map_sg(), not the number of segments */
+auto dma_unmap_sg(DMADevice *dev, ScatterList *sgl, base::size_t nents, dma_data_direction dir) -> void
+{
+    for (base::size_t i = 0; i < nents && sgl[i].dma_length; i++) {
+        dma_unmap_page(dev, sgl[i].dma_address, sgl[i].dma_length, dir);
+    }
+}
+
+};
@@ -5,6 +5,9 @@ import :types;
 import kernel.base;
 import kernel.lib;
 
+#include <closureos/compiler.h>
+#include <closureos/errno.h>
+
 export namespace mm {
 
 /* we can only allocate max 8 pages at a time */
@@ -26,7 +29,7 @@ enum {
     KOBJECT_SIZE_NR,
 };
 
-base::size_t kobj_default_size[KOBJECT_SIZE_NR] = {
+inline constexpr base::size_t kobj_default_size[KOBJECT_SIZE_NR] = {
     16,
     32,
     64,
@@ -40,9 +43,218 @@ base::size_t kobj_default_size[KOBJECT_SIZE_NR] = {
     8192,
 };
 
+inline constexpr const char *kobj_default_name[KOBJECT_SIZE_NR] = {
+    "kmalloc-16",
+    "kmalloc-32",
+    "kmalloc-64",
+    "kmalloc-128",
+    "kmalloc-192",
+    "kmalloc-256",
+    "kmalloc-512",
+    "kmalloc-1k",
+    "kmalloc-2k",
+    "kmalloc-4k",
+    "kmalloc-8k",
+};
+
+/* size-to-cache lookup table, indexed by size rounded up to 8 bytes */
+inline constexpr base::size_t KMALLOC_SIZE_INDEX_SHIFT = 3;
+inline constexpr base::size_t KMALLOC_SIZE_INDEX_NR = (KMALLOC_MAX_CACHE_SIZE >> KMALLOC_SIZE_INDEX_SHIFT) + 1;
+inline constexpr base::uint8_t KMALLOC_NO_CACHE = 0xFF;
+
+__always_inline auto kmalloc_size_index(base::size_t size) -> base::size_t
+{
+    return (size + (1 << KMALLOC_SIZE_INDEX_SHIFT) - 1) >> KMALLOC_SIZE_INDEX_SHIFT;
+}
+
+/**
+ * Requested sizes are sampled into a histogram over buckets of the lookup
+ * table, from which extra size classes are spawned between the default ones
+ * where too much space is wasted by rounding up.
+ */
+inline constexpr base::size_t KMALLOC_SAMPLE_SHIFT = 6;             /* sample 1 of 64 allocations */
+inline constexpr base::size_t KMALLOC_CLASS_MAX_NR = 32;            /* default and spawned ones */
+inline constexpr base::size_t KMALLOC_ADAPT_MIN_SAMPLES = 256;      /* of a class before adapting it */
+inline constexpr base::size_t KMALLOC_ADAPT_WASTE_PERMILLE = 125;   /* of a class to be split */
+
+/* an entry of a recorded size profile */
+struct KMallocProfileEntry {
+    base::size_t size;
+    base::size_t count;
+};
+
+/* sampled usage of a size class */
+struct KMallocClassStat {
+    base::size_t size;
+    base::size_t samples;
+    base::size_t wasted;        /* bytes wasted by the samples */
+};
+
+/**
+ * Size to kmalloc() an object aligned to a cache line with, e.g. for types
+ * holding a lib::PerCPU. Spawned classes are only aligned to their size, so
+ * it's rounded up to a default class, all of which from 64 bytes are multiples
+ * of cache lines and are never taken over by a spawned class.
+ */
+constexpr auto kmalloc_cache_aligned_size(base::size_t size) -> base::size_t
+{
+    for (base::size_t i = 0; i < KOBJECT_SIZE_NR; i++) {
+        if (size <= kobj_default_size[i] && kobj_default_size[i] >= lib::CACHE_LINE_SIZE) {
+            return kobj_default_size[i];
+        }
+    }
+
+    /* large ones are served by whole pages */
+    return size;
+}
+
+/* index of default cache for a compile-time size, KOBJECT_SIZE_NR for none */
+consteval auto kmalloc_index(base::size_t size) -> base::size_t
+{
+    for (base::size_t i = 0; i < KOBJECT_SIZE_NR; i++) {
+        if (size <= kobj_default_size[i]) {
+            return i;
+        }
+    }
+
+    return KOBJECT_SIZE_NR;
+}
+
 inline constexpr base::size_t CACHE_POOL_MAX_NR = 0x10;
 
-/* size-specific memory pool, front end of PagePool */
+/* max number of slabs on a per-CPU partial list before being moved to the cache */
+inline constexpr base::size_t KMEM_CPU_PARTIAL_MAX = 8;
+
+/* max number of objects on other slabs to skip when grouping a bulk free */
+inline constexpr base::size_t KMEM_BULK_LOOKAHEAD = 3;
+
+/* events of a KMemCache counted on each CPU */
+enum kmem_cache_stat_item {
+    KMEM_STAT_ALLOC = 0,        /* objects allocated */
+    KMEM_STAT_FREE,             /* objects freed */
+    KMEM_STAT_ALLOC_SLOW,       /* allocations missing the local freelist */
+    KMEM_STAT_FREE_SLOW,        /* frees to slabs other than the active one */
+    KMEM_STAT_NEW_SLAB,         /* slabs taken from the page allocator */
+    KMEM_STAT_ITEM_NR,
+};
+
+/**
+ * Per-CPU front end of a KMemCache, accessed with local interrupts disabled
+ * - `page` is the active slab, and its free objects are taken to `freelist`,
+ *   which is only touched by the owner CPU
+ * - slabs on the `partial` list are owned (frozen) by this CPU, other CPUs can
+ *   only free objects to the `page->freelist` of them under `page->lock`
+ */
+struct KMemCacheCPU {
+    Page *page;
+    void **freelist;
+    lib::ListHead partial;
+    base::size_t partial_nr;
+    base::size_t stat[KMEM_STAT_ITEM_NR];
+};
+
+/* max number of empty slabs kept on each node, the rest go back to the buddy */
+inline constexpr base::size_t KMEM_NODE_EMPTY_MAX = 2;
+
+/**
+ * Slabs shared by all CPUs, kept on the node they're allocated from
+ * - `partial` slabs have both free and allocated objects
+ * - `empty` slabs are a small reserve to avoid buddy round trips, all of
+ *   them could be released by the shrinker under memory pressure
+ * Full slabs are not tracked, they go to the per-CPU partial list of the CPU
+ * freeing the first object on them.
+ */
+struct KMemCacheNode {
+    lib::ListHead partial;
+    base::size_t partial_nr;
+    lib::ListHead empty;
+    base::size_t empty_nr;
+    lib::atomic::SpinLock lock;
+};
+
+enum kmem_cache_flags {
+    KMEM_CACHE_HWCACHE_ALIGN    = (1 << 0), /* align objects to cache lines */
+    KMEM_CACHE_NO_MERGE         = (1 << 1), /* never share with other caches */
+    KMEM_CACHE_MAGAZINE         = (1 << 2), /* with the magazine layer */
+};
+
+/**
+ * Magazine layer (Bonwick & Adams, 2001), an optional front end of slabs for
+ * objects allocated on one CPU and freed on another
+ * - each CPU has a loaded and a previous magazine of object pointers, most
+ *   allocations and frees are served by them without touching any slab
+ * - a CPU exchanges whole magazines with the depot when both of its own are
+ *   empty (allocating) or full (freeing), so objects flow between CPUs a
+ *   magazine at a time rather than one by one under slab locks
+ * - magazines get bigger when the depot lock is contended
+ */
+
+/* magazine sizes are chosen to make a magazine fill a power-of-2 object */
+inline constexpr base::size_t KMEM_MAG_SIZE_MIN = 28;
+inline constexpr base::size_t KMEM_MAG_SIZE_MAX = 252;
+
+/* number of contended depot lockings before growing magazines */
+inline constexpr base::size_t KMEM_DEPOT_CONTENTION_MAX = 16;
+
+/* max number of full magazines in the depot, more objects go back to slabs */
+inline constexpr base::size_t KMEM_DEPOT_FULL_MAX = 64;
+
+struct KMemMagazine {
+    lib::ListHead list;     /* in the depot */
+    base::size_t rounds;    /* number of objects in it */
+    base::size_t size;      /* max number of objects */
+    void *objs[];
+};
+
+struct KMemMagazineCPU {
+    KMemMagazine *loaded;
+    KMemMagazine *prev;
+    base::size_t alloc_hit, alloc_miss;
+    base::size_t free_hit, free_miss;
+};
+
+struct KMemDepot {
+    lib::ListHead full;
+    base::size_t full_nr;
+    base::size_t full_objs;     /* objects in full magazines */
+    lib::ListHead empty;
+    base::size_t empty_nr;
+    base::size_t mag_size;      /* size of newly allocated magazines */
+    base::size_t contention;
+    lib::atomic::SpinLock lock;
+    lib::PerCPU<KMemMagazineCPU> cpu;
+};
+
+struct KMemMagazineStat {
+    base::size_t alloc_hit, alloc_miss;
+    base::size_t free_hit, free_miss;
+    base::size_t full_nr, empty_nr;
+    base::size_t mag_size;
+};
+
+/* usage of a KMemCache, with per-CPU counters folded */
+struct KMemCacheStat {
+    const char *name;
+    base::size_t obj_size;      /* stride of objects, including the padding */
+    base::size_t slabs;
+    base::size_t pages;
+    base::size_t objects;       /* in all slabs */
+    base::size_t active_objects;
+    base::size_t events[KMEM_STAT_ITEM_NR];
+};
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+/**
+ * Size-specific memory pool, front end of PagePool.
+ * - objects are laid out with `obj_sz` stride, which is a multiple of `align`
+ * - the first object of each slab is shifted by a colour, which is a multiple
+ *   of `colour_off` bounded by the leftover space of the slab, so that objects
+ *   of different slabs don't always compete for the same cache sets
+ * - the constructor runs only when a slab is created, objects should be given
+ *   back in the constructed state, so the free pointer is put after the object
+ *   rather than over it for caches with constructors
+ */
 class KMemCache {
 public:
     KMemCache(void);
@@ -51,36 +263,117 @@ public:
     auto Malloc(void) -> void*;
     auto Free(Page *page, void *obj) -> void;
 
+    auto MallocBulk(base::size_t nr, void **objs) -> base::size_t;
+    auto FreeBulk(base::size_t nr, void **objs) -> void;
+
     auto AddPool(PagePool *pool) -> bool;
     auto RemovePool(base::size_t index) -> PagePool*;
 
-    auto Init(base::size_t obj_sz) -> void;
+    auto Init(const char *name,
+              base::size_t size,
+              base::size_t align = 0,
+              base::size_t flags = 0,
+              kmem_ctor_t ctor = nullptr) -> void;
+    auto Release(void) -> bool;
+
+    auto Shrink(base::size_t nid, base::size_t nr) -> base::size_t;
+
+    auto Name(void) -> const char*;
+    auto ObjectSize(void) -> base::size_t;
+
+    auto GetMagazineStat(KMemMagazineStat *stat) -> bool;
+    auto GetStat(KMemCacheStat *stat) -> void;
 
 private:
+    friend class KHeapPool;
+
+    /* attributes given on creation */
+
+    const char *name;
+    base::size_t size;
+    base::size_t align;
+    base::size_t flags;
+    kmem_ctor_t ctor;
+
+    base::size_t offset;        /* of the free pointer in an object */
+    base::size_t colour_off;
+    base::size_t colour_nr;
+    base::size_t colour_next;
+
+    base::size_t refcount;      /* number of creators sharing this cache */
+    lib::ListHead list;         /* in the cache list of KHeapPool */
+    lib::atomic::atomic_t slab_nr;
+
+    auto __mergeable(base::size_t size, base::size_t align, base::size_t flags, kmem_ctor_t ctor) -> bool;
+
+    __always_inline auto __get_freepointer(void *obj) -> void**
+    {
+        return *(void***) ((virt_addr_t) obj + this->offset);
+    }
+
+    __always_inline auto __set_freepointer(void *obj, void **fp) -> void
+    {
+        *(void***) ((virt_addr_t) obj + this->offset) = fp;
+    }
+
     /* pages pool backend */
 
     PagePool *pools[CACHE_POOL_MAX_NR];
     base::size_t pool_nr;
     base::size_t order;
 
-    auto __internal_page_alloc(void) -> Page*;
+    /* pools sorted by distance to each node */
+    PagePool *node_pools[MAX_NUMNODES][CACHE_POOL_MAX_NR];
+    base::size_t node_pool_nr[MAX_NUMNODES];
+
+    auto __build_node_pools(void) -> void;
+    auto __internal_page_alloc(base::size_t nid) -> Page*;
     auto __page_obj_slicing(Page* page) -> void;
 
-    /* caches front end */
+    /* per-CPU caches front end */
+
+    lib::PerCPU<KMemCacheCPU> cpu_slab;
+
+    auto __freeze_slab(KMemCacheCPU *c, Page *page) -> void;
+    auto __deactivate_slab(KMemCacheCPU *c) -> void;
+    auto __unfreeze_partials(KMemCacheCPU *c) -> void;
+    auto __discard_slab(Page *page) -> void;
+
+    /* caches shared by all CPUs */
 
     base::size_t page_obj_nr;
     base::size_t obj_sz;
-    Page *current;
-    lib::ListHead partial;
-    lib::ListHead full;
-    void **freelist;
+    KMemCacheNode node[MAX_NUMNODES];
 
-    auto __internal_obj_alloc(void) -> void*;
-    auto __internal_obj_free(Page *page, void *obj) -> void;
+    auto __get_node(Page *page) -> KMemCacheNode*;
+    auto __get_partial(KMemCacheCPU *c, base::size_t nid) -> bool;
+    auto __put_empty(KMemCacheNode *n, Page *page) -> void;
+    auto __internal_obj_alloc(KMemCacheCPU *c) -> void*;
+    auto __internal_obj_free(KMemCacheCPU *c, Page *page, void *head, void *tail, base::size_t cnt) -> void;
 
-    /* infrastructure */
+    auto __slab_alloc(void) -> void*;
+    auto __slab_free(Page *page, void *obj) -> void;
 
-    lib::atomic::SpinLock lock;
+    /* magazine layer, only exists with KMEM_CACHE_MAGAZINE */
+
+    KMemDepot *depot;
+
+    auto __depot_create(void) -> KMemDepot*;
+    auto __depot_destroy(void) -> void;
+    auto __depot_lock(void) -> void;
+    auto __depot_get_empty(void) -> KMemMagazine*;
+    auto __depot_flush(void) -> void;
+    auto __magazine_alloc(void) -> void*;
+    auto __magazine_free(void *obj) -> bool;
+    auto __magazine_drain(KMemMagazine *mag) -> void;
+    auto __magazine_release(KMemMagazine *mag) -> void;
+
+    /* give empty slabs back on memory pressure */
+
+    Shrinker shrinker;
+
+    static auto __shrinker_count(Shrinker *shrinker, base::size_t nid) -> base::size_t;
+    static auto __shrinker_scan(Shrinker *shrinker, base::size_t nid, base::size_t nr) -> base::size_t;
 };
 
 /* static memory initializer to avoid constructor to be existed */
@@ -111,24 +404,164 @@ KMemCache::~KMemCache(void)
 
 auto KMemCache::Malloc(void) -> void*
 {
-    void *obj;
+    void *obj = nullptr;
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
 
-    this->lock.Lock();
+    if (this->depot) {
+        obj = this->__magazine_alloc();
+    }
+
+    if (!obj) {
+        obj = this->__slab_alloc();
+    }
 
-    obj = this->__internal_obj_alloc();
+    if (obj) {
+        this->cpu_slab.This()->stat[KMEM_STAT_ALLOC]++;
+    }
 
-    this->lock.UnLock();
+    lib::local_irq_restore(flags);
 
     return obj;
 }
 
 auto KMemCache::Free(Page *page, void *obj) -> void
 {
-    this->lock.Lock();
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
+
+    this->cpu_slab.This()->stat[KMEM_STAT_FREE]++;
+
+    if (!this->depot || !this->__magazine_free(obj)) {
+        this->__slab_free(page, obj);
+    }
+
+    lib::local_irq_restore(flags);
+}
+
+/* fast path: pop from the local freelist without any shared lock */
+auto KMemCache::__slab_alloc(void) -> void*
+{
+    KMemCacheCPU *c = this->cpu_slab.This();
+    void *obj;
+
+    obj = c->freelist;
+    if (obj) {
+        c->freelist = this->__get_freepointer(obj);
+    } else {
+        obj = this->__internal_obj_alloc(c);
+    }
+
+    return obj;
+}
+
+/* fast path: push to the local freelist if the object is on the active slab */
+auto KMemCache::__slab_free(Page *page, void *obj) -> void
+{
+    KMemCacheCPU *c = this->cpu_slab.This();
+
+    if (page == c->page) {
+        this->__set_freepointer(obj, c->freelist);
+        c->freelist = (void**) obj;
+    } else {
+        this->__internal_obj_free(c, page, obj, obj, 1);
+    }
+}
+
+/**
+ * Allocate `nr` objects with local interrupts disabled only once, the local
+ * freelist is refilled with all free objects of a slab at a time.
+ * Returns the number of allocated objects, less than `nr` only on shortage.
+ */
+auto KMemCache::MallocBulk(base::size_t nr, void **objs) -> base::size_t
+{
+    KMemCacheCPU *c;
+    base::size_t flags, i;
+    void *obj;
+
+    flags = lib::local_irq_save();
+
+    c = this->cpu_slab.This();
+
+    for (i = 0; i < nr; i++) {
+        obj = c->freelist;
+        if (obj) {
+            c->freelist = this->__get_freepointer(obj);
+        } else if (!(obj = this->__internal_obj_alloc(c))) {
+            break;
+        }
+
+        objs[i] = obj;
+    }
+
+    c->stat[KMEM_STAT_ALLOC] += i;
+
+    lib::local_irq_restore(flags);
+
+    return i;
+}
+
+/**
+ * Free `nr` objects, objects on the same slab are chained and given back at
+ * once, taking the slab lock only once for each group.
+ * NOTE: entries of `objs` are cleared while being grouped.
+ */
+auto KMemCache::FreeBulk(base::size_t nr, void **objs) -> void
+{
+    base::size_t flags, cnt, lookahead;
+    void *head, *tail, *obj;
+    KMemCacheCPU *c;
+    Page *page;
+
+    flags = lib::local_irq_save();
+
+    c = this->cpu_slab.This();
+
+    while (nr > 0) {
+        head = tail = objs[--nr];
+        if (!head) {
+            continue;
+        }
 
-    this->__internal_obj_free(page, obj);
+        /* detach following objects on the same slab as the last one */
+        page = &virt_to_folio((virt_addr_t) head)->page;
+        this->__set_freepointer(tail, nullptr);
+        cnt = 1;
+        lookahead = KMEM_BULK_LOOKAHEAD;
 
-    this->lock.UnLock();
+        for (base::size_t i = nr; i > 0; i--) {
+            obj = objs[i - 1];
+            if (!obj) {
+                continue;
+            }
+
+            if (&virt_to_folio((virt_addr_t) obj)->page != page) {
+                if (!--lookahead) {
+                    break;
+                }
+
+                continue;
+            }
+
+            this->__set_freepointer(obj, (void**) head);
+            head = obj;
+            cnt++;
+            objs[i - 1] = nullptr;
+        }
+
+        c->stat[KMEM_STAT_FREE] += cnt;
+
+        if (page == c->page) {
+            this->__set_freepointer(tail, c->freelist);
+            c->freelist = (void**) head;
+        } else {
+            this->__internal_obj_free(c, page, head, tail, cnt);
+        }
+    }
+
+    lib::local_irq_restore(flags);
 }
 
 auto KMemCache::AddPool(PagePool *pool) -> bool
@@ -151,6 +584,9 @@ auto KMemCache::AddPool(PagePool *pool) -> bool
     }
 
     *slot = pool;
+    this->pool_nr++;
+
+    this->__build_node_pools();
 
     return true;
 }
@@ -166,18 +602,88 @@ auto KMemCache::RemovePool(base::size_t index) -> PagePool*
     if (this->pools[index]) {
         candidate = this->pools[index];
         this->pools[index] = nullptr;
+        this->pool_nr--;
+
+        this->__build_node_pools();
     }
 
     return candidate;
 }
 
-auto KMemCache::Init(base::size_t obj_sz) -> void
+auto KMemCache::__build_node_pools(void) -> void
+{
+    for (base::size_t nid = 0; nid < MAX_NUMNODES; nid++) {
+        this->node_pool_nr[nid] = sort_pools_by_node(this->node_pools[nid],
+                                                     this->pools,
+                                                     CACHE_POOL_MAX_NR,
+                                                     nid);
+    }
+}
+
+__always_inline auto kmem_align_up(base::size_t x, base::size_t align) -> base::size_t
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+/* alignment of objects, cache-line alignment is relaxed for small objects */
+static auto kmem_calc_align(base::size_t size, base::size_t align, base::size_t flags) -> base::size_t
+{
+    base::size_t ralign;
+
+    if (flags & KMEM_CACHE_HWCACHE_ALIGN) {
+        /* let small objects share a cache line without crossing it */
+        ralign = lib::CACHE_LINE_SIZE;
+        while (size <= (ralign / 2)) {
+            ralign /= 2;
+        }
+
+        if (ralign > align) {
+            align = ralign;
+        }
+    }
+
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+
+    return align;
+}
+
+/* `align` should be a power of 2, or 0 for the default alignment */
+auto KMemCache::Init(const char *name,
+                     base::size_t size,
+                     base::size_t align,
+                     base::size_t flags,
+                     kmem_ctor_t ctor) -> void
 {
+    base::size_t obj_sz, leftover;
+
     for (auto i = 0; i < CACHE_POOL_MAX_NR; i++) {
         this->pools[i] = nullptr;
     }
 
     this->pool_nr = 0;
+
+    for (auto nid = 0; nid < MAX_NUMNODES; nid++) {
+        this->node_pool_nr[nid] = 0;
+    }
+
+    this->name = name;
+    this->size = size;
+    this->align = kmem_calc_align(size, align, flags);
+    this->flags = flags;
+    this->ctor = ctor;
+
+    if (ctor) {
+        this->offset = kmem_align_up(size, sizeof(void*));
+        obj_sz = this->offset + sizeof(void*);
+    } else {
+        this->offset = 0;
+        obj_sz = (size < sizeof(void*)) ? sizeof(void*) : size;
+    }
+
+    obj_sz = kmem_align_up(obj_sz, this->align);
+
     this->order = obj_sz >> PAGE_SHIFT;
     if (obj_sz >= PAGE_SIZE) {
         this->order++;
@@ -186,154 +692,608 @@ auto KMemCache::Init(base::size_t obj_sz) -> void
     this->obj_sz = obj_sz;
     this->page_obj_nr = (PAGE_SIZE << this->order) / this->obj_sz;
 
-    this->current = nullptr;
-    lib::list_head_init(&this->partial);
-    lib::list_head_init(&this->full);
-    this->freelist = nullptr;
+    /* colours keep the alignment, and there's always the colour 0 */
+    leftover = (PAGE_SIZE << this->order) - this->page_obj_nr * this->obj_sz;
+    this->colour_off = (this->align > lib::CACHE_LINE_SIZE) ? this->align : lib::CACHE_LINE_SIZE;
+    this->colour_nr = leftover / this->colour_off + 1;
+    this->colour_next = 0;
 
-    this->lock.Reset();
-}
+    this->refcount = 1;
+    lib::list_head_init(&this->list);
+    this->slab_nr = 0;
 
-auto KMemCache::__internal_page_alloc(void) -> Page*
-{
-    Page *new_page = nullptr;
+    /* we just go without magazines if we fail to create the depot */
+    this->depot = nullptr;
 
-    for (auto i = 0; i < CACHE_POOL_MAX_NR; i++) {
-        if (this->pools[i]) {
-            new_page = this->pools[i]->AllocPages(this->order);
-            if (new_page) {
-                break;
-            }
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        KMemCacheCPU *c = this->cpu_slab.Of(cpu);
+
+        c->page = nullptr;
+        c->freelist = nullptr;
+        lib::list_head_init(&c->partial);
+        c->partial_nr = 0;
+
+        for (auto i = 0; i < KMEM_STAT_ITEM_NR; i++) {
+            c->stat[i] = 0;
         }
     }
 
-    return new_page;
+    for (auto nid = 0; nid < MAX_NUMNODES; nid++) {
+        KMemCacheNode *n = &this->node[nid];
+
+        lib::list_head_init(&n->partial);
+        n->partial_nr = 0;
+        lib::list_head_init(&n->empty);
+        n->empty_nr = 0;
+        n->lock.Reset();
+    }
+
+    this->shrinker.count = KMemCache::__shrinker_count;
+    this->shrinker.scan = KMemCache::__shrinker_scan;
+    register_shrinker(&this->shrinker);
+
+    if (flags & KMEM_CACHE_MAGAZINE) {
+        this->depot = this->__depot_create();
+    }
+}
+
+/* allocate a slab from pools nearest to the node */
+auto KMemCache::__internal_page_alloc(base::size_t nid) -> Page*
+{
+    return alloc_pages_from(this->node_pools[nid], this->node_pool_nr[nid], this->order, GFP_KERNEL);
+}
+
+auto KMemCache::__get_node(Page *page) -> KMemCacheNode*
+{
+    return &this->node[page->pool->Node()];
 }
 
 auto KMemCache::__page_obj_slicing(Page* page) -> void
 {
     void *curr_obj;
     virt_addr_t next_obj;
-    void **obj_ptr;
 
-    next_obj = page_to_virt(page);
+    next_obj = page_to_virt(page) + this->colour_next * this->colour_off;
     curr_obj = nullptr;
-    obj_ptr = (void**) next_obj;
+
+    if (++this->colour_next == this->colour_nr) {
+        this->colour_next = 0;
+    }
 
     for (auto i = 0; i < this->page_obj_nr; i++) {
-        *obj_ptr = curr_obj;
+        if (this->ctor) {
+            this->ctor((void*) next_obj);
+        }
+
+        this->__set_freepointer((void*) next_obj, (void**) curr_obj);
         curr_obj = (void*) next_obj;
         next_obj += this->obj_sz;
-        obj_ptr = (void**) next_obj;
     }
 
+    lib::atomic::atomic_inc(&this->slab_nr);
+
     page->obj_nr = this->page_obj_nr;
     page->freelist = (void**) curr_obj;
     page->kc = this;
+    page->frozen = false;
+    page->lock.Reset();
     get_page(page);
 
 }
 
-auto KMemCache::__internal_obj_alloc(void) -> void*
+/**
+ * Make the slab as the active one of current CPU and take all free objects on it,
+ * the slab should have been frozen (or just allocated) by current CPU.
+ */
+auto KMemCache::__freeze_slab(KMemCacheCPU *c, Page *page) -> void
 {
-    void *obj = nullptr;
+    page->lock.Lock();
 
-redo:
-    /* we have objects on the kmem_cache now, just allocate one */
-    if (this->freelist != nullptr) {
-        obj = this->freelist;
-        this->freelist = (void**) (*this->freelist);
-        this->current->obj_nr--;
-        goto out;
-    }
+    page->frozen = true;
+    c->freelist = page->freelist;
+    page->freelist = nullptr;
+    page->obj_nr = 0;
+
+    page->lock.UnLock();
+
+    c->page = page;
+}
+
+/* give the active slab back to its node with objects on the local freelist */
+auto KMemCache::__deactivate_slab(KMemCacheCPU *c) -> void
+{
+    Page *page = c->page;
+    KMemCacheNode *n;
+    bool is_empty, is_full;
+    void *obj;
 
-    /* no object on freelist, put the current page on the full list */
-    if (this->current) {
-        lib::list_add_next(&this->full, &this->current->list);
-        this->current = nullptr;
+    if (!page) {
+        return ;
     }
 
-    /* try to get the page from partial list */
-    if (!lib::list_empty(&this->partial)) {
-        this->current = lib::container_of(this->partial.next, &Page::list);
-        this->freelist = this->current->freelist;
-        lib::list_del(&this->current->list);
-        goto redo;
+    n = this->__get_node(page);
+    mm_stat_lock(&n->lock, MM_STAT_SLAB_LOCK_CONTENDED);
+    page->lock.Lock();
+
+    /* objects on the local freelist are all from the active slab */
+    while ((obj = c->freelist)) {
+        c->freelist = this->__get_freepointer(obj);
+        this->__set_freepointer(obj, page->freelist);
+        page->freelist = (void**) obj;
+        page->obj_nr++;
     }
 
-    /* no current on the partial list, allocated from the buddy */
-    this->current = this->__internal_page_alloc();
-    if (this->current) {
-        this->__page_obj_slicing(this->current);
-        this->freelist = this->current->freelist;
-        goto redo;
+    page->frozen = false;
+    is_empty = (page->obj_nr == this->page_obj_nr);
+    is_full = (page->freelist == nullptr);
+
+    page->lock.UnLock();
+
+    c->page = nullptr;
+
+    if (is_empty) {
+        this->__put_empty(n, page);
+    } else if (!is_full) {
+        lib::list_add_prev(&n->partial, &page->list);
+        n->partial_nr++;
     }
 
-out:
-    return obj;
+    n->lock.UnLock();
 }
 
-auto KMemCache::__internal_obj_free(Page *page, void *obj) -> void
+/* move slabs on the per-CPU partial list back to partial lists of their nodes */
+auto KMemCache::__unfreeze_partials(KMemCacheCPU *c) -> void
 {
-    page->obj_nr++;
+    KMemCacheNode *n, *locked = nullptr;
+    Page *page;
 
-    if (page == this->current) {
-        *(void**) obj = this->freelist;
-        this->freelist = (void**) obj;
-    } else {
-        if (page->obj_nr == 1) {    /* on full list */
-            list_del(&page->list);
-            list_add_next(&this->full, &page->list);
-        } else if (page->obj_nr == this->page_obj_nr) {   /* all freed */
-            list_del(&page->list);
-            put_page(page);
+    while (!lib::list_empty(&c->partial)) {
+        page = lib::list_entry(c->partial.next, &Page::list);
+        lib::list_del(&page->list);
+        c->partial_nr--;
+
+        /* slabs are mostly from the same node, so we keep the lock if we can */
+        n = this->__get_node(page);
+        if (n != locked) {
+            if (locked) {
+                locked->lock.UnLock();
+            }
+
+            mm_stat_lock(&n->lock, MM_STAT_SLAB_LOCK_CONTENDED);
+            locked = n;
         }
-    }
-}
 
-/* General front end of KMemCache */
-class KHeapPool {
-public:
-    KHeapPool(void);
-    ~KHeapPool();
+        page->lock.Lock();
+        page->frozen = false;
 
-    auto Malloc(base::size_t size) -> void*;
-    auto Free(void *obj) -> void;
+        if (page->obj_nr == this->page_obj_nr) {
+            page->lock.UnLock();
+            this->__put_empty(n, page);
+        } else {
+            page->lock.UnLock();
+            lib::list_add_prev(&n->partial, &page->list);
+            n->partial_nr++;
+        }
+    }
 
-    auto PageAlloc(base::size_t order) -> Page*;
-    auto PageFree(Page *p) -> void;
+    if (locked) {
+        locked->lock.UnLock();
+    }
+}
 
-    auto Init(void) -> void;
-    auto SetKMemCaches(KMemCache **caches, base::size_t cache_nr, base::size_t *cache_obj_sizes) -> void;
-    auto SetPagePools(PagePool **pools, base::size_t pool_nr) -> void;
+/**
+ * Take a slab from the node as the active one, partial slabs come first
+ * so that empty ones could be given back on memory pressure.
+ */
+auto KMemCache::__get_partial(KMemCacheCPU *c, base::size_t nid) -> bool
+{
+    KMemCacheNode *n = &this->node[nid];
+    Page *page;
 
-private:
-    KMemCache **caches;
-    base::size_t cache_nr;
-    base::size_t *cache_obj_sizes;
+    /* racy check to avoid taking locks of empty nodes */
+    if (!n->partial_nr && !n->empty_nr) {
+        return false;
+    }
 
-    auto __malloc_caches(base::size_t size) -> void*;
+    mm_stat_lock(&n->lock, MM_STAT_SLAB_LOCK_CONTENDED);
 
-    PagePool **pools;
-    base::size_t pool_nr;
+    if (!lib::list_empty(&n->partial)) {
+        page = lib::list_entry(n->partial.next, &Page::list);
+        n->partial_nr--;
+    } else if (!lib::list_empty(&n->empty)) {
+        page = lib::list_entry(n->empty.next, &Page::list);
+        n->empty_nr--;
+    } else {
+        n->lock.UnLock();
+        return false;
+    }
 
-    auto __malloc_pools(base::size_t size) -> void*;
-};
+    lib::list_del(&page->list);
+    this->__freeze_slab(c, page);
 
-static base::uint8_t GloblKHeapPoolMem[sizeof(KHeapPool)];
-KHeapPool *GloblKHeapPool = (KHeapPool*) &GloblKHeapPoolMem;
+    n->lock.UnLock();
 
-KHeapPool::KHeapPool(void)
-{
-    /* do nothing */    
+    return true;
 }
 
-KHeapPool::~KHeapPool()
+/* keep an empty slab on the node if the reserve is not full, called with n->lock held */
+auto KMemCache::__put_empty(KMemCacheNode *n, Page *page) -> void
 {
-    /* do nothing */
+    if (n->empty_nr < KMEM_NODE_EMPTY_MAX) {
+        lib::list_add_next(&n->empty, &page->list);
+        n->empty_nr++;
+    } else {
+        this->__discard_slab(page);
+    }
 }
 
-auto KHeapPool::Malloc(base::size_t size) -> void*
+/* give an empty slab back to the page allocator */
+auto KMemCache::__discard_slab(Page *page) -> void
+{
+    lib::atomic::atomic_dec(&this->slab_nr);
+
+    page->kc = nullptr;
+    page->freelist = nullptr;
+    page->obj_nr = 0;
+    put_page(page);
+}
+
+/* slow path of allocation, called with local interrupts disabled */
+auto KMemCache::__internal_obj_alloc(KMemCacheCPU *c) -> void*
+{
+    void *obj = nullptr;
+    base::size_t nid;
+    Page *page;
+
+    c->stat[KMEM_STAT_ALLOC_SLOW]++;
+
+redo:
+    /* we have objects on the local freelist now, just allocate one */
+    if (c->freelist != nullptr) {
+        obj = c->freelist;
+        c->freelist = this->__get_freepointer(obj);
+        goto out;
+    }
+
+    /**
+     * take objects freed by other CPUs on the active slab,
+     * or unfreeze it if it's full, as we don't track full slabs
+     */
+    if (c->page) {
+        page = c->page;
+        page->lock.Lock();
+
+        if (page->freelist) {
+            c->freelist = page->freelist;
+            page->freelist = nullptr;
+            page->obj_nr = 0;
+            page->lock.UnLock();
+            goto redo;
+        }
+
+        page->frozen = false;
+        page->lock.UnLock();
+        c->page = nullptr;
+    }
+
+    /* try to get the page from per-CPU partial list */
+    if (!lib::list_empty(&c->partial)) {
+        page = lib::list_entry(c->partial.next, &Page::list);
+        lib::list_del(&page->list);
+        c->partial_nr--;
+        this->__freeze_slab(c, page);
+        goto redo;
+    }
+
+    /* try to get the page from shared partial list of local node */
+    nid = numa_node_id();
+    if (this->__get_partial(c, nid)) {
+        goto redo;
+    }
+
+    /* no page on the local partial lists, allocated from the buddy */
+    page = this->__internal_page_alloc(nid);
+    if (page) {
+        c->stat[KMEM_STAT_NEW_SLAB]++;
+        this->__page_obj_slicing(page);
+        this->__freeze_slab(c, page);
+        goto redo;
+    }
+
+    /* we're running out of memory, take partial slabs on remote nodes */
+    for (base::size_t i = 0; i < numa_node_nr; i++) {
+        if (i != nid && this->__get_partial(c, i)) {
+            goto redo;
+        }
+    }
+
+out:
+    return obj;
+}
+
+/**
+ * Slow path of freeing, for objects not on the local active slab,
+ * `cnt` objects from `head` to `tail` are chained and on the same slab.
+ */
+auto KMemCache::__internal_obj_free(KMemCacheCPU *c, Page *page, void *head, void *tail, base::size_t cnt) -> void
+{
+    KMemCacheNode *n;
+    bool was_full, is_empty;
+
+    c->stat[KMEM_STAT_FREE_SLOW] += cnt;
+
+    page->lock.Lock();
+
+    was_full = !page->frozen && (page->freelist == nullptr);
+
+    this->__set_freepointer(tail, page->freelist);
+    page->freelist = (void**) head;
+    page->obj_nr += cnt;
+
+    if (was_full) {
+        /* a full slab is not on any list, take it to local partial list */
+        page->frozen = true;
+    }
+
+    is_empty = !page->frozen && (page->obj_nr == this->page_obj_nr);
+
+    page->lock.UnLock();
+
+    if (was_full) {
+        lib::list_add_prev(&c->partial, &page->list);
+        c->partial_nr++;
+
+        if (c->partial_nr > KMEM_CPU_PARTIAL_MAX) {
+            this->__unfreeze_partials(c);
+        }
+
+        return ;
+    }
+
+    if (!is_empty) {
+        return ;
+    }
+
+    /* all freed, check again under the lock as it might be taken by others */
+    n = this->__get_node(page);
+    mm_stat_lock(&n->lock, MM_STAT_SLAB_LOCK_CONTENDED);
+    page->lock.Lock();
+
+    if (!page->frozen && (page->obj_nr == this->page_obj_nr)) {
+        lib::list_del(&page->list);
+        n->partial_nr--;
+        page->lock.UnLock();
+        this->__put_empty(n, page);
+    } else {
+        page->lock.UnLock();
+    }
+
+    n->lock.UnLock();
+}
+
+/**
+ * Give all slabs back to the page allocator before destroying the cache,
+ * returning false if there are still objects in use.
+ */
+auto KMemCache::Release(void) -> bool
+{
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
+
+    /* objects in magazines go back to slabs first */
+    if (this->depot) {
+        for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+            KMemMagazineCPU *mc = this->depot->cpu.Of(cpu);
+
+            this->__magazine_release(mc->loaded);
+            this->__magazine_release(mc->prev);
+            mc->loaded = mc->prev = nullptr;
+        }
+
+        this->__depot_flush();
+    }
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        KMemCacheCPU *c = this->cpu_slab.Of(cpu);
+
+        this->__deactivate_slab(c);
+        this->__unfreeze_partials(c);
+    }
+
+    lib::local_irq_restore(flags);
+
+    for (auto nid = 0; nid < MAX_NUMNODES; nid++) {
+        this->Shrink(nid, ~0UL);
+    }
+
+    if (lib::atomic::atomic_read(&this->slab_nr)) {
+        return false;
+    }
+
+    unregister_shrinker(&this->shrinker);
+
+    if (this->depot) {
+        this->__depot_destroy();
+    }
+
+    return true;
+}
+
+auto KMemCache::Name(void) -> const char*
+{
+    return this->name;
+}
+
+auto KMemCache::ObjectSize(void) -> base::size_t
+{
+    return this->size;
+}
+
+/**
+ * Whether objects of the given attributes could be allocated from this cache,
+ * caches with constructors are never merged as their objects are not generic.
+ */
+auto KMemCache::__mergeable(base::size_t size, base::size_t align, base::size_t flags, kmem_ctor_t ctor) -> bool
+{
+    if (ctor || this->ctor || ((flags | this->flags) & KMEM_CACHE_NO_MERGE)) {
+        return false;
+    }
+
+    if ((flags ^ this->flags) & KMEM_CACHE_MAGAZINE) {
+        return false;
+    }
+
+    align = kmem_calc_align(size, align, flags);
+    size = kmem_align_up((size < sizeof(void*)) ? sizeof(void*) : size, align);
+
+    /* don't waste too much space for each object */
+    if (size > this->obj_sz || (this->obj_sz - size) >= sizeof(void*)) {
+        return false;
+    }
+
+    /* both the stride and the colours should keep the alignment */
+    return !(this->obj_sz & (align - 1)) && !(this->colour_off & (align - 1));
+}
+
+/* release up to `nr` pages of empty slabs on the node, returning the freed number */
+auto KMemCache::Shrink(base::size_t nid, base::size_t nr) -> base::size_t
+{
+    KMemCacheNode *n = &this->node[nid];
+    base::size_t freed = 0, flags;
+    Page *page;
+
+    if (!n->empty_nr) {
+        return 0;
+    }
+
+    /* the lock is also taken by frees in interrupt context */
+    flags = lib::local_irq_save();
+    mm_stat_lock(&n->lock, MM_STAT_SLAB_LOCK_CONTENDED);
+
+    while (freed < nr && !lib::list_empty(&n->empty)) {
+        page = lib::list_entry(n->empty.next, &Page::list);
+        lib::list_del(&page->list);
+        n->empty_nr--;
+        this->__discard_slab(page);
+        freed += (1UL << this->order);
+    }
+
+    n->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return freed;
+}
+
+auto KMemCache::__shrinker_count(Shrinker *shrinker, base::size_t nid) -> base::size_t
+{
+    KMemCache *kc = lib::container_of(shrinker, &KMemCache::shrinker);
+    base::size_t count = kc->node[nid].empty_nr << kc->order;
+
+    /**
+     * Objects in full magazines might make more slabs empty. The depot isn't
+     * split by node and they may come from any node, so they're counted for
+     * every node, as the most pages they could make empty.
+     */
+    if (kc->depot) {
+        count += (kc->depot->full_objs * kc->obj_sz) >> PAGE_SHIFT;
+    }
+
+    return count;
+}
+
+auto KMemCache::__shrinker_scan(Shrinker *shrinker, base::size_t nid, base::size_t nr) -> base::size_t
+{
+    KMemCache *kc = lib::container_of(shrinker, &KMemCache::shrinker);
+    base::size_t flags;
+
+    if (kc->depot) {
+        flags = lib::local_irq_save();
+        kc->__depot_flush();
+        lib::local_irq_restore(flags);
+    }
+
+    return kc->Shrink(nid, nr);
+}
+
+/* General front end of KMemCache */
+class KHeapPool {
+public:
+    KHeapPool(void);
+    ~KHeapPool();
+
+    auto Malloc(base::size_t size) -> void*;
+    auto Free(void *obj) -> void;
+
+    auto PageAlloc(base::size_t order) -> Page*;
+    auto PageFree(Page *p) -> void;
+
+    auto Init(void) -> void;
+    auto SetKMemCaches(KMemCache **caches, base::size_t cache_nr, const base::size_t *cache_obj_sizes) -> void;
+    auto SetPagePools(PagePool **pools, base::size_t pool_nr) -> void;
+
+    auto CreateCache(const char *name,
+                     base::size_t size,
+                     base::size_t align,
+                     base::size_t flags,
+                     kmem_ctor_t ctor) -> KMemCache*;
+    auto DestroyCache(KMemCache *kc) -> int;
+
+    auto GetCacheStat(KMemCacheStat *stats, base::size_t start, base::size_t nr) -> base::size_t;
+
+    auto AdaptSizeClasses(void) -> base::size_t;
+    auto NewSizeSamples(void) -> base::size_t;
+    auto AddSizeSamples(const KMallocProfileEntry *profile, base::size_t nr) -> void;
+    auto DecaySizeSamples(base::size_t shift) -> void;
+    auto GetSizeProfile(KMallocProfileEntry *profile, base::size_t nr) -> base::size_t;
+    auto GetClassStat(KMallocClassStat *stats, base::size_t nr) -> base::size_t;
+
+private:
+    /* all caches, including default ones, for merging */
+    lib::ListHead cache_list;
+    lib::atomic::SpinLock cache_lock;
+
+    /* pools given to newly created caches */
+    PagePool *cache_pools[CACHE_POOL_MAX_NR];
+    base::size_t cache_pool_nr;
+
+    KMemCache *caches[KMALLOC_CLASS_MAX_NR];
+    base::size_t cache_nr;
+    base::size_t cache_obj_sizes[KMALLOC_CLASS_MAX_NR];
+    base::uint8_t size_index[KMALLOC_SIZE_INDEX_NR];
+
+    auto __malloc_caches(base::size_t size) -> void*;
+
+    /* sampled sizes, and classes spawned from them */
+    lib::PerCPU<base::size_t> sample_seq;
+    volatile base::size_t size_samples[KMALLOC_SIZE_INDEX_NR];
+    volatile base::size_t new_samples;  /* sampled since the last adapting */
+    char class_names[KMALLOC_CLASS_MAX_NR][16];
+    lib::atomic::SpinLock class_lock;
+
+    auto __spawn_class(base::size_t first, base::size_t last) -> bool;
+
+    /* pools sorted by distance to each node */
+    PagePool *pools[MAX_NUMNODES][CACHE_POOL_MAX_NR];
+    base::size_t pool_nr[MAX_NUMNODES];
+
+    auto __malloc_pools(base::size_t size) -> void*;
+};
+
+static base::uint8_t GloblKHeapPoolMem[sizeof(KHeapPool)];
+KHeapPool *GloblKHeapPool = (KHeapPool*) &GloblKHeapPoolMem;
+
+KHeapPool::KHeapPool(void)
+{
+    /* do nothing */    
+}
+
+KHeapPool::~KHeapPool()
+{
+    /* do nothing */
+}
+
+auto KHeapPool::Malloc(base::size_t size) -> void*
 {
     void *obj = nullptr;
 
@@ -347,23 +1307,39 @@ auto KHeapPool::Malloc(base::size_t size) -> void*
 
 auto KHeapPool::__malloc_caches(base::size_t size) -> void*
 {
-    void *obj = nullptr;
+    base::uint8_t index;
+    void *obj;
 
-    for (auto i = 0; i < this->cache_nr; i++) {
-        if (size <= this->cache_obj_sizes[i]) {
-            obj = this->caches[i]->Malloc();
-            if (obj) {
-                break;
-            }
-        }
+    if (size > KMALLOC_MAX_CACHE_SIZE) {
+        count_mm_event(MM_STAT_KMALLOC_LARGE);
+        return nullptr;
     }
 
+    index = this->size_index[kmalloc_size_index(size)];
+    if (index == KMALLOC_NO_CACHE) {
+        count_mm_event(MM_STAT_KMALLOC_LARGE);
+        return nullptr;
+    }
+
+    if (!(++(*this->sample_seq.This()) & ((1 << KMALLOC_SAMPLE_SHIFT) - 1))) {
+        lib::atomic::atomic_inc(&this->size_samples[kmalloc_size_index(size)]);
+        lib::atomic::atomic_inc(&this->new_samples);
+    }
+
+    obj = this->caches[index]->Malloc();
+    if (!obj) {
+        count_mm_event(MM_STAT_KMALLOC_FALLBACK);
+        return nullptr;
+    }
+
+    count_mm_event(MM_STAT_KMALLOC_WASTE, this->cache_obj_sizes[index] - size);
+
     return obj;
 }
 
 auto KHeapPool::__malloc_pools(base::size_t size) -> void*
 {
-    base::size_t order = 0, need = size;
+    base::size_t order = 0, need = size, nid;
     Page *obj;
 
     size >>= (PAGE_SHIFT + 1);
@@ -376,12 +1352,11 @@ auto KHeapPool::__malloc_pools(base::size_t size) -> void*
         order++;
     }
 
-    for (auto i = 0; i < this->pool_nr; i++) {
-        obj = this->pools[i]->AllocPages(order);
-        if (obj) {
-            get_page(obj);
-            return (void*) page_to_virt(obj);
-        }
+    nid = numa_node_id();
+    obj = alloc_pages_from(this->pools[nid], this->pool_nr[nid], order, GFP_KERNEL);
+    if (obj) {
+        get_page(obj);
+        return (void*) page_to_virt(obj);
     }
 
     /* we failed unexpectedly :( */
@@ -390,30 +1365,22 @@ auto KHeapPool::__malloc_pools(base::size_t size) -> void*
 
 auto KHeapPool::Free(void *obj) -> void
 {
-    Page *page;
+    Folio *folio;
 
-    page = get_head_page(virt_to_page((virt_addr_t) obj));
-    if (!page->kc) {
-        put_page(page);
+    folio = virt_to_folio((virt_addr_t) obj);
+    if (!folio_slab(folio)) {
+        folio_put(folio);
         return ;
     }
 
-    page->kc->Free(page, obj);
+    folio_slab(folio)->Free(&folio->page, obj);
 }
 
 auto KHeapPool::PageAlloc(base::size_t order) -> Page*
 {
-    Page *p;
-
-    for (auto i = 0; i < this->pool_nr; i++) {
-        p = this->pools[i]->AllocPages(order);
-        if (p) {
-            return p;
-        }
-    }
+    base::size_t nid = numa_node_id();
 
-    /* we failed unexpectedly :( */
-    return nullptr;
+    return alloc_pages_from(this->pools[nid], this->pool_nr[nid], order, GFP_KERNEL);
 }
 
 auto KHeapPool::PageFree(Page *p) -> void
@@ -422,32 +1389,761 @@ auto KHeapPool::PageFree(Page *p) -> void
      * XXX: We might need to check whether p->pool belongs to this KHeapPool in the future
      */
     if (p) {
-        p = get_head_page(p);
-        p->pool->FreePages(p, p->order);
+        Folio *folio = page_folio(p);
+        folio->page.pool->FreePages(&folio->page, folio_order(folio));
     }
 }
 
 auto KHeapPool::Init(void) -> void
 {
-    this->caches = nullptr;
     this->cache_nr = 0;
-    this->cache_obj_sizes = 0;
 
-    this->pools = nullptr;
-    this->pool_nr = 0;
+    for (auto i = 0; i < KMALLOC_SIZE_INDEX_NR; i++) {
+        this->size_index[i] = KMALLOC_NO_CACHE;
+        this->size_samples[i] = 0;
+    }
+
+    for (base::size_t cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        *this->sample_seq.Of(cpu) = 0;
+    }
+
+    this->new_samples = 0;
+
+    this->class_lock.Reset();
+
+    for (auto nid = 0; nid < MAX_NUMNODES; nid++) {
+        this->pool_nr[nid] = 0;
+    }
+
+    lib::list_head_init(&this->cache_list);
+    this->cache_lock.Reset();
+    this->cache_pool_nr = 0;
 }
 
-auto KHeapPool::SetKMemCaches(KMemCache **caches, base::size_t cache_nr, base::size_t *cache_obj_sizes) -> void
+/* caches should be sorted by object size in ascending order */
+auto KHeapPool::SetKMemCaches(KMemCache **caches, base::size_t cache_nr, const base::size_t *cache_obj_sizes) -> void
 {
-    this->caches = caches;
+    base::size_t curr = 0;
+
+    if (cache_nr > KMALLOC_CLASS_MAX_NR) {
+        cache_nr = KMALLOC_CLASS_MAX_NR;
+    }
+
+    for (base::size_t i = 0; i < cache_nr; i++) {
+        this->caches[i] = caches[i];
+        this->cache_obj_sizes[i] = cache_obj_sizes[i];
+    }
+
     this->cache_nr = cache_nr;
-    this->cache_obj_sizes = cache_obj_sizes;
+
+    this->cache_lock.Lock();
+    for (auto i = 0; i < cache_nr; i++) {
+        lib::list_add_prev(&this->cache_list, &caches[i]->list);
+    }
+    this->cache_lock.UnLock();
+
+    /* build the lookup table, mapping each size to the smallest fitting cache */
+    for (auto i = 0; i < KMALLOC_SIZE_INDEX_NR; i++) {
+        base::size_t size = i << KMALLOC_SIZE_INDEX_SHIFT;
+
+        while (curr < cache_nr && cache_obj_sizes[curr] < size) {
+            curr++;
+        }
+
+        this->size_index[i] = (curr < cache_nr) ? curr : KMALLOC_NO_CACHE;
+    }
 }
 
+/* pools are copied and sorted for each node, at most CACHE_POOL_MAX_NR of them are used */
 auto KHeapPool::SetPagePools(PagePool **pools, base::size_t pool_nr) -> void
 {
-    this->pools = pools;
-    this->pool_nr = pool_nr;
+    if (pool_nr > CACHE_POOL_MAX_NR) {
+        pool_nr = CACHE_POOL_MAX_NR;
+    }
+
+    for (base::size_t nid = 0; nid < MAX_NUMNODES; nid++) {
+        this->pool_nr[nid] = sort_pools_by_node(this->pools[nid], pools, pool_nr, nid);
+    }
+
+    for (base::size_t i = 0; i < pool_nr; i++) {
+        this->cache_pools[i] = pools[i];
+    }
+
+    this->cache_pool_nr = pool_nr;
+}
+
+/**
+ * Create a dedicated cache for objects of the size, a compatible existing
+ * cache is shared instead if there's one, unless KMEM_CACHE_NO_MERGE is given.
+ * The name should be valid until the cache is destroyed.
+ */
+auto KHeapPool::CreateCache(const char *name,
+                            base::size_t size,
+                            base::size_t align,
+                            base::size_t flags,
+                            kmem_ctor_t ctor) -> KMemCache*
+{
+    KMemCache *kc;
+
+    if (!size || size > KMALLOC_MAX_CACHE_SIZE || (align & (align - 1))) {
+        return nullptr;
+    }
+
+    this->cache_lock.Lock();
+
+    for (auto l = this->cache_list.next; l != &this->cache_list; l = l->next) {
+        kc = lib::list_entry(l, &KMemCache::list);
+
+        if (kc->__mergeable(size, align, flags, ctor)) {
+            kc->refcount++;
+            this->cache_lock.UnLock();
+            return kc;
+        }
+    }
+
+    this->cache_lock.UnLock();
+
+    kc = (KMemCache*) this->Malloc(kmalloc_cache_aligned_size(sizeof(KMemCache)));
+    if (!kc) {
+        return nullptr;
+    }
+
+    kc->Init(name, size, align, flags, ctor);
+
+    for (base::size_t i = 0; i < this->cache_pool_nr; i++) {
+        kc->AddPool(this->cache_pools[i]);
+    }
+
+    this->cache_lock.Lock();
+    lib::list_add_prev(&this->cache_list, &kc->list);
+    this->cache_lock.UnLock();
+
+    return kc;
+}
+
+/* drop a reference to the cache, it's freed with the last one if all objects are freed */
+auto KHeapPool::DestroyCache(KMemCache *kc) -> int
+{
+    this->cache_lock.Lock();
+
+    if (--kc->refcount) {
+        this->cache_lock.UnLock();
+        return 0;
+    }
+
+    lib::list_del(&kc->list);
+
+    this->cache_lock.UnLock();
+
+    if (!kc->Release()) {
+        /* objects are still in use, keep the cache alive */
+        this->cache_lock.Lock();
+        kc->refcount++;
+        lib::list_add_prev(&this->cache_list, &kc->list);
+        this->cache_lock.UnLock();
+
+        return -EBUSY;
+    }
+
+    this->Free(kc);
+
+    return 0;
+}
+
+static auto kmalloc_class_name(char *buf, base::size_t size) -> void
+{
+    const char prefix[] = "kmalloc-";
+    char digits[20];
+    base::size_t nr = 0;
+
+    for (base::size_t i = 0; prefix[i]; i++) {
+        *buf++ = prefix[i];
+    }
+
+    do {
+        digits[nr++] = '0' + (size % 10);
+        size /= 10;
+    } while (size);
+
+    while (nr) {
+        *buf++ = digits[--nr];
+    }
+
+    *buf = '\0';
+}
+
+/**
+ * Natural alignment of a spawned size class, i.e. the largest power of 2
+ * dividing its size, up to a cache line. It's what objects laid out with the
+ * size as stride get anyway, so nothing is padded.
+ */
+static auto kmalloc_class_align(base::size_t size) -> base::size_t
+{
+    base::size_t align = size & -size;
+
+    return (align < lib::CACHE_LINE_SIZE) ? align : lib::CACHE_LINE_SIZE;
+}
+
+/**
+ * Split the class serving buckets [first, last] if its sampled requests waste
+ * too much space, the new class serves buckets up to the size minimizing the
+ * waste of both.
+ */
+auto KHeapPool::__spawn_class(base::size_t first, base::size_t last) -> bool
+{
+    base::size_t class_size = this->cache_obj_sizes[this->size_index[first]];
+    base::size_t samples = 0, wasted = 0, below = 0, split = 0, cost, best;
+    base::size_t index = this->cache_nr;
+    KMemCache *kc;
+
+    for (base::size_t i = first; i <= last; i++) {
+        samples += this->size_samples[i];
+        wasted += this->size_samples[i] * (class_size - (i << KMALLOC_SIZE_INDEX_SHIFT));
+    }
+
+    if (samples < KMALLOC_ADAPT_MIN_SAMPLES
+        || wasted * 1000 <= samples * class_size * KMALLOC_ADAPT_WASTE_PERMILLE) {
+        return false;
+    }
+
+    /* space taken by samples after the split, which only differs from waste by a constant */
+    best = samples * class_size;
+    for (base::size_t i = first; i < last; i++) {
+        below += this->size_samples[i];
+
+        /* samples keep coming in, don't let them overflow the total */
+        if (below > samples) {
+            break;
+        }
+
+        cost = (i << KMALLOC_SIZE_INDEX_SHIFT) * below + class_size * (samples - below);
+        if (cost < best) {
+            best = cost;
+            split = i;
+        }
+    }
+
+    /* it's not worth a new cache unless it cuts at least a quarter of the waste */
+    if (!split || (samples * class_size - best) * 4 < wasted) {
+        return false;
+    }
+
+    kmalloc_class_name(this->class_names[index], split << KMALLOC_SIZE_INDEX_SHIFT);
+
+    kc = this->CreateCache(this->class_names[index],
+                           split << KMALLOC_SIZE_INDEX_SHIFT,
+                           kmalloc_class_align(split << KMALLOC_SIZE_INDEX_SHIFT),
+                           0,
+                           nullptr);
+    if (!kc) {
+        return false;
+    }
+
+    this->caches[index] = kc;
+    this->cache_obj_sizes[index] = split << KMALLOC_SIZE_INDEX_SHIFT;
+    this->cache_nr++;
+
+    /* Malloc() looks up the table without locks, publish the class at last */
+    barrier();
+
+    for (base::size_t i = first; i <= split; i++) {
+        this->size_index[i] = index;
+    }
+
+    return true;
+}
+
+/**
+ * Spawn size classes from sampled sizes, at most one for each existing class
+ * in a pass, returning the number spawned. It allocates memory and takes time,
+ * so it should be called at idle time.
+ */
+auto KHeapPool::AdaptSizeClasses(void) -> base::size_t
+{
+    base::size_t first = 1, last, spawned = 0;
+    base::uint8_t index;
+
+    if (!this->class_lock.TryLock()) {
+        return 0;
+    }
+
+    this->new_samples = 0;
+
+    /* buckets served by the same class are contiguous in the lookup table */
+    while (first < KMALLOC_SIZE_INDEX_NR && this->cache_nr < KMALLOC_CLASS_MAX_NR) {
+        index = this->size_index[first];
+
+        for (last = first; last + 1 < KMALLOC_SIZE_INDEX_NR; last++) {
+            if (this->size_index[last + 1] != index) {
+                break;
+            }
+        }
+
+        if (index != KMALLOC_NO_CACHE && this->__spawn_class(first, last)) {
+            spawned++;
+        }
+
+        first = last + 1;
+    }
+
+    this->class_lock.UnLock();
+
+    return spawned;
+}
+
+/* number of sizes sampled since classes were adapted last time */
+auto KHeapPool::NewSizeSamples(void) -> base::size_t
+{
+    return this->new_samples;
+}
+
+/* add a recorded profile to sampled sizes, e.g. to build size classes at boot */
+auto KHeapPool::AddSizeSamples(const KMallocProfileEntry *profile, base::size_t nr) -> void
+{
+    for (base::size_t i = 0; i < nr; i++) {
+        if (profile[i].size && profile[i].size <= KMALLOC_MAX_CACHE_SIZE) {
+            base::size_t index = kmalloc_size_index(profile[i].size);
+
+            this->size_samples[index] = this->size_samples[index] + profile[i].count;
+        }
+    }
+}
+
+/* age sampled sizes by `shift` bits, so that classes follow the workload */
+auto KHeapPool::DecaySizeSamples(base::size_t shift) -> void
+{
+    for (auto i = 0; i < KMALLOC_SIZE_INDEX_NR; i++) {
+        this->size_samples[i] = (shift < 64) ? (this->size_samples[i] >> shift) : 0;
+    }
+}
+
+/* fill at most `nr` buckets with samples, returning the number filled */
+auto KHeapPool::GetSizeProfile(KMallocProfileEntry *profile, base::size_t nr) -> base::size_t
+{
+    base::size_t filled = 0;
+
+    for (auto i = 1; i < KMALLOC_SIZE_INDEX_NR && filled < nr; i++) {
+        if (this->size_samples[i]) {
+            profile[filled].size = i << KMALLOC_SIZE_INDEX_SHIFT;
+            profile[filled].count = this->size_samples[i];
+            filled++;
+        }
+    }
+
+    return filled;
+}
+
+/**
+ * Fill sampled usage of at most `nr` size classes, indexed in the order they
+ * were set up or spawned. Waste is estimated by the bucket size of samples,
+ * so it could be less than the real one by up to 7 bytes for each.
+ */
+auto KHeapPool::GetClassStat(KMallocClassStat *stats, base::size_t nr) -> base::size_t
+{
+    base::uint8_t index;
+
+    if (nr > this->cache_nr) {
+        nr = this->cache_nr;
+    }
+
+    for (base::size_t i = 0; i < nr; i++) {
+        stats[i].size = this->cache_obj_sizes[i];
+        stats[i].samples = stats[i].wasted = 0;
+    }
+
+    for (auto i = 1; i < KMALLOC_SIZE_INDEX_NR; i++) {
+        index = this->size_index[i];
+        if (index < nr) {
+            stats[index].samples += this->size_samples[i];
+            stats[index].wasted += this->size_samples[i] * (stats[index].size - (i << KMALLOC_SIZE_INDEX_SHIFT));
+        }
+    }
+
+    return nr;
+}
+
+/* fill stats of at most `nr` caches from the `start`-th one, returning the number filled */
+auto KHeapPool::GetCacheStat(KMemCacheStat *stats, base::size_t start, base::size_t nr) -> base::size_t
+{
+    base::size_t i = 0, filled = 0;
+
+    this->cache_lock.Lock();
+
+    for (auto l = this->cache_list.next; l != &this->cache_list && filled < nr; l = l->next, i++) {
+        if (i >= start) {
+            lib::list_entry(l, &KMemCache::list)->GetStat(&stats[filled++]);
+        }
+    }
+
+    this->cache_lock.UnLock();
+
+    return filled;
+}
+
+/**
+ * Magazine layer of KMemCache, all of them are called with local interrupts
+ * disabled, and magazines are allocated from the kernel heap.
+ */
+
+auto KMemCache::__depot_create(void) -> KMemDepot*
+{
+    KMemDepot *d;
+
+    d = (KMemDepot*) GloblKHeapPool->Malloc(kmalloc_cache_aligned_size(sizeof(KMemDepot)));
+    if (!d) {
+        return nullptr;
+    }
+
+    lib::list_head_init(&d->full);
+    d->full_nr = 0;
+    d->full_objs = 0;
+    lib::list_head_init(&d->empty);
+    d->empty_nr = 0;
+    d->mag_size = KMEM_MAG_SIZE_MIN;
+    d->contention = 0;
+    d->lock.Reset();
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        KMemMagazineCPU *mc = d->cpu.Of(cpu);
+
+        mc->loaded = mc->prev = nullptr;
+        mc->alloc_hit = mc->alloc_miss = 0;
+        mc->free_hit = mc->free_miss = 0;
+    }
+
+    return d;
+}
+
+/* magazines should have been flushed */
+auto KMemCache::__depot_destroy(void) -> void
+{
+    GloblKHeapPool->Free(this->depot);
+    this->depot = nullptr;
+}
+
+/* lock the depot, and grow magazines if we're contending for it too much */
+auto KMemCache::__depot_lock(void) -> void
+{
+    KMemDepot *d = this->depot;
+
+    if (d->lock.TryLock()) {
+        return ;
+    }
+
+    d->lock.Lock();
+
+    if (++d->contention >= KMEM_DEPOT_CONTENTION_MAX && d->mag_size < KMEM_MAG_SIZE_MAX) {
+        /* the header takes 4 pointers, keep the whole a power of 2 */
+        d->mag_size = d->mag_size * 2 + 4;
+        d->contention = 0;
+    }
+}
+
+/* take an empty magazine of current size from the depot, or allocate one */
+auto KMemCache::__depot_get_empty(void) -> KMemMagazine*
+{
+    KMemDepot *d = this->depot;
+    KMemMagazine *mag = nullptr;
+    base::size_t size;
+
+    this->__depot_lock();
+
+    if (!lib::list_empty(&d->empty)) {
+        mag = lib::list_entry(d->empty.next, &KMemMagazine::list);
+        lib::list_del(&mag->list);
+        d->empty_nr--;
+    }
+
+    size = d->mag_size;
+
+    d->lock.UnLock();
+
+    if (mag && mag->size >= size) {
+        return mag;
+    }
+
+    /* it's been too small since magazines grew */
+    if (mag) {
+        GloblKHeapPool->Free(mag);
+    }
+
+    mag = (KMemMagazine*) GloblKHeapPool->Malloc(sizeof(KMemMagazine) + size * sizeof(void*));
+    if (mag) {
+        mag->rounds = 0;
+        mag->size = size;
+    }
+
+    return mag;
+}
+
+/* give all objects in the magazine back to slabs */
+auto KMemCache::__magazine_drain(KMemMagazine *mag) -> void
+{
+    void *obj;
+
+    while (mag->rounds) {
+        obj = mag->objs[--mag->rounds];
+        this->__slab_free(&virt_to_folio((virt_addr_t) obj)->page, obj);
+    }
+}
+
+/* give all objects in the magazine back to slabs, and free the magazine */
+auto KMemCache::__magazine_release(KMemMagazine *mag) -> void
+{
+    if (mag) {
+        this->__magazine_drain(mag);
+        GloblKHeapPool->Free(mag);
+    }
+}
+
+/* free all magazines in the depot */
+auto KMemCache::__depot_flush(void) -> void
+{
+    KMemDepot *d = this->depot;
+    lib::ListHead full, empty;
+
+    lib::list_head_init(&full);
+    lib::list_head_init(&empty);
+
+    /* move them to local lists, so that slabs are not touched under the depot lock */
+    d->lock.Lock();
+
+    if (!lib::list_empty(&d->full)) {
+        lib::list_add(&full, d->full.prev, d->full.next);
+        lib::list_head_init(&d->full);
+    }
+
+    if (!lib::list_empty(&d->empty)) {
+        lib::list_add(&empty, d->empty.prev, d->empty.next);
+        lib::list_head_init(&d->empty);
+    }
+
+    d->full_nr = d->empty_nr = 0;
+    d->full_objs = 0;
+
+    d->lock.UnLock();
+
+    while (!lib::list_empty(&full)) {
+        KMemMagazine *mag = lib::list_entry(full.next, &KMemMagazine::list);
+
+        lib::list_del(&mag->list);
+        this->__magazine_release(mag);
+    }
+
+    while (!lib::list_empty(&empty)) {
+        KMemMagazine *mag = lib::list_entry(empty.next, &KMemMagazine::list);
+
+        lib::list_del(&mag->list);
+        GloblKHeapPool->Free(mag);
+    }
+}
+
+auto KMemCache::__magazine_alloc(void) -> void*
+{
+    KMemDepot *d = this->depot;
+    KMemMagazineCPU *mc = d->cpu.This();
+    KMemMagazine *mag;
+
+    if (mc->loaded && mc->loaded->rounds) {
+        goto hit;
+    }
+
+    if (mc->prev && mc->prev->rounds) {
+        mag = mc->loaded;
+        mc->loaded = mc->prev;
+        mc->prev = mag;
+        goto hit;
+    }
+
+    /* both are empty, exchange the previous one for a full one in the depot */
+    this->__depot_lock();
+
+    if (lib::list_empty(&d->full)) {
+        d->lock.UnLock();
+        mc->alloc_miss++;
+        return nullptr;
+    }
+
+    mag = lib::list_entry(d->full.next, &KMemMagazine::list);
+    lib::list_del(&mag->list);
+    d->full_nr--;
+    d->full_objs -= mag->rounds;
+
+    if (mc->prev) {
+        lib::list_add_next(&d->empty, &mc->prev->list);
+        d->empty_nr++;
+    }
+
+    d->lock.UnLock();
+
+    mc->prev = mc->loaded;
+    mc->loaded = mag;
+
+hit:
+    mc->alloc_hit++;
+
+    return mc->loaded->objs[--mc->loaded->rounds];
+}
+
+auto KMemCache::__magazine_free(void *obj) -> bool
+{
+    KMemDepot *d = this->depot;
+    KMemMagazineCPU *mc = d->cpu.This();
+    KMemMagazine *mag;
+
+    if (mc->loaded && mc->loaded->rounds < mc->loaded->size) {
+        goto hit;
+    }
+
+    if (mc->prev && mc->prev->rounds < mc->prev->size) {
+        mag = mc->loaded;
+        mc->loaded = mc->prev;
+        mc->prev = mag;
+        goto hit;
+    }
+
+    /* both are full, and there're too many cached objects, reuse the previous one */
+    if (mc->prev && d->full_nr >= KMEM_DEPOT_FULL_MAX) {
+        this->__magazine_drain(mc->prev);
+        mag = mc->loaded;
+        mc->loaded = mc->prev;
+        mc->prev = mag;
+        goto hit;
+    }
+
+    /* both are full, exchange the previous one for an empty one */
+    mag = this->__depot_get_empty();
+    if (!mag) {
+        mc->free_miss++;
+        return false;
+    }
+
+    if (mc->prev) {
+        this->__depot_lock();
+        lib::list_add_prev(&d->full, &mc->prev->list);
+        d->full_nr++;
+        d->full_objs += mc->prev->rounds;
+        d->lock.UnLock();
+    }
+
+    mc->prev = mc->loaded;
+    mc->loaded = mag;
+
+hit:
+    mc->free_hit++;
+    mc->loaded->objs[mc->loaded->rounds++] = obj;
+
+    return true;
+}
+
+/* sum up counters of all CPUs, returning false if there's no magazine layer */
+auto KMemCache::GetMagazineStat(KMemMagazineStat *stat) -> bool
+{
+    KMemDepot *d = this->depot;
+
+    if (!d) {
+        return false;
+    }
+
+    stat->alloc_hit = stat->alloc_miss = 0;
+    stat->free_hit = stat->free_miss = 0;
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        KMemMagazineCPU *mc = d->cpu.Of(cpu);
+
+        stat->alloc_hit += mc->alloc_hit;
+        stat->alloc_miss += mc->alloc_miss;
+        stat->free_hit += mc->free_hit;
+        stat->free_miss += mc->free_miss;
+    }
+
+    stat->full_nr = d->full_nr;
+    stat->empty_nr = d->empty_nr;
+    stat->mag_size = d->mag_size;
+
+    return true;
+}
+
+/**
+ * Sum up counters of all CPUs. As they're read without stopping others,
+ * active objects might be a little off while the cache is being used.
+ */
+auto KMemCache::GetStat(KMemCacheStat *stat) -> void
+{
+    for (auto i = 0; i < KMEM_STAT_ITEM_NR; i++) {
+        stat->events[i] = 0;
+    }
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        KMemCacheCPU *c = this->cpu_slab.Of(cpu);
+
+        for (auto i = 0; i < KMEM_STAT_ITEM_NR; i++) {
+            stat->events[i] += c->stat[i];
+        }
+    }
+
+    stat->name = this->name;
+    stat->obj_size = this->obj_sz;
+    stat->slabs = lib::atomic::atomic_read(&this->slab_nr);
+    stat->pages = stat->slabs << this->order;
+    stat->objects = stat->slabs * this->page_obj_nr;
+
+    if (stat->events[KMEM_STAT_ALLOC] > stat->events[KMEM_STAT_FREE]) {
+        stat->active_objects = stat->events[KMEM_STAT_ALLOC] - stat->events[KMEM_STAT_FREE];
+    } else {
+        stat->active_objects = 0;
+    }
+}
+
+auto kmem_cache_create(const char *name,
+                       base::size_t size,
+                       base::size_t align = 0,
+                       base::size_t flags = 0,
+                       kmem_ctor_t ctor = nullptr) -> KMemCache*
+{
+    return GloblKHeapPool->CreateCache(name, size, align, flags, ctor);
+}
+
+auto kmem_cache_destroy(KMemCache *kc) -> int
+{
+    return GloblKHeapPool->DestroyCache(kc);
+}
+
+__always_inline auto kmem_cache_alloc(KMemCache *kc) -> void*
+{
+    return kc->Malloc();
+}
+
+__always_inline auto kmem_cache_free(KMemCache *kc, void *obj) -> void
+{
+    kc->Free(&virt_to_folio((virt_addr_t) obj)->page, obj);
+}
+
+__always_inline auto kmem_cache_alloc_bulk(KMemCache *kc, base::size_t nr, void **objs) -> base::size_t
+{
+    return kc->MallocBulk(nr, objs);
+}
+
+__always_inline auto kmem_cache_free_bulk(KMemCache *kc, base::size_t nr, void **objs) -> void
+{
+    kc->FreeBulk(nr, objs);
+}
+
+/**
+ * Allocation with compile-time size, resolved to a default cache directly
+ * without looking up the table. Sizes beyond default caches go to the heap.
+ * NOTE: a failed cache means no page for a new slab, so there's no fallback.
+ */
+template <base::size_t Size>
+__always_inline auto kmalloc(void) -> void*
+{
+    constexpr base::size_t index = kmalloc_index(Size);
+
+    if constexpr (index < KOBJECT_SIZE_NR) {
+        return GloblKMemCacheGroup[index]->Malloc();
+    } else {
+        return GloblKHeapPool->Malloc(Size);
+    }
 }
 
 };
@@ -0,0 +1,259 @@
+export module kernel.mm:kstack;
+
+import :heap;
+import :layout;
+import :pages;
+import :pgtable;
+import :types;
+import :vmalloc;
+import kernel.base;
+import kernel.lib;
+
+#include <closureos/compiler.h>
+#include <closureos/errno.h>
+#include <asm/page_types.h>
+
+export namespace mm {
+
+/**
+ * Kernel stacks in the stack region.
+ *
+ * - each stack is mapped from single pages, with an unmapped guard page
+ *   below it, so an overflow faults instead of corrupting memory nearby
+ * - address space is managed by a VMapAllocator of its own, so stacks don't
+ *   compete with vmalloc() for the dynamic mapping region
+ * - recently freed stacks are kept mapped in a per-CPU cache, so that most
+ *   of allocations don't need to touch page tables, and most of frees don't
+ *   need to flush TLB, the cache of the reclaiming CPU is drained by a
+ *   shrinker
+ * - pages of stacks are unmovable, as a stack can't be migrated under its
+ *   running task
+ */
+
+inline constexpr base::size_t THREAD_SIZE_ORDER = 2;
+inline constexpr base::size_t THREAD_SIZE_PAGES = (1UL << THREAD_SIZE_ORDER);
+inline constexpr base::size_t THREAD_SIZE = (THREAD_SIZE_PAGES << PAGE_SHIFT);
+
+inline constexpr base::size_t KSTACK_GUARD_SIZE = PAGE_SIZE;
+
+/* max number of mapped stacks kept for each CPU */
+inline constexpr base::size_t KSTACK_CACHE_NR = 4;
+
+struct KStackCacheCPU {
+    virt_addr_t stacks[KSTACK_CACHE_NR];
+    base::size_t nr;
+};
+
+class KStackAllocator {
+public:
+    auto Init(virt_addr_t start, virt_addr_t end) -> void;
+
+    auto Alloc(gfp_t flags) -> void*;
+    auto Free(void *stack) -> void;
+    auto Drain(void) -> base::size_t;
+
+private:
+    VMapAllocator vmap;
+    lib::PerCPU<KStackCacheCPU> cpu_cache;
+    Shrinker shrinker;
+
+    auto __alloc_stack(gfp_t flags) -> virt_addr_t;
+    auto __free_stack(virt_addr_t stack) -> void;
+
+    static auto __shrinker_count(Shrinker *shrinker, base::size_t nid) -> base::size_t;
+    static auto __shrinker_scan(Shrinker *shrinker, base::size_t nid, base::size_t nr) -> base::size_t;
+};
+
+/* to avoid calling global initializer, we manually point it to mem */
+base::uint8_t GloblKStackAllocatorMem[sizeof(KStackAllocator)];
+KStackAllocator *GloblKStackAllocator = (KStackAllocator*) &GloblKStackAllocatorMem;
+
+auto KStackAllocator::Init(virt_addr_t start, virt_addr_t end) -> void
+{
+    this->vmap.Init(start, end);
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        this->cpu_cache.Of(cpu)->nr = 0;
+    }
+
+    this->shrinker.count = KStackAllocator::__shrinker_count;
+    this->shrinker.scan = KStackAllocator::__shrinker_scan;
+    register_shrinker(&this->shrinker);
+}
+
+/* map a new stack, returning its lowest address, or 0 on failure */
+auto KStackAllocator::__alloc_stack(gfp_t flags) -> virt_addr_t
+{
+    virt_addr_t stack;
+    VMapArea *va;
+    Page *page;
+
+    va = this->vmap.AllocArea(KSTACK_GUARD_SIZE + THREAD_SIZE, PAGE_SIZE, VMAP_AREA_VMALLOC);
+    if (!va) {
+        return 0;
+    }
+
+    stack = va->va_start + KSTACK_GUARD_SIZE;
+
+    for (base::size_t i = 0; i < THREAD_SIZE_PAGES; i++) {
+        page = alloc_pages(0, flags & ~__GFP_MOVABLE);
+        if (!page) {
+            goto err;
+        }
+
+        if (GloblKernPageTable->MapRange(stack + (i << PAGE_SHIFT), page_to_phys(page), PAGE_SIZE, PTE_ATTR_RW) < 0) {
+            free_pages(page, 0);
+            goto err;
+        }
+    }
+
+    return stack;
+
+err:
+    this->__free_stack(stack);
+
+    return 0;
+}
+
+/* unmap the stack and free its pages, TLB is flushed lazily by the allocator */
+auto KStackAllocator::__free_stack(virt_addr_t stack) -> void
+{
+    VMapArea *va = this->vmap.RemoveArea(stack - KSTACK_GUARD_SIZE);
+    phys_addr_t pa;
+
+    if (!va) {
+        return ;
+    }
+
+    for (virt_addr_t addr = stack; addr < va->va_end; addr += PAGE_SIZE) {
+        if (GloblKernPageTable->Translate(addr, &pa) == 0) {
+            free_pages(phys_to_page(pa), 0);
+        }
+    }
+
+    this->vmap.FreeArea(va);
+}
+
+/**
+ * Allocate a stack of THREAD_SIZE, returning its lowest address, the top of
+ * it is at (stack + THREAD_SIZE). A cached one is taken first if there is.
+ */
+auto KStackAllocator::Alloc(gfp_t flags) -> void*
+{
+    KStackCacheCPU *cache;
+    virt_addr_t stack = 0;
+    base::size_t irq_flags;
+
+    irq_flags = lib::local_irq_save();
+
+    cache = this->cpu_cache.This();
+    if (cache->nr) {
+        stack = cache->stacks[--cache->nr];
+    }
+
+    lib::local_irq_restore(irq_flags);
+
+    if (stack) {
+        count_mm_event(MM_STAT_KSTACK_CACHE_HIT);
+    } else {
+        stack = this->__alloc_stack(flags);
+    }
+
+    if (stack) {
+        count_mm_event(MM_STAT_KSTACK_ALLOC);
+    }
+
+    return (void*) stack;
+}
+
+/* the stack is kept mapped in the cache if there's room */
+auto KStackAllocator::Free(void *stack) -> void
+{
+    KStackCacheCPU *cache;
+    base::size_t irq_flags;
+
+    irq_flags = lib::local_irq_save();
+
+    cache = this->cpu_cache.This();
+    if (cache->nr < KSTACK_CACHE_NR) {
+        cache->stacks[cache->nr++] = (virt_addr_t) stack;
+        lib::local_irq_restore(irq_flags);
+        return ;
+    }
+
+    lib::local_irq_restore(irq_flags);
+
+    this->__free_stack((virt_addr_t) stack);
+}
+
+/**
+ * Give back stacks cached by this CPU, returning the number of freed pages.
+ * NOTE: stacks cached by other CPUs are never reclaimed, as their caches are
+ * only touched by themselves.
+ */
+auto KStackAllocator::Drain(void) -> base::size_t
+{
+    KStackCacheCPU *cache;
+    base::size_t irq_flags, freed = 0;
+    virt_addr_t stack;
+
+    for (;;) {
+        irq_flags = lib::local_irq_save();
+
+        cache = this->cpu_cache.This();
+        stack = cache->nr ? cache->stacks[--cache->nr] : 0;
+
+        lib::local_irq_restore(irq_flags);
+
+        if (!stack) {
+            break;
+        }
+
+        this->__free_stack(stack);
+        freed += THREAD_SIZE_PAGES;
+    }
+
+    this->vmap.Purge();
+
+    return freed;
+}
+
+/* pages of cached stacks may come from any node, so they're counted for every node */
+auto KStackAllocator::__shrinker_count(Shrinker *shrinker, base::size_t nid) -> base::size_t
+{
+    KStackAllocator *ka = lib::container_of(shrinker, &KStackAllocator::shrinker);
+
+    (void) nid;
+
+    return ka->cpu_cache.This()->nr * THREAD_SIZE_PAGES;
+}
+
+/* the cache is small, so it's always drained as a whole */
+auto KStackAllocator::__shrinker_scan(Shrinker *shrinker, base::size_t nid, base::size_t nr) -> base::size_t
+{
+    KStackAllocator *ka = lib::container_of(shrinker, &KStackAllocator::shrinker);
+
+    (void) nid;
+    (void) nr;
+
+    return ka->Drain();
+}
+
+auto alloc_kernel_stack(gfp_t flags = GFP_KERNEL) -> void*
+{
+    return GloblKStackAllocator->Alloc(flags);
+}
+
+auto free_kernel_stack(void *stack) -> void
+{
+    if (stack) {
+        GloblKStackAllocator->Free(stack);
+    }
+}
+
+__always_inline auto kernel_stack_top(void *stack) -> virt_addr_t
+{
+    return (virt_addr_t) stack + THREAD_SIZE;
+}
+
+};
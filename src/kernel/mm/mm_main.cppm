@@ -1,41 +1,533 @@
 export module kernel.mm;
+export import :dma;
 export import :heap;
+export import :kstack;
 export import :layout;
 export import :pages;
+export import :pgtable;
 export import :types;
+export import :vmalloc;
 
 import kernel.base;
 import kernel.lib;
 
+#include <asm/tlbflush.h>
+#include <asm/tsc.h>
+
+/* temporarily here, remove sooon... */
+extern "C" {
+#include <boot/tty.h>
+};
+
 export namespace mm {
 
+/**
+ * Seed the buddy with free ranges handed over by booting stage allocator,
+ * ranges are split by nodes, and then at the 4GB boundary into the DMA32
+ * and Normal zones of the node.
+ */
 static auto pages_pool_init(void) -> void
 {
-    GloblPagePool->Init();
+    base::size_t seeded = 0, nid;
+    base::uint64_t start_tsc;
+    pfn_t start, end, node_end;
+
+    numa_init();
+    shrinker_init();
+
+    for (nid = 0; nid < MAX_NUMNODES; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            node_page_pool(nid, i)->Init(nid);
+        }
+    }
+
+    start_tsc = rdtsc();
+
+    for (base::size_t i = 0; i < boot_free_range_nr; i++) {
+        for (start = boot_free_ranges[i].start; start < boot_free_ranges[i].end; start = end) {
+            nid = pfn_to_nid(start, &node_end);
+            end = boot_free_ranges[i].end < node_end ? boot_free_ranges[i].end : node_end;
+
+            if (start < DMA32_PFN_LIMIT && end > DMA32_PFN_LIMIT) {
+                end = DMA32_PFN_LIMIT;
+            }
+
+            seeded += node_page_pool(
+                nid,
+                start < DMA32_PFN_LIMIT ? PAGE_POOL_TYPE_DMA32 : PAGE_POOL_TYPE_NORMAL
+            )->AddPagesRange(start, end);
+        }
+    }
+
+    build_page_pool_zonelists();
+    setup_page_pool_watermarks();
+
+    boot_printstr("[*] buddy seeded with ");
+    boot_printnum(seeded);
+    boot_printstr(" pages in ");
+    boot_printnum(boot_free_range_nr);
+    boot_printstr(" ranges on ");
+    boot_printnum(numa_node_nr);
+    boot_printstr(" nodes, took ");
+    boot_printnum(rdtsc() - start_tsc);
+    boot_puts(" TSC cycles.");
+}
+
+/* sampled usage of kmalloc size classes before and after adapting them */
+static KMallocClassStat kmalloc_class_stat[2][KMALLOC_CLASS_MAX_NR];
+
+static auto kmalloc_report_classes(base::size_t before_nr, base::size_t after_nr) -> void
+{
+    boot_puts("[*] kmalloc size classes adapted, bytes wasted by sampled allocations:");
+
+    for (base::size_t i = 0; i < after_nr; i++) {
+        boot_printstr("    ");
+        boot_printnum(kmalloc_class_stat[1][i].size);
+        boot_printstr(": ");
 
-    for (auto i = 0; i < pgdb_page_nr; i++) {
-        if (pgdb_base[i].type == PAGE_NORMAL_MEM && pgdb_base[i].ref_count < 0) {
-            GloblPagePool->AddPages(&pgdb_base[i], 0);
+        if (i < before_nr) {
+            boot_printnum(kmalloc_class_stat[0][i].wasted);
+        } else {
+            boot_printstr("new");
         }
+
+        boot_printstr(" -> ");
+        boot_printnum(kmalloc_class_stat[1][i].wasted);
+        boot_puts("");
+    }
+}
+
+/**
+ * Spawn kmalloc size classes where sampled sizes waste too much space, and
+ * report waste of each class. Callers should be serialized, e.g. the idle loop.
+ */
+auto kmalloc_adapt_size_classes(void) -> base::size_t
+{
+    base::size_t before_nr, after_nr, spawned;
+
+    /* the histogram has hardly changed since the last pass, don't walk it again */
+    if (GloblKHeapPool->NewSizeSamples() < KMALLOC_ADAPT_MIN_SAMPLES) {
+        return 0;
     }
+
+    before_nr = GloblKHeapPool->GetClassStat(kmalloc_class_stat[0], KMALLOC_CLASS_MAX_NR);
+
+    spawned = GloblKHeapPool->AdaptSizeClasses();
+    if (!spawned) {
+        return 0;
+    }
+
+    after_nr = GloblKHeapPool->GetClassStat(kmalloc_class_stat[1], KMALLOC_CLASS_MAX_NR);
+    kmalloc_report_classes(before_nr, after_nr);
+
+    /* old samples have been served, let new ones weigh more */
+    GloblKHeapPool->DecaySizeSamples(1);
+
+    return spawned;
 }
 
+/* build kmalloc size classes from a recorded profile, with its samples dropped after */
+auto kmalloc_load_size_profile(const KMallocProfileEntry *profile, base::size_t nr) -> base::size_t
+{
+    base::size_t before_nr, after_nr, spawned = 0, n;
+
+    GloblKHeapPool->AddSizeSamples(profile, nr);
+    before_nr = GloblKHeapPool->GetClassStat(kmalloc_class_stat[0], KMALLOC_CLASS_MAX_NR);
+
+    while ((n = GloblKHeapPool->AdaptSizeClasses()) > 0) {
+        spawned += n;
+    }
+
+    if (spawned) {
+        after_nr = GloblKHeapPool->GetClassStat(kmalloc_class_stat[1], KMALLOC_CLASS_MAX_NR);
+        kmalloc_report_classes(before_nr, after_nr);
+    }
+
+    GloblKHeapPool->DecaySizeSamples(64);
+
+    return spawned;
+}
+
+#ifdef CONFIG_KMALLOC_PROFILE
+/* lines of "{ size, count }," recorded by `mmsim --profile-out` */
+static constexpr KMallocProfileEntry kmalloc_boot_profile[] = {
+#include CONFIG_KMALLOC_PROFILE
+};
+#endif
+
+/* caches and the heap take pools of all nodes, they'll be sorted by distance */
 static auto kheap_pool_init(void) -> void
 {
+    PagePool *pools[MAX_NUMNODES * PAGE_POOL_TYPE_NR];
+    base::size_t pool_nr = 0;
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            if (node_page_pool(nid, i)->ManagedPages()) {
+                pools[pool_nr++] = node_page_pool(nid, i);
+            }
+        }
+    }
+
     for (auto i = 0; i < KOBJECT_SIZE_NR; i++) {
-        GloblKMemCacheGroup[i]->Init(kobj_default_size[i]);
-        GloblKMemCacheGroup[i]->AddPool(GloblPagePool);
+        GloblKMemCacheGroup[i]->Init(kobj_default_name[i], kobj_default_size[i]);
+
+        for (base::size_t j = 0; j < pool_nr; j++) {
+            GloblKMemCacheGroup[i]->AddPool(pools[j]);
+        }
     }
 
     GloblKHeapPool->Init();
     GloblKHeapPool->SetKMemCaches(GloblKMemCacheGroup, KOBJECT_SIZE_NR, kobj_default_size);
-    GloblKHeapPool->SetPagePools(GloblPagePoolGroup, PAGE_POOL_TYPE_NR);
+    GloblKHeapPool->SetPagePools(pools, pool_nr);
+
+#ifdef CONFIG_KMALLOC_PROFILE
+    kmalloc_load_size_profile(kmalloc_boot_profile, sizeof(kmalloc_boot_profile) / sizeof(kmalloc_boot_profile[0]));
+#endif
+}
+
+/* take over the page table built at booting stage */
+static auto kern_pgtable_init(void) -> void
+{
+    GloblKernPageTable->Init(read_cr3());
+}
+
+static auto vmalloc_init(void) -> void
+{
+    GloblVMapAllocator->Init(vmremap_base, KERN_DYNAMIC_MAP_REGION_END + 1);
+}
+
+static auto kstack_init(void) -> void
+{
+    GloblKStackAllocator->Init(KERN_STACK_REGION_BASE, KERN_STACK_REGION_END + 1);
 }
 
+/* it's after the heap is ready, but before memory is taken by others */
+static auto dma_cma_init(void) -> void
+{
+    CMAStat stat;
+
+    if (cma_init(CMA_DEFAULT_PAGES) < 0) {
+        boot_puts("[!] Warning: no memory for the CMA area, large coherent DMA buffers will rely on the buddy.");
+        return;
+    }
+
+    GloblCMAArea->GetStat(&stat);
+
+    boot_printstr("[*] CMA area of ");
+    boot_printnum(stat.count);
+    boot_printstr(" pages reserved at pfn 0x");
+    boot_printhex(stat.base_pfn);
+    boot_puts(".");
+}
+
+/* allocator statistics of the whole system */
+struct MMStat {
+    base::size_t events[MM_STAT_ITEM_NR];
+    base::size_t managed_pages;
+    FreeAreaStat area;          /* summed up over all pools */
+    base::size_t slab_pages;
+};
+
+auto mm_stat_snapshot(MMStat *stat) -> void
+{
+    KMemCacheStat caches[8];
+    base::size_t start = 0, nr;
+    FreeAreaStat area;
+
+    for (auto i = 0; i < MM_STAT_ITEM_NR; i++) {
+        stat->events[i] = sum_mm_event((mm_stat_item) i);
+    }
+
+    stat->managed_pages = 0;
+    stat->area.free_pages = stat->area.pcp_pages = 0;
+
+    for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+        stat->area.free_blocks[order] = 0;
+    }
+
+    for (auto type = 0; type < MIGRATE_TYPES; type++) {
+        stat->area.free_pages_type[type] = 0;
+    }
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            PagePool *pool = node_page_pool(nid, i);
+
+            if (!pool->ManagedPages()) {
+                continue;
+            }
+
+            pool->GetFreeAreaStat(&area);
+
+            stat->managed_pages += pool->ManagedPages();
+            stat->area.free_pages += area.free_pages;
+            stat->area.pcp_pages += area.pcp_pages;
+
+            for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+                stat->area.free_blocks[order] += area.free_blocks[order];
+            }
+
+            for (auto type = 0; type < MIGRATE_TYPES; type++) {
+                stat->area.free_pages_type[type] += area.free_pages_type[type];
+            }
+        }
+    }
+
+    stat->slab_pages = 0;
+    while ((nr = GloblKHeapPool->GetCacheStat(caches, start, 8)) > 0) {
+        for (base::size_t i = 0; i < nr; i++) {
+            stat->slab_pages += caches[i].pages;
+        }
+
+        start += nr;
+    }
+}
+
+static auto mm_stat_dump_free_area(const FreeAreaStat *area) -> void
+{
+    boot_printstr("    free blocks:");
+    for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+        boot_printstr(" ");
+        boot_printnum(area->free_blocks[order]);
+    }
+    boot_puts("");
+
+    boot_printstr("    fragmentation index:");
+    for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+        boot_printstr(" ");
+        boot_printnum(fragmentation_index(area, order));
+    }
+    boot_puts("");
+
+    boot_printstr("    unusable free index:");
+    for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+        boot_printstr(" ");
+        boot_printnum(unusable_free_index(area, order));
+    }
+    boot_puts("");
+}
+
+/* print all statistics to the console, for people debugging the allocators */
+auto mm_stat_dump(void) -> void
+{
+    KMemCacheStat caches[8];
+    base::size_t start = 0, nr;
+    FreeAreaStat area;
+    CMAStat cma;
+    MMStat stat;
+
+    mm_stat_snapshot(&stat);
+
+    boot_puts("[*] mm statistics:");
+
+    for (auto i = 0; i < MM_STAT_ITEM_NR; i++) {
+        boot_printstr("  ");
+        boot_printstr(mm_stat_item_name[i]);
+        boot_printstr(": ");
+        boot_printnum(stat.events[i]);
+        boot_puts("");
+    }
+
+    boot_printstr("  pages: ");
+    boot_printnum(stat.managed_pages);
+    boot_printstr(" managed, ");
+    boot_printnum(stat.area.free_pages);
+    boot_printstr(" free, ");
+    boot_printnum(stat.area.pcp_pages);
+    boot_printstr(" on pcp lists, ");
+    boot_printnum(stat.slab_pages);
+    boot_puts(" in slabs");
+
+    GloblCMAArea->GetStat(&cma);
+    boot_printstr("  CMA: ");
+    boot_printnum(cma.used);
+    boot_printstr("/");
+    boot_printnum(cma.count);
+    boot_puts(" pages taken");
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            PagePool *pool = node_page_pool(nid, i);
+
+            if (!pool->ManagedPages()) {
+                continue;
+            }
+
+            pool->GetFreeAreaStat(&area);
+
+            boot_printstr("  node ");
+            boot_printnum(nid);
+            boot_puts(i == PAGE_POOL_TYPE_DMA32 ? " DMA32:" : " Normal:");
+            mm_stat_dump_free_area(&area);
+        }
+    }
+
+    boot_puts("  caches (obj size, active/total objects, slabs, allocs, frees, slow allocs, slow frees):");
+    while ((nr = GloblKHeapPool->GetCacheStat(caches, start, 8)) > 0) {
+        for (base::size_t i = 0; i < nr; i++) {
+            boot_printstr("    ");
+            boot_printstr(caches[i].name);
+            boot_printstr(" ");
+            boot_printnum(caches[i].obj_size);
+            boot_printstr(" ");
+            boot_printnum(caches[i].active_objects);
+            boot_printstr("/");
+            boot_printnum(caches[i].objects);
+            boot_printstr(" ");
+            boot_printnum(caches[i].slabs);
+            boot_printstr(" ");
+            boot_printnum(caches[i].events[KMEM_STAT_ALLOC]);
+            boot_printstr(" ");
+            boot_printnum(caches[i].events[KMEM_STAT_FREE]);
+            boot_printstr(" ");
+            boot_printnum(caches[i].events[KMEM_STAT_ALLOC_SLOW]);
+            boot_printstr(" ");
+            boot_printnum(caches[i].events[KMEM_STAT_FREE_SLOW]);
+            boot_puts("");
+        }
+
+        start += nr;
+    }
+
+    boot_puts("  kmalloc size classes (size, sampled allocations, bytes wasted by them):");
+    nr = GloblKHeapPool->GetClassStat(kmalloc_class_stat[0], KMALLOC_CLASS_MAX_NR);
+    for (base::size_t i = 0; i < nr; i++) {
+        boot_printstr("    ");
+        boot_printnum(kmalloc_class_stat[0][i].size);
+        boot_printstr(" ");
+        boot_printnum(kmalloc_class_stat[0][i].samples);
+        boot_printstr(" ");
+        boot_printnum(kmalloc_class_stat[0][i].wasted);
+        boot_puts("");
+    }
+}
+
+#ifdef CONFIG_MM_BENCHMARK
+/* compare per-object cost of the single-object and bulk slab interfaces */
+static auto kmem_bulk_benchmark(void) -> void
+{
+    constexpr base::size_t BATCH = 64, ROUNDS = 1024;
+    KMemCache *kc = GloblKMemCacheGroup[KOBJECT_64];
+    base::uint64_t start_tsc, single_tsc, bulk_tsc;
+    void *objs[BATCH];
+    base::size_t nr;
+
+    /* warm up slabs of the cache */
+    kc->FreeBulk(kc->MallocBulk(BATCH, objs), objs);
+
+    start_tsc = rdtsc();
+    for (base::size_t r = 0; r < ROUNDS; r++) {
+        for (nr = 0; nr < BATCH; nr++) {
+            if (!(objs[nr] = kc->Malloc())) {
+                break;
+            }
+        }
+
+        for (base::size_t i = 0; i < nr; i++) {
+            kc->Free(&virt_to_folio((virt_addr_t) objs[i])->page, objs[i]);
+        }
+
+        if (nr < BATCH) {
+            goto fail;
+        }
+    }
+    single_tsc = rdtsc() - start_tsc;
+
+    start_tsc = rdtsc();
+    for (base::size_t r = 0; r < ROUNDS; r++) {
+        nr = kc->MallocBulk(BATCH, objs);
+        kc->FreeBulk(nr, objs);
+
+        if (nr < BATCH) {
+            goto fail;
+        }
+    }
+    bulk_tsc = rdtsc() - start_tsc;
+
+    boot_printstr("[*] kmem bulk benchmark: ");
+    boot_printnum(single_tsc / (BATCH * ROUNDS));
+    boot_printstr(" cycles per object for single, ");
+    boot_printnum(bulk_tsc / (BATCH * ROUNDS));
+    boot_puts(" for bulk.");
+
+    return ;
+
+fail:
+    boot_puts("[x] kmem bulk benchmark: out of memory.");
+}
+
+/* compare __GFP_ZERO allocations with and without pre-zeroed pages */
+static auto zeroed_pages_benchmark(void) -> void
+{
+    constexpr base::size_t NR = 128;
+    base::uint64_t start_tsc, miss_tsc, hit_tsc;
+    ZeroPoolStat stat = { 0, 0, 0, 0, 0 }, pool_stat;
+    Page *pages[NR];
+
+    start_tsc = rdtsc();
+    for (base::size_t i = 0; i < NR; i++) {
+        pages[i] = alloc_pages(0, GFP_KERNEL | __GFP_ZERO);
+    }
+    miss_tsc = rdtsc() - start_tsc;
+
+    for (base::size_t i = 0; i < NR; i++) {
+        free_pages(pages[i], 0);
+    }
+
+    refill_zeroed_pages();
+
+    start_tsc = rdtsc();
+    for (base::size_t i = 0; i < NR; i++) {
+        pages[i] = alloc_pages(0, GFP_KERNEL | __GFP_ZERO);
+    }
+    hit_tsc = rdtsc() - start_tsc;
+
+    for (base::size_t i = 0; i < NR; i++) {
+        free_pages(pages[i], 0);
+    }
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            node_page_pool(nid, i)->GetZeroPoolStat(&pool_stat);
+
+            stat.hits += pool_stat.hits;
+            stat.misses += pool_stat.misses;
+            stat.zeroed_pages += pool_stat.zeroed_pages;
+            stat.zero_cycles += pool_stat.zero_cycles;
+            stat.nr += pool_stat.nr;
+        }
+    }
+
+    boot_printstr("[*] zeroed pages benchmark: ");
+    boot_printnum(miss_tsc / NR);
+    boot_printstr(" cycles per page for zeroing on allocation, ");
+    boot_printnum(hit_tsc / NR);
+    boot_printstr(" for pre-zeroed, ");
+    if (stat.hits + stat.misses) {
+        boot_printnum(stat.hits * 100 / (stat.hits + stat.misses));
+        boot_printstr("% hit rate, ");
+    }
+    boot_printstr("idle zeroing at ");
+    boot_printnum(stat.zero_cycles ? (stat.zeroed_pages * PAGE_SIZE * 1000 / stat.zero_cycles) : 0);
+    boot_puts(" bytes per 1000 cycles.");
+}
+#endif
+
 auto mm_core_init(void) -> void
 {
     pages_pool_init();
     kheap_pool_init();
+    dma_cma_init();
+    kern_pgtable_init();
+    vmalloc_init();
+    kstack_init();
+
+#ifdef CONFIG_MM_BENCHMARK
+    kmem_bulk_benchmark();
+    zeroed_pages_benchmark();
+    mm_stat_dump();
+#endif
 }
 
 };
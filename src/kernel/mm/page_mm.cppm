@@ -6,11 +6,15 @@ import kernel.base;
 import kernel.lib;
 
 #include <closureos/compiler.h>
+#include <closureos/errno.h>
+#include <asm/page.h>
+#include <asm/tsc.h>
 
 export namespace mm {
 
 class KMemCache;
 class PagePool;
+struct MovableOps;
 
 /**
  * Page-related definitions
@@ -32,6 +36,11 @@ enum page_type {
 enum migrate_type {
     MIGRATE_UNMOVABLE = 0,
     MIGRATE_MOVABLE,
+    MIGRATE_RECLAIMABLE,
+    MIGRATE_PCPTYPES,               /* types above are requested and cached on pcp lists */
+    MIGRATE_CMA = MIGRATE_PCPTYPES, /* reserved for contiguous allocations, lent to movable ones */
+    MIGRATE_ISOLATE,                /* being taken by a contiguous allocation, never allocated from */
+    MIGRATE_TYPES,
 };
 
 /**
@@ -41,36 +50,250 @@ enum migrate_type {
  * 
  * NOTE: we ONLY store some critical information at the head page, as it takes too long to assign the value
  * to every page, but only recording it at the head and to find the head at use is enough.
+ * A tail page of an allocated block keeps nothing but `compound_head`, which is written at allocation,
+ * while tails of a free block are never looked up, so they're left as they are.
  */
 struct Page {
 public:
-    lib::ListHead list;
+    union {
+        lib::ListHead list;
+        Page *compound_head;    /* used only when it's a tail of an allocated block */
+    };
     struct {
         /* for page allocator */
         unsigned type: 4;
-        unsigned migrate_type: 4;
+        unsigned migrate_type: 4;   /* freelist that the free block is on */
+        unsigned pageblock_type: 4; /* valid at the first page of a pageblock only */
         unsigned is_free: 1; /* already in freelist */
-        unsigned is_head: 1; /* head of a group of pages*/
+        unsigned is_head: 1; /* head of a group of pages, only heads change it */
         unsigned order: 4;
+        /* for slab allocator */
+        unsigned frozen: 1;  /* owned by a CPU's active slab or partial list */
     };
     lib::atomic::atomic_t ref_count;     /* -1 for free */
     lib::atomic::atomic_t map_count;     /* mapped count in processes */
     lib::atomic::SpinLock lock;
-    void **freelist;    /* used only when the slub is not a cpu partial */
+    union {
+        struct {
+            void **freelist;    /* used only when the slub is not a cpu partial */
+            base::size_t obj_nr;      /* used only when it's a slub page */
+        };
+        struct {
+            const MovableOps *mops;     /* used only when it's a movable page (no kc) */
+            base::size_t mops_private;  /* for the owner of the movable page */
+        };
+    };
     KMemCache *kc;  /* used only when it's a slub page */
     PagePool *pool; /* SHOULD remains unchanged after initialization */
-    base::size_t obj_nr;      /* used only when it's a slub page */
 
     /* unused area to make it page-aligned, maybe we can put sth else there? */
     base::size_t unused[0];
 } __attribute__((aligned(64)));
 
+/**
+ * Operations provided by the owner of a movable page, which is allocated with
+ * __GFP_MOVABLE and has `mops` set, so that compaction could migrate it.
+ * - isolate: stop the owner from freeing the page, false if it's busy now,
+ *            called with the pool lock held
+ * - migrate: copy the content from `src` to `dst` and switch all mappings to
+ *            `dst`, the owner takes over `dst` (with `mops` set) on success,
+ *            and `src` will be freed by compaction
+ * - putback: migration is given up, the owner could use the page as before
+ * `list` of an isolated page is used by compaction.
+ */
+struct MovableOps {
+    bool (*isolate)(Page *page);
+    int (*migrate)(Page *dst, Page *src);
+    void (*putback)(Page *page);
+};
+
 /* pages array representing all pages */
 Page *pgdb_base;
 base::size_t pgdb_page_nr;
 
 inline constexpr base::size_t PGDB_PG_PAGE_NR = (PAGE_SIZE / sizeof(Page));
 
+/* free physical memory ranges [start, end) handed over by booting stage allocator */
+struct PFNRange {
+    pfn_t start;
+    pfn_t end;
+};
+
+inline constexpr base::size_t BOOT_FREE_RANGE_MAX_NR = 256;
+
+PFNRange boot_free_ranges[BOOT_FREE_RANGE_MAX_NR];
+base::size_t boot_free_range_nr;
+
+/**
+ * NUMA topology, handed over by booting stage from ACPI SRAT and SLIT.
+ * Memory not covered by any node range belongs to node 0.
+ */
+
+inline constexpr base::size_t MAX_NUMNODES = 8;
+inline constexpr base::size_t NUMA_NODE_RANGE_MAX_NR = 64;
+
+inline constexpr base::uint8_t NUMA_LOCAL_DISTANCE = 10;
+inline constexpr base::uint8_t NUMA_REMOTE_DISTANCE = 20;
+
+struct NodeRange {
+    pfn_t start;
+    pfn_t end;
+    base::size_t nid;
+};
+
+base::size_t numa_node_nr;
+NodeRange numa_node_ranges[NUMA_NODE_RANGE_MAX_NR];
+base::size_t numa_node_range_nr;
+base::uint8_t numa_distance[MAX_NUMNODES][MAX_NUMNODES];
+base::size_t numa_cpu_node[lib::NR_CPUS];
+
+__always_inline auto numa_node_id(void) -> base::size_t
+{
+    return numa_cpu_node[lib::smp_processor_id()];
+}
+
+__always_inline auto node_distance(base::size_t from, base::size_t to) -> base::size_t
+{
+    return numa_distance[from][to];
+}
+
+/* node of the pfn, with the end of the range it lies in stored to `end` */
+auto pfn_to_nid(pfn_t pfn, pfn_t *end = nullptr) -> base::size_t
+{
+    pfn_t next = ~0UL;
+
+    for (base::size_t i = 0; i < numa_node_range_nr; i++) {
+        NodeRange *range = &numa_node_ranges[i];
+
+        if (pfn >= range->start && pfn < range->end) {
+            if (end) {
+                *end = range->end;
+            }
+
+            return range->nid;
+        }
+
+        if (range->start > pfn && range->start < next) {
+            next = range->start;
+        }
+    }
+
+    if (end) {
+        *end = next;
+    }
+
+    return 0;
+}
+
+/* fix up the topology from booting stage, or make up a single node */
+auto numa_init(void) -> void
+{
+    if (!numa_node_nr || numa_node_nr > MAX_NUMNODES) {
+        numa_node_nr = 1;
+        numa_node_range_nr = 0;
+    }
+
+    for (base::size_t i = 0; i < MAX_NUMNODES; i++) {
+        for (base::size_t j = 0; j < MAX_NUMNODES; j++) {
+            if (i == j) {
+                numa_distance[i][j] = NUMA_LOCAL_DISTANCE;
+            } else if (numa_distance[i][j] <= NUMA_LOCAL_DISTANCE) {
+                numa_distance[i][j] = NUMA_REMOTE_DISTANCE;
+            }
+        }
+    }
+
+    for (base::size_t cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        if (numa_cpu_node[cpu] >= numa_node_nr) {
+            numa_cpu_node[cpu] = 0;
+        }
+    }
+}
+
+/**
+ * Allocator statistics.
+ * Events are counted on the copy of the CPU we're running on, without any
+ * lock or atomic operation, and readers fold copies of all CPUs on demand.
+ * A count might get lost if an interrupt counting the same event comes in
+ * between, which is acceptable for statistics.
+ */
+
+enum mm_stat_item {
+    MM_STAT_PGALLOC = 0,            /* pages allocated */
+    MM_STAT_PGFREE,                 /* pages freed */
+    MM_STAT_PGALLOC_FAIL,           /* allocations failed */
+    MM_STAT_PCP_HIT,                /* allocations served by pcp lists */
+    MM_STAT_PCP_REFILL,             /* pcp lists refilled from the buddy */
+    MM_STAT_PCP_DRAIN,              /* pcp lists drained to the buddy */
+    MM_STAT_MIGRATE_FALLBACK,       /* allocations from other migrate types */
+    MM_STAT_RECLAIM,                /* direct reclaim entered */
+    MM_STAT_POOL_LOCK_CONTENDED,    /* spinning on a PagePool lock */
+    MM_STAT_SLAB_LOCK_CONTENDED,    /* spinning on a KMemCacheNode lock */
+    MM_STAT_KMALLOC_LARGE,          /* KHeapPool allocations too large for caches */
+    MM_STAT_KMALLOC_FALLBACK,       /* KHeapPool allocations failed on caches */
+    MM_STAT_KMALLOC_WASTE,          /* bytes lost to rounding up to cache sizes */
+    MM_STAT_CMA_ALLOC,              /* pages taken by contiguous allocations */
+    MM_STAT_CMA_ALLOC_FAIL,         /* contiguous ranges failed to be taken */
+    MM_STAT_CMA_MIGRATED,           /* pages migrated out for contiguous allocations */
+    MM_STAT_KSTACK_ALLOC,           /* kernel stacks allocated */
+    MM_STAT_KSTACK_CACHE_HIT,       /* kernel stacks served by per-CPU caches */
+    MM_STAT_ITEM_NR,
+};
+
+inline constexpr const char *mm_stat_item_name[MM_STAT_ITEM_NR] = {
+    "pgalloc",
+    "pgfree",
+    "pgalloc_fail",
+    "pcp_hit",
+    "pcp_refill",
+    "pcp_drain",
+    "migrate_fallback",
+    "reclaim",
+    "pool_lock_contended",
+    "slab_lock_contended",
+    "kmalloc_large",
+    "kmalloc_fallback",
+    "kmalloc_waste",
+    "cma_alloc",
+    "cma_alloc_fail",
+    "cma_migrated",
+    "kstack_alloc",
+    "kstack_cache_hit",
+};
+
+struct MMStatCPU {
+    base::size_t events[MM_STAT_ITEM_NR];
+};
+
+/* to avoid calling global initializer, we manually point it to mem */
+alignas(lib::PerCPU<MMStatCPU>) base::uint8_t GloblMMStatCPUMem[sizeof(lib::PerCPU<MMStatCPU>)];
+lib::PerCPU<MMStatCPU> *GloblMMStatCPU = (lib::PerCPU<MMStatCPU>*) &GloblMMStatCPUMem;
+
+__always_inline auto count_mm_event(mm_stat_item item, base::size_t nr = 1) -> void
+{
+    GloblMMStatCPU->This()->events[item] += nr;
+}
+
+auto sum_mm_event(mm_stat_item item) -> base::size_t
+{
+    base::size_t sum = 0;
+
+    for (base::size_t cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        sum += GloblMMStatCPU->Of(cpu)->events[item];
+    }
+
+    return sum;
+}
+
+/* take the lock, counting to `item` if we have to spin on it */
+__always_inline auto mm_stat_lock(lib::atomic::SpinLock *lock, mm_stat_item item) -> void
+{
+    if (!lock->TryLock()) {
+        count_mm_event(item);
+        lock->Lock();
+    }
+}
+
 /* page operations */
 
 __always_inline auto page_to_pfn(Page *p) -> pfn_t
@@ -113,11 +336,66 @@ __always_inline auto virt_to_page(virt_addr_t addr) -> Page*
     return phys_to_page(virt_to_phys(addr));
 }
 
+/* valid only for pages of allocated blocks, tails of a free block are stale */
 __always_inline auto get_head_page(Page *p) -> Page*
 {
-    return p->is_head 
-          ? p 
-          : (Page*)((virt_addr_t) p & ~((sizeof(*p)*(1 << p->order))-1));
+    return p->is_head ? p : p->compound_head;
+}
+
+/**
+ * struct Folio
+ * - representing an allocated block of `1 << order` pages as a whole
+ * - it's just the head page, so that a Page* could be taken as a Folio* after
+ *   finding its head, refcount, mapping and slab ownership all live there
+ */
+struct Folio {
+    Page page;
+};
+
+__always_inline auto page_folio(Page *p) -> Folio*
+{
+    return (Folio*) get_head_page(p);
+}
+
+__always_inline auto virt_to_folio(virt_addr_t addr) -> Folio*
+{
+    return page_folio(virt_to_page(addr));
+}
+
+__always_inline auto folio_page(Folio *folio, base::size_t n) -> Page*
+{
+    return &folio->page + n;
+}
+
+__always_inline auto folio_order(Folio *folio) -> base::size_t
+{
+    return folio->page.order;
+}
+
+__always_inline auto folio_nr_pages(Folio *folio) -> base::size_t
+{
+    return 1UL << folio->page.order;
+}
+
+__always_inline auto folio_size(Folio *folio) -> base::size_t
+{
+    return PAGE_SIZE << folio->page.order;
+}
+
+__always_inline auto folio_pfn(Folio *folio) -> pfn_t
+{
+    return page_to_pfn(&folio->page);
+}
+
+__always_inline auto folio_address(Folio *folio) -> virt_addr_t
+{
+    return page_to_virt(&folio->page);
+}
+
+/* the cache owning the folio, nullptr if it's not a slab */
+__always_inline auto folio_slab(Folio *folio) -> KMemCache*
+{
+    return folio->page.kc;
 }
 
 /**
@@ -137,221 +415,2082 @@ __always_inline auto get_page_buddy(Page *p, int order) -> Page*
 
 inline constexpr base::size_t MAX_PAGE_ORDER = 11;
 
-class PagePool {
-public:
-    PagePool(void);
-    ~PagePool();
+/**
+ * Pageblocks (anti-fragmentation)
+ * - physical memory is grouped into pageblocks, each of them is assigned with
+ *   a migrate type, and free pages in it are put on freelists of that type
+ * - an allocation falls back to other types only if its own type runs out,
+ *   and it steals the whole pageblock if possible, so that different types
+ *   are kept away from each other and high-order blocks survive longer
+ * - the type is stored at the first page of each pageblock, booting stage
+ *   makes sure that its `struct Page` always exists
+ */
 
-    auto AllocPages(base::size_t order) -> Page *;
-    auto FreePages(Page *page, base::size_t order) -> void;
+inline constexpr base::size_t PAGEBLOCK_ORDER = 9;
+inline constexpr base::size_t PAGEBLOCK_PAGES = (1UL << PAGEBLOCK_ORDER);
 
-    /* for booting stage only */
+__always_inline auto pageblock_head(Page *p) -> Page*
+{
+    return pfn_to_page(page_to_pfn(p) & ~(PAGEBLOCK_PAGES - 1));
+}
 
-    auto Init(void) -> void;
-    auto AddPages(Page *page, base::size_t order) -> void;
+__always_inline auto get_pageblock_type(Page *p) -> base::size_t
+{
+    return pageblock_head(p)->pageblock_type;
+}
 
-private:
-    lib::ListHead freelist[MAX_PAGE_ORDER];
-    lib::atomic::SpinLock lock;
+__always_inline auto set_pageblock_type(Page *p, base::size_t migrate_type) -> void
+{
+    pageblock_head(p)->pageblock_type = migrate_type;
+}
 
-    auto __reinit_page(Page *p, base::size_t order, bool free) -> void;
+/**
+ * Contiguous memory allocator (CMA)
+ * - a range of pageblocks is reserved as MIGRATE_CMA at booting stage, they're
+ *   never stolen, but movable allocations could borrow pages from them
+ * - a contiguous allocation isolates pageblocks around the range first, so
+ *   that pages freed there are not handed out again, and then migrates
+ *   movable pages in the range out
+ * - ranges are reserved and isolated in blocks of CMA_BLOCK_ORDER, which is
+ *   the max order of the buddy, so free blocks never cross their borders
+ */
 
-    auto __alloc_page_direct(base::size_t order) -> Page *;
-    auto __alloc_pages(base::size_t order) -> Page *;
+inline constexpr base::size_t CMA_BLOCK_ORDER = MAX_PAGE_ORDER - 1;
+inline constexpr base::size_t CMA_BLOCK_PAGES = (1UL << CMA_BLOCK_ORDER);
 
-    auto __free_pages(Page *p, base::size_t order) -> void;
+/* times to scan a range for pages to migrate, as some could be busy for a while */
+inline constexpr base::size_t CMA_MIGRATE_RETRY_MAX = 5;
 
-    auto __reclaim_memory(void) -> void;
+/* types to steal from when we run out of a type, in order of preference */
+inline constexpr base::size_t migrate_fallbacks[MIGRATE_PCPTYPES][MIGRATE_PCPTYPES - 1] = {
+    { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE },   /* MIGRATE_UNMOVABLE */
+    { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE }, /* MIGRATE_MOVABLE */
+    { MIGRATE_UNMOVABLE, MIGRATE_MOVABLE },     /* MIGRATE_RECLAIMABLE */
 };
 
-enum page_pool_types {
-    PAGE_POOL_TYPE_NORMAL = 0,
-    PAGE_POOL_TYPE_NR,
-};
+/**
+ * Per-CPU pages cache (front end of the buddy system)
+ * - blocks with order in [0, PCP_MAX_ORDER] are cached on each CPU
+ * - refilled from and drained to the buddy in batches under the pool lock
+ * - hot pages are put at the head of the list and cold pages at the tail
+ */
 
-base::uint8_t GloblPagePoolMem[sizeof(PagePool)]; /* to avoid calling global initializer, we manually point it to mem */
-PagePool *GloblPagePool = (PagePool*) &GloblPagePoolMem;
-PagePool *GloblPagePoolGroup[PAGE_POOL_TYPE_NR] = {
-    (PagePool*) &GloblPagePoolMem,
+inline constexpr base::size_t PCP_MAX_ORDER = 3;
+inline constexpr base::size_t PCP_BATCH_PAGES = 32;
+inline constexpr base::size_t PCP_HIGH_BATCHES = 4;
+
+struct PerCPUPages {
+    lib::ListHead lists[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];
+    base::size_t count[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];  /* number of blocks on each list */
 };
 
-__always_inline auto get_page(struct Page *p) -> void
+/* number of blocks to move between the pcp list and the buddy at a time */
+__always_inline auto pcp_batch(base::size_t order) -> base::size_t
 {
-    lib::atomic::atomic_inc(&get_head_page(p)->ref_count);
+    return (PCP_BATCH_PAGES >> order) ? (PCP_BATCH_PAGES >> order) : 1;
 }
 
-__always_inline auto put_page(struct Page *p) -> void
+/* pcp list will be drained if it holds more blocks than that */
+__always_inline auto pcp_high(base::size_t order) -> base::size_t
 {
-    p = get_head_page(p);
-
-    if (lib::atomic::atomic_dec(&p->ref_count) < 0) {
-        p->pool->FreePages(p, p->order);
-    }
+    return pcp_batch(order) * PCP_HIGH_BATCHES;
 }
 
-PagePool::PagePool(void)
-{
-    /* do nothing */
-}
+/**
+ * Page allocation flags
+ */
 
-PagePool::~PagePool(void)
-{
-    /* do nothing */
-}
+typedef base::uint32_t gfp_t;
 
-auto PagePool::__reinit_page(Page *p, base::size_t order, bool free) -> void
+inline constexpr gfp_t __GFP_ATOMIC    = (1 << 0);  /* can't wait, e.g. in interrupt context */
+inline constexpr gfp_t __GFP_RECLAIM   = (1 << 1);  /* may reclaim memory directly on shortage */
+inline constexpr gfp_t __GFP_ZERO      = (1 << 2);  /* pages should be zeroed */
+inline constexpr gfp_t __GFP_DMA32     = (1 << 3);  /* only from memory below 4GB */
+inline constexpr gfp_t __GFP_MOVABLE   = (1 << 4);  /* pages could be migrated */
+inline constexpr gfp_t __GFP_RECLAIMABLE = (1 << 5);  /* pages could be freed by shrinkers */
+inline constexpr gfp_t __GFP_THISNODE  = (1 << 6);  /* only from the requested node */
+
+inline constexpr gfp_t GFP_KERNEL  = (__GFP_RECLAIM);
+inline constexpr gfp_t GFP_ATOMIC  = (__GFP_ATOMIC);
+inline constexpr gfp_t GFP_DMA32   = (__GFP_RECLAIM | __GFP_DMA32);
+
+__always_inline auto gfp_migrate_type(gfp_t flags) -> base::size_t
 {
-    for (auto i = 0; i < (1 << order); i++) {
-        p[i].is_free = free;
-        p[i].order = order;
-        p[i].freelist = nullptr;
-        p[i].kc = nullptr;
-        p[i].is_head = false;
-        lib::atomic::atomic_set(&p->ref_count, -1);
-        lib::atomic::atomic_set(&p->map_count, -1);
+    if (flags & __GFP_MOVABLE) {
+        return MIGRATE_MOVABLE;
+    }
+
+    if (flags & __GFP_RECLAIMABLE) {
+        return MIGRATE_RECLAIMABLE;
     }
 
-    p[0].is_head = true;
+    return MIGRATE_UNMOVABLE;
 }
 
-auto PagePool::__alloc_page_direct(base::size_t order) -> Page *
+/**
+ * Watermarks of a PagePool (in pages)
+ * - below LOW: background reclaim is started
+ * - below MIN: only atomic allocations could go on, with reserves down to MIN/2
+ * - reaching HIGH: background reclaim is stopped
+ */
+
+enum page_pool_watermark {
+    WMARK_MIN = 0,
+    WMARK_LOW,
+    WMARK_HIGH,
+    WMARK_NR,
+};
+
+/* compaction statistics of a PagePool */
+struct CompactStat {
+    base::size_t attempts;
+    base::size_t successes;
+    base::size_t pages_migrated;
+    base::size_t pages_failed;
+};
+
+/* max number of pages to be isolated and migrated in a round */
+inline constexpr base::size_t COMPACT_CLUSTER_MAX = 32;
+
+/**
+ * Pre-zeroed pages of a PagePool, for order-0 __GFP_ZERO allocations.
+ * They're zeroed at idle time and kept out of the buddy, so they're given
+ * back on reclaiming. Each migrate type has its own list, so pages of
+ * unmovable pageblocks don't end up holding movable data.
+ */
+
+/* max number of pre-zeroed pages kept in a pool, and its ratio to the pool */
+inline constexpr base::size_t ZERO_POOL_MAX = 256;
+inline constexpr base::size_t ZERO_POOL_RATIO_SHIFT = 6;
+
+struct ZeroPoolStat {
+    base::size_t hits;          /* __GFP_ZERO pages from the pool */
+    base::size_t misses;        /* __GFP_ZERO pages zeroed on allocation */
+    base::size_t zeroed_pages;  /* pages zeroed at idle time */
+    base::uint64_t zero_cycles; /* TSC cycles spent on zeroing them */
+    base::size_t nr;            /* pages in the pool now, of all migrate types */
+};
+
+/* free blocks statistics of a PagePool, for observing fragmentation */
+struct FreeAreaStat {
+    base::size_t free_blocks[MAX_PAGE_ORDER];
+    base::size_t free_pages;
+    base::size_t free_pages_type[MIGRATE_TYPES];
+    base::size_t pcp_pages;     /* cached on pcp lists, not in `free_pages` */
+};
+
+/**
+ * Fragmentation index of an allocation of `order`, in thousandths.
+ * Towards 0 means it would fail for lack of memory, towards 1000 means it
+ * would fail for fragmentation, and -1000 means it would succeed.
+ */
+auto fragmentation_index(const FreeAreaStat *stat, base::size_t order) -> int
 {
-    Page *p = nullptr;
-    Page *buddy;
-    base::size_t allocated = order;
+    base::size_t blocks = 0;
 
-    while (allocated < MAX_PAGE_ORDER) {
-        if (!lib::list_empty(&this->freelist[allocated])) {
-            p = lib::list_entry(this->freelist[allocated].next, &Page::list);
-            lib::list_del(&p->list);
-            break;
-        } else {
-            allocated++;
+    for (base::size_t i = 0; i < MAX_PAGE_ORDER; i++) {
+        if (i >= order && stat->free_blocks[i]) {
+            return -1000;
         }
-    }
 
-    /* failed */
-    if (!p) {
-        goto out;
+        blocks += stat->free_blocks[i];
     }
 
-    /* it means that we acquire pages from higher order */
-    if (allocated != order) {
-        /* put half pages back to buddy */
-        do {
-            allocated--;
-            buddy = get_page_buddy(p, allocated);
-            this->__reinit_page(buddy, allocated, true);
-            lib::list_add_next(&this->freelist[allocated], &buddy->list);
-        } while (allocated > order);
+    if (!blocks) {
+        return 0;
     }
 
-    this->__reinit_page(p, allocated, false);
-
-out:
-    return p;
+    return 1000 - (int) ((1000 + (stat->free_pages * 1000 >> order)) / blocks);
 }
 
-auto PagePool::__alloc_pages(base::size_t order) -> Page *
+/* free memory unusable for an allocation of `order`, in thousandths */
+auto unusable_free_index(const FreeAreaStat *stat, base::size_t order) -> int
 {
-    Page *p = nullptr;
-    bool redo = false;
+    base::size_t usable = 0;
 
-    if (order >= MAX_PAGE_ORDER) {
-        return nullptr;
+    if (!stat->free_pages) {
+        return 0;
     }
 
-    this->lock.Lock();
-
-redo:
-    /* try to alloc directly */
-    p = this->__alloc_page_direct(order);
-    if (p) {
-        goto out;
+    for (base::size_t i = order; i < MAX_PAGE_ORDER; i++) {
+        usable += stat->free_blocks[i] << i;
     }
 
-    /* failed to allocate! try to reclaim memory... */
-    if (!redo) {
-        this->__reclaim_memory();
-        redo = true;
-        goto redo;
-    }
+    return (int) ((stat->free_pages - usable) * 1000 / stat->free_pages);
+}
 
-out:
-    this->lock.UnLock();
+class PagePool {
+public:
+    PagePool(void);
+    ~PagePool();
 
-    return p;
-}
+    auto AllocPages(base::size_t order, gfp_t flags = GFP_KERNEL) -> Page *;
+    auto FreePages(Page *page, base::size_t order) -> void;
+    auto FreePagesCold(Page *page, base::size_t order) -> void;
 
-auto PagePool::__free_pages(Page *p, base::size_t order) -> void
-{
-    if (!p) {
-        return;
-    }
+    auto DrainPerCPUPages(void) -> void;
 
-    if (order >= MAX_PAGE_ORDER) {
-        return;
-    }
+    auto GetFreeAreaStat(FreeAreaStat *stat) -> void;
 
-    this->lock.Lock();
+    /* pre-zeroed pages */
 
-    /* try to combine nearby pages */
-    while (order < (MAX_PAGE_ORDER - 1)) {
-        Page *buddy;
+    auto AllocZeroedPage(base::size_t migrate_type) -> Page *;
+    auto ClearPages(Page *page, base::size_t order) -> void;
+    auto RefillZeroedPages(void) -> base::size_t;
+    auto DrainZeroedPages(void) -> base::size_t;
+    auto GetZeroPoolStat(ZeroPoolStat *stat) -> void;
 
-        buddy = get_page_buddy(p, order);
-        if (buddy->type == PAGE_NORMAL_MEM && buddy->is_head && buddy->is_free) {
-            list_del(&buddy->list);
-            if (buddy < p) {
-                p->is_head = false;
-                p = buddy;
-            }
-            order++;
-            continue;
-        }
+    /* watermarks and reclaim, for allocating across pools */
 
-        /* we can't combine forward or backward, just break */
-        break;
-    }
+    auto TryAllocPages(base::size_t order, base::size_t migrate_type, base::size_t mark) -> Page *;
+    auto WatermarkOk(base::size_t order, base::size_t mark) -> bool;
+    auto Watermark(base::size_t wmark) -> base::size_t;
+    auto SetWatermarks(base::size_t min) -> void;
+    auto ManagedPages(void) -> base::size_t;
 
-    this->__reinit_page(p, order, true);
+    auto WakeupReclaim(void) -> void;
+    auto ReclaimPages(base::size_t order) -> bool;
+    auto BalancePages(void) -> base::size_t;
 
-    list_add_next(&(this->freelist[order]), &p->list);
+    /* compaction */
 
-    this->lock.UnLock();
-}
+    auto Compact(base::size_t order) -> bool;
+    auto GetCompactStat(CompactStat *stat) -> void;
 
-auto PagePool::__reclaim_memory(void) -> void
-{
-    /* TODO: reclame movable memory pages */
-}
+    /* contiguous ranges of CMA pageblocks */
 
-auto PagePool::AllocPages(base::size_t order) -> Page *
-{
-    return this->__alloc_pages(order);
-}
+    auto ReserveCMA(base::size_t nr, pfn_t *start) -> int;
+    auto AllocContigRange(pfn_t start, pfn_t end) -> int;
+    auto FreeContigRange(pfn_t start, pfn_t end) -> void;
+    auto FreeCMAPages(void) -> base::size_t;
 
-auto PagePool::FreePages(Page *page, base::size_t order) -> void
-{
-    this->__free_pages(page, order);
-}
+    auto Node(void) -> base::size_t;
 
-auto PagePool::Init(void) -> void
-{
-    for (auto i = 0; i < MAX_PAGE_ORDER; i++) {
-        lib::list_head_init(&this->freelist[i]);
-    }
+    /* for booting stage only */
 
-    this->lock.Reset();
-}
+    auto Init(base::size_t nid = 0) -> void;
+    auto AddPages(Page *page, base::size_t order) -> void;
+    auto AddPagesRange(pfn_t start, pfn_t end) -> base::size_t;
 
-auto PagePool::AddPages(Page *page, base::size_t order) -> void
-{
-    for (auto i = 0; i < (1 << order); i++) {
-        page->pool = this;  /* shoudl NOT be changed after initialization */
-    }
+private:
+    lib::ListHead freelist[MIGRATE_TYPES][MAX_PAGE_ORDER];
+    base::size_t free_area_map[MIGRATE_TYPES];  /* bit N is set if freelist[type][N] is not empty */
+    base::size_t free_area_nr[MIGRATE_TYPES][MAX_PAGE_ORDER];
+    lib::atomic::SpinLock lock;
+
+    base::size_t managed_pages;
+    base::size_t free_pages;    /* pages in the buddy, not including pcp lists */
+    base::size_t free_cma_pages;    /* part of `free_pages` that only serves movable allocations */
+    base::size_t watermark[WMARK_NR];
+    bool reclaim_pending;
+
+    pfn_t start_pfn, end_pfn;   /* range spanned by the pool */
+    CompactStat compact_stat;
+
+    lib::ListHead zero_list[MIGRATE_PCPTYPES];  /* protected by `lock` */
+    base::size_t zero_nr[MIGRATE_PCPTYPES];
+    ZeroPoolStat zero_stat;
+
+    base::size_t nid;
+
+    lib::PerCPU<PerCPUPages> pcp;
+
+    auto __reinit_page(Page *p, base::size_t order, bool free) -> void;
 
-    this->FreePages(page, order);
+    auto __freelist_add(Page *p, base::size_t order, base::size_t migrate_type, bool tail) -> void;
+    auto __freelist_del(Page *p, base::size_t order) -> void;
+
+    auto __move_free_pages(pfn_t start, pfn_t end, base::size_t migrate_type) -> base::size_t;
+    auto __steal_pageblock(Page *p, base::size_t order, base::size_t migrate_type) -> void;
+
+    auto __alloc_page_smallest(base::size_t order, base::size_t migrate_type) -> Page *;
+    auto __alloc_page_fallback(base::size_t order, base::size_t migrate_type) -> Page *;
+    auto __alloc_page_direct(base::size_t order, base::size_t migrate_type) -> Page *;
+    auto __alloc_pages_pcp(base::size_t order, base::size_t migrate_type) -> Page *;
+    auto __alloc_pages(base::size_t order, base::size_t migrate_type) -> Page *;
+
+    auto __free_page_direct(Page *p, base::size_t order) -> void;
+    auto __free_pages_pcp(Page *p, base::size_t order, bool cold) -> void;
+    auto __free_pages(Page *p, base::size_t order, bool cold) -> void;
+
+    auto __drain_pcp_list(PerCPUPages *pcp, base::size_t migrate_type, base::size_t order, base::size_t count) -> void;
+
+    auto __span_pfn_range(pfn_t start, pfn_t end) -> void;
+
+    auto __compact_suitable(base::size_t order) -> bool;
+    auto __compact_isolate_migrate(pfn_t *pfn, pfn_t end, lib::ListHead *list) -> base::size_t;
+    auto __compact_isolate_free(pfn_t *pfn, pfn_t low, lib::ListHead *list, base::size_t nr) -> base::size_t;
+
+    auto __reclaim_memory(base::size_t order) -> bool;
+
+    auto __set_range_type(pfn_t start, pfn_t end, base::size_t migrate_type) -> void;
+    auto __find_free_block(pfn_t pfn) -> Page *;
+    auto __migrate_contig_range(pfn_t start, pfn_t end) -> base::size_t;
+    auto __take_contig_range(pfn_t start, pfn_t end) -> int;
+};
+
+/**
+ * Memory zones of each node, each of them is managed by a PagePool.
+ * Pools of a node are listed in fallback order, a restricted allocation starts
+ * from the pool it's restricted to and falls back only to pools after it.
+ */
+
+enum page_pool_types {
+    PAGE_POOL_TYPE_NORMAL = 0,
+    PAGE_POOL_TYPE_DMA32,
+    PAGE_POOL_TYPE_NR,
+};
+
+inline constexpr pfn_t DMA32_PFN_LIMIT = ((1UL << 32) / PAGE_SIZE);
+
+/* to avoid calling global initializer, we manually point it to mem */
+alignas(PagePool) base::uint8_t GloblPagePoolMem[MAX_NUMNODES][PAGE_POOL_TYPE_NR][sizeof(PagePool)];
+
+__always_inline auto node_page_pool(base::size_t nid, base::size_t type) -> PagePool*
+{
+    return (PagePool*) &GloblPagePoolMem[nid][type];
+}
+
+/**
+ * Pools to allocate from for each node and each highest allowed zone,
+ * local pools come first, and then pools of other nodes by distance.
+ */
+struct PagePoolZonelist {
+    PagePool *pools[MAX_NUMNODES * PAGE_POOL_TYPE_NR];
+    base::size_t pool_nr;
+    base::size_t local_nr;
+};
+
+PagePoolZonelist GloblPagePoolZonelists[MAX_NUMNODES][PAGE_POOL_TYPE_NR];
+
+auto alloc_pages_from(PagePool **pools, base::size_t pool_nr, base::size_t order, gfp_t flags) -> Page *;
+
+/**
+ * Shrinkers give memory cached by upper layers (e.g. empty slabs) back to the
+ * page allocator, they're called on reclaiming.
+ * - count: number of pages that could be freed on the node
+ * - scan: try to free up to `nr` pages on the node, returning the freed number
+ */
+struct Shrinker {
+    base::size_t (*count)(Shrinker *shrinker, base::size_t nid);
+    base::size_t (*scan)(Shrinker *shrinker, base::size_t nid, base::size_t nr);
+    lib::ListHead list;
+};
+
+/* min number of pages to ask shrinkers for at a time */
+inline constexpr base::size_t SHRINK_BATCH = 32;
+
+auto shrinker_init(void) -> void;
+auto register_shrinker(Shrinker *shrinker) -> void;
+auto unregister_shrinker(Shrinker *shrinker) -> void;
+auto shrink_slab(base::size_t nid, base::size_t nr) -> base::size_t;
+
+__always_inline auto folio_get(Folio *folio) -> void
+{
+    lib::atomic::atomic_inc(&folio->page.ref_count);
+}
+
+__always_inline auto folio_put(Folio *folio) -> void
+{
+    /* atomic_dec() returns the old value */
+    if (lib::atomic::atomic_dec(&folio->page.ref_count) <= 0) {
+        folio->page.pool->FreePages(&folio->page, folio_order(folio));
+    }
+}
+
+__always_inline auto get_page(struct Page *p) -> void
+{
+    folio_get(page_folio(p));
+}
+
+__always_inline auto put_page(struct Page *p) -> void
+{
+    folio_put(page_folio(p));
+}
+
+PagePool::PagePool(void)
+{
+    /* do nothing */
+}
+
+PagePool::~PagePool(void)
+{
+    /* do nothing */
+}
+
+/**
+ * Set up the head of a block, tails are written only when the block is
+ * allocated, as free tails are never looked up and already have `is_head`
+ * cleared: only heads get promoted or demoted while splitting and merging.
+ */
+auto PagePool::__reinit_page(Page *p, base::size_t order, bool free) -> void
+{
+    p->is_free = free;
+    p->order = order;
+    p->freelist = nullptr;
+    p->kc = nullptr;
+    p->is_head = true;
+    lib::atomic::atomic_set(&p->ref_count, -1);
+    lib::atomic::atomic_set(&p->map_count, -1);
+
+    if (!free) {
+        for (auto i = 1; i < (1 << order); i++) {
+            p[i].compound_head = p;
+        }
+    }
+}
+
+auto PagePool::__freelist_add(Page *p, base::size_t order, base::size_t migrate_type, bool tail) -> void
+{
+    if (tail) {
+        lib::list_add_prev(&this->freelist[migrate_type][order], &p->list);
+    } else {
+        lib::list_add_next(&this->freelist[migrate_type][order], &p->list);
+    }
+
+    p->migrate_type = migrate_type;
+
+    this->free_area_nr[migrate_type][order]++;
+    this->free_area_map[migrate_type] |= (1UL << order);
+    this->free_pages += (1UL << order);
+
+    if (migrate_type == MIGRATE_CMA) {
+        this->free_cma_pages += (1UL << order);
+    }
+}
+
+auto PagePool::__freelist_del(Page *p, base::size_t order) -> void
+{
+    base::size_t migrate_type = p->migrate_type;
+
+    lib::list_del(&p->list);
+
+    this->free_area_nr[migrate_type][order]--;
+    this->free_pages -= (1UL << order);
+    if (migrate_type == MIGRATE_CMA) {
+        this->free_cma_pages -= (1UL << order);
+    }
+
+    if (!this->free_area_nr[migrate_type][order]) {
+        this->free_area_map[migrate_type] &= ~(1UL << order);
+    }
+}
+
+/* move free blocks of this pool in [start, end) to freelists of `migrate_type` */
+auto PagePool::__move_free_pages(pfn_t start, pfn_t end, base::size_t migrate_type) -> base::size_t
+{
+    base::size_t moved = 0, order;
+    pfn_t pfn = start;
+    Page *p;
+
+    if (end > pgdb_page_nr) {
+        end = pgdb_page_nr;
+    }
+
+    while (pfn < end) {
+        p = pfn_to_page(pfn);
+
+        if (!(p->type == PAGE_NORMAL_MEM && p->is_head && p->is_free && p->pool == this)) {
+            pfn++;
+            continue;
+        }
+
+        order = p->order;
+        if (p->migrate_type != migrate_type) {
+            this->__freelist_del(p, order);
+            this->__freelist_add(p, order, migrate_type, false);
+        }
+
+        moved += (1UL << order);
+        pfn += (1UL << order);
+    }
+
+    return moved;
+}
+
+/**
+ * Take the pageblock(s) of a free block found on another type's freelist.
+ * Free pages in the pageblock are all moved to our freelists, and the
+ * pageblock becomes ours if at least half of it is free.
+ */
+auto PagePool::__steal_pageblock(Page *p, base::size_t order, base::size_t migrate_type) -> void
+{
+    pfn_t start;
+
+    if (order >= PAGEBLOCK_ORDER) {
+        for (auto i = 0; i < (1 << order); i += PAGEBLOCK_PAGES) {
+            set_pageblock_type(&p[i], migrate_type);
+        }
+
+        this->__freelist_del(p, order);
+        this->__freelist_add(p, order, migrate_type, false);
+
+        return ;
+    }
+
+    start = page_to_pfn(p) & ~(PAGEBLOCK_PAGES - 1);
+    if (this->__move_free_pages(start, start + PAGEBLOCK_PAGES, migrate_type) >= (PAGEBLOCK_PAGES / 2)) {
+        set_pageblock_type(p, migrate_type);
+    }
+}
+
+/* find the smallest order with free blocks of the type that can satisfy the request */
+auto PagePool::__alloc_page_smallest(base::size_t order, base::size_t migrate_type) -> Page *
+{
+    Page *p;
+    Page *buddy;
+    base::size_t allocated, avail_map;
+
+    avail_map = this->free_area_map[migrate_type] & ~((1UL << order) - 1);
+    if (!avail_map) {
+        return nullptr;
+    }
+
+    allocated = __builtin_ctzl(avail_map);
+    p = lib::list_entry(this->freelist[migrate_type][allocated].next, &Page::list);
+    this->__freelist_del(p, allocated);
+
+    /* it means that we acquire pages from higher order */
+    if (allocated != order) {
+        /* put half pages back to buddy */
+        do {
+            allocated--;
+            buddy = get_page_buddy(p, allocated);
+            this->__reinit_page(buddy, allocated, true);
+            this->__freelist_add(buddy, allocated, migrate_type, false);
+        } while (allocated > order);
+    }
+
+    this->__reinit_page(p, allocated, false);
+
+    return p;
+}
+
+/**
+ * Our own type runs out, take from the largest free block of other types,
+ * which leaves less fragmentation behind than taking small ones.
+ * Unmovable and reclaimable allocations always steal the whole pageblock to
+ * gather themselves together, while movable ones do that only for large
+ * requests, otherwise they just borrow pages as they could be moved away.
+ */
+auto PagePool::__alloc_page_fallback(base::size_t order, base::size_t migrate_type) -> Page *
+{
+    base::size_t found_type = MIGRATE_TYPES, found_order = 0, avail_map, curr_order;
+    Page *p;
+
+    for (auto i = 0; i < (MIGRATE_PCPTYPES - 1); i++) {
+        base::size_t fallback_type = migrate_fallbacks[migrate_type][i];
+
+        avail_map = this->free_area_map[fallback_type] & ~((1UL << order) - 1);
+        if (!avail_map) {
+            continue;
+        }
+
+        curr_order = 63 - __builtin_clzl(avail_map);
+        if (found_type == MIGRATE_TYPES || curr_order > found_order) {
+            found_type = fallback_type;
+            found_order = curr_order;
+        }
+    }
+
+    if (found_type == MIGRATE_TYPES) {
+        return nullptr;
+    }
+
+    count_mm_event(MM_STAT_MIGRATE_FALLBACK);
+
+    if (migrate_type != MIGRATE_MOVABLE || found_order >= (PAGEBLOCK_ORDER / 2)) {
+        p = lib::list_entry(this->freelist[found_type][found_order].next, &Page::list);
+        this->__steal_pageblock(p, found_order, migrate_type);
+
+        return this->__alloc_page_smallest(order, migrate_type);
+    }
+
+    return this->__alloc_page_smallest(order, found_type);
+}
+
+/**
+ * Movable allocations borrow CMA pages before stealing others' pageblocks,
+ * and take them first if CMA holds most of free pages, so that pages outside
+ * are kept for allocations that can't use CMA.
+ */
+auto PagePool::__alloc_page_direct(base::size_t order, base::size_t migrate_type) -> Page *
+{
+    Page *p = nullptr;
+
+    if (migrate_type == MIGRATE_MOVABLE && this->free_cma_pages > (this->free_pages / 2)) {
+        p = this->__alloc_page_smallest(order, MIGRATE_CMA);
+        if (p) {
+            return p;
+        }
+    }
+
+    p = this->__alloc_page_smallest(order, migrate_type);
+    if (!p && migrate_type == MIGRATE_MOVABLE) {
+        p = this->__alloc_page_smallest(order, MIGRATE_CMA);
+    }
+
+    if (!p) {
+        p = this->__alloc_page_fallback(order, migrate_type);
+    }
+
+    return p;
+}
+
+/* grab a block from local pcp list, refill it from the buddy if it's empty */
+auto PagePool::__alloc_pages_pcp(base::size_t order, base::size_t migrate_type) -> Page *
+{
+    PerCPUPages *pcp;
+    lib::ListHead *list;
+    Page *p = nullptr;
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
+
+    pcp = this->pcp.This();
+    list = &pcp->lists[migrate_type][order];
+
+    if (lib::list_empty(list)) {
+        count_mm_event(MM_STAT_PCP_REFILL);
+        mm_stat_lock(&this->lock, MM_STAT_POOL_LOCK_CONTENDED);
+
+        for (auto i = 0; i < pcp_batch(order); i++) {
+            p = this->__alloc_page_direct(order, migrate_type);
+            if (!p) {
+                break;
+            }
+
+            lib::list_add_prev(list, &p->list);
+            pcp->count[migrate_type][order]++;
+        }
+
+        this->lock.UnLock();
+    }
+
+    if (!lib::list_empty(list)) {
+        p = lib::list_entry(list->next, &Page::list);
+        lib::list_del(&p->list);
+        pcp->count[migrate_type][order]--;
+        count_mm_event(MM_STAT_PCP_HIT);
+    } else {
+        p = nullptr;
+    }
+
+    lib::local_irq_restore(flags);
+
+    return p;
+}
+
+auto PagePool::__alloc_pages(base::size_t order, base::size_t migrate_type) -> Page *
+{
+    Page *p = nullptr;
+    base::size_t flags;
+
+    if (order >= MAX_PAGE_ORDER) {
+        return nullptr;
+    }
+
+    /* fast path: no shared lock for low-order pages usually */
+    if (order <= PCP_MAX_ORDER) {
+        p = this->__alloc_pages_pcp(order, migrate_type);
+        if (p) {
+            return p;
+        }
+    }
+
+    flags = lib::local_irq_save();
+    mm_stat_lock(&this->lock, MM_STAT_POOL_LOCK_CONTENDED);
+
+    p = this->__alloc_page_direct(order, migrate_type);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return p;
+}
+
+/**
+ * Put pages back to the buddy, the caller should hold the lock.
+ * The block goes to the freelist of the pageblock's type.
+ */
+auto PagePool::__free_page_direct(Page *p, base::size_t order) -> void
+{
+    base::size_t migrate_type = get_pageblock_type(p);
+
+    /* try to combine nearby pages */
+    while (order < (MAX_PAGE_ORDER - 1)) {
+        Page *buddy;
+
+        if (buddy_page_pfn(page_to_pfn(p), order) >= pgdb_page_nr) {
+            break;
+        }
+
+        buddy = get_page_buddy(p, order);
+        if (buddy->type == PAGE_NORMAL_MEM && buddy->is_head && buddy->is_free
+            && buddy->order == order && buddy->pool == this) {
+            this->__freelist_del(buddy, order);
+            if (buddy < p) {
+                p->is_head = false;
+                p = buddy;
+            } else {
+                buddy->is_head = false;
+            }
+            order++;
+            continue;
+        }
+
+        /* we can't combine forward or backward, just break */
+        break;
+    }
+
+    this->__reinit_page(p, order, true);
+
+    this->__freelist_add(p, order, migrate_type, false);
+}
+
+/* return `count` coldest blocks on the pcp list to the buddy */
+auto PagePool::__drain_pcp_list(PerCPUPages *pcp, base::size_t migrate_type, base::size_t order, base::size_t count) -> void
+{
+    lib::ListHead *list = &pcp->lists[migrate_type][order];
+    Page *p;
+
+    count_mm_event(MM_STAT_PCP_DRAIN);
+    mm_stat_lock(&this->lock, MM_STAT_POOL_LOCK_CONTENDED);
+
+    while (count-- && !lib::list_empty(list)) {
+        p = lib::list_entry(list->prev, &Page::list);
+        lib::list_del(&p->list);
+        pcp->count[migrate_type][order]--;
+        this->__free_page_direct(p, order);
+    }
+
+    this->lock.UnLock();
+}
+
+/* pages are cached on the pcp list of their pageblock's type */
+auto PagePool::__free_pages_pcp(Page *p, base::size_t order, bool cold) -> void
+{
+    PerCPUPages *pcp;
+    base::size_t flags, migrate_type;
+
+    migrate_type = get_pageblock_type(p);
+
+    /* cached pages are not owned by anyone, compaction must not take them */
+    p->mops = nullptr;
+
+    flags = lib::local_irq_save();
+
+    /* isolated pages are being taken, they must not be handed out from the cache */
+    if (migrate_type == MIGRATE_ISOLATE) {
+        mm_stat_lock(&this->lock, MM_STAT_POOL_LOCK_CONTENDED);
+        this->__free_page_direct(p, order);
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+        return ;
+    }
+
+    /* CMA pages are only lent to movable allocations */
+    if (migrate_type == MIGRATE_CMA) {
+        migrate_type = MIGRATE_MOVABLE;
+    }
+
+    pcp = this->pcp.This();
+
+    if (cold) {
+        lib::list_add_prev(&pcp->lists[migrate_type][order], &p->list);
+    } else {
+        lib::list_add_next(&pcp->lists[migrate_type][order], &p->list);
+    }
+
+    pcp->count[migrate_type][order]++;
+
+    if (pcp->count[migrate_type][order] > pcp_high(order)) {
+        this->__drain_pcp_list(pcp, migrate_type, order, pcp_batch(order));
+    }
+
+    lib::local_irq_restore(flags);
+}
+
+auto PagePool::__free_pages(Page *p, base::size_t order, bool cold) -> void
+{
+    base::size_t flags;
+
+    if (!p) {
+        return;
+    }
+
+    if (order >= MAX_PAGE_ORDER) {
+        return;
+    }
+
+    count_mm_event(MM_STAT_PGFREE, 1UL << order);
+
+    if (order <= PCP_MAX_ORDER) {
+        this->__free_pages_pcp(p, order, cold);
+        return;
+    }
+
+    flags = lib::local_irq_save();
+    mm_stat_lock(&this->lock, MM_STAT_POOL_LOCK_CONTENDED);
+
+    this->__free_page_direct(p, order);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+}
+
+/**
+ * Reclaim pages back to the buddy, and compact memory for high-order
+ * requests, returning whether it's worth retrying the allocation.
+ */
+auto PagePool::__reclaim_memory(base::size_t order) -> bool
+{
+    base::size_t old_free = this->free_pages;
+    base::size_t nr = (1UL << order);
+    bool progress;
+
+    count_mm_event(MM_STAT_RECLAIM);
+
+    this->DrainZeroedPages();
+    this->DrainPerCPUPages();
+
+    /* pages freed by shrinkers might go to other pools on the node */
+    progress = shrink_slab(this->nid, (nr > SHRINK_BATCH) ? nr : SHRINK_BATCH) > 0;
+    progress = progress || (this->free_pages > old_free);
+
+    if (order > 0 && this->Compact(order)) {
+        progress = true;
+    }
+
+    return progress;
+}
+
+/**
+ * Compaction
+ * - the migrate scanner goes up from the bottom of the pool, isolating
+ *   movable pages in movable pageblocks
+ * - the free scanner goes down from the top of the pool, isolating free
+ *   pages in movable pageblocks as migration targets
+ * - pages are migrated from the bottom to the top until the scanners meet
+ *   or a free block of the requested order shows up
+ */
+
+/* whether there is a free block for the order, the caller should hold the lock */
+auto PagePool::__compact_suitable(base::size_t order) -> bool
+{
+    for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+        if (this->free_area_map[type] >> order) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Isolate movable pages from *pfn up to `end`, until a cluster is collected
+ * at the end of a pageblock. The caller should hold the lock.
+ */
+auto PagePool::__compact_isolate_migrate(pfn_t *pfn, pfn_t end, lib::ListHead *list) -> base::size_t
+{
+    base::size_t nr = 0;
+    pfn_t curr = *pfn;
+    Page *p;
+
+    while (curr < end) {
+        /* stop at the boundary of pageblocks */
+        if (!(curr & (PAGEBLOCK_PAGES - 1)) && nr) {
+            break;
+        }
+
+        p = pfn_to_page(curr);
+
+        /* the first pageblock might be entered in the middle */
+        if ((!(curr & (PAGEBLOCK_PAGES - 1)) || curr == *pfn)
+            && get_pageblock_type(p) != MIGRATE_MOVABLE) {
+            curr = (curr + PAGEBLOCK_PAGES) & ~(PAGEBLOCK_PAGES - 1);
+            continue;
+        }
+
+        if (p->type != PAGE_NORMAL_MEM || p->pool != this || !p->is_head) {
+            curr++;
+            continue;
+        }
+
+        /* slub pages share the field with `mops`, so they're filtered first */
+        if (p->is_free || p->order != 0 || p->kc || !p->mops) {
+            curr += (1UL << p->order);
+            continue;
+        }
+
+        if (p->mops->isolate(p)) {
+            lib::list_add_prev(list, &p->list);
+            nr++;
+
+            if (nr == COMPACT_CLUSTER_MAX) {
+                curr++;
+                break;
+            }
+        }
+
+        curr++;
+    }
+
+    *pfn = curr;
+
+    return nr;
+}
+
+/**
+ * Isolate at least `nr` free pages from pageblocks under *pfn (down to `low`),
+ * they're split into single pages. The caller should hold the lock.
+ */
+auto PagePool::__compact_isolate_free(pfn_t *pfn, pfn_t low, lib::ListHead *list, base::size_t nr) -> base::size_t
+{
+    base::size_t isolated = 0, order;
+    pfn_t block = *pfn, curr, end;
+    Page *p;
+
+    while (isolated < nr && block >= PAGEBLOCK_PAGES && (block - PAGEBLOCK_PAGES) >= low) {
+        block -= PAGEBLOCK_PAGES;
+
+        if (get_pageblock_type(pfn_to_page(block)) != MIGRATE_MOVABLE) {
+            continue;
+        }
+
+        end = block + PAGEBLOCK_PAGES;
+        if (end > this->end_pfn) {
+            end = this->end_pfn;
+        }
+
+        curr = (block > this->start_pfn) ? block : this->start_pfn;
+
+        for (; curr < end; ) {
+            p = pfn_to_page(curr);
+
+            if (p->type != PAGE_NORMAL_MEM || p->pool != this
+                || !p->is_head || !p->is_free) {
+                curr++;
+                continue;
+            }
+
+            order = p->order;
+            this->__freelist_del(p, order);
+
+            for (auto i = 0; i < (1 << order); i++) {
+                this->__reinit_page(&p[i], 0, false);
+                lib::list_add_prev(list, &p[i].list);
+            }
+
+            isolated += (1UL << order);
+            curr += (1UL << order);
+        }
+    }
+
+    *pfn = block;
+
+    return isolated;
+}
+
+/* compact the pool until a free block of `order` is available */
+auto PagePool::Compact(base::size_t order) -> bool
+{
+    lib::ListHead migrate_list, free_list, done_list;
+    pfn_t migrate_pfn, free_pfn;
+    base::size_t flags, migrated, failed;
+    bool success = false;
+    Page *src, *dst;
+
+    if (this->start_pfn >= this->end_pfn) {
+        return false;
+    }
+
+    lib::list_head_init(&migrate_list);
+    lib::list_head_init(&free_list);
+    lib::list_head_init(&done_list);
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    /* there's no need to compact, the request may fail for watermarks */
+    if (this->__compact_suitable(order)) {
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+        return true;
+    }
+
+    this->compact_stat.attempts++;
+
+    /* pages are only walked in the pool, the free scanner moves by pageblocks and clamps itself */
+    migrate_pfn = this->start_pfn;
+    free_pfn = (this->end_pfn + PAGEBLOCK_PAGES - 1) & ~(PAGEBLOCK_PAGES - 1);
+
+    while (migrate_pfn < free_pfn && migrate_pfn < this->end_pfn) {
+        if (this->__compact_suitable(order)) {
+            success = true;
+            break;
+        }
+
+        if (!this->__compact_isolate_migrate(&migrate_pfn,
+                                             (free_pfn < this->end_pfn) ? free_pfn : this->end_pfn,
+                                             &migrate_list)) {
+            continue;
+        }
+
+        /* free scanner only takes pageblocks above the migrate scanner */
+        this->__compact_isolate_free(&free_pfn,
+                                     (migrate_pfn + PAGEBLOCK_PAGES - 1) & ~(PAGEBLOCK_PAGES - 1),
+                                     &free_list,
+                                     COMPACT_CLUSTER_MAX);
+
+        /* owners may do some heavy jobs (like copying), so we release the lock */
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+
+        migrated = failed = 0;
+
+        while (!lib::list_empty(&migrate_list)) {
+            src = lib::list_entry(migrate_list.next, &Page::list);
+            lib::list_del(&src->list);
+
+            if (lib::list_empty(&free_list)) {
+                src->mops->putback(src);
+                failed++;
+                continue;
+            }
+
+            dst = lib::list_entry(free_list.next, &Page::list);
+            lib::list_del(&dst->list);
+
+            if (src->mops->migrate(dst, src) < 0) {
+                lib::list_add_next(&free_list, &dst->list);
+                src->mops->putback(src);
+                failed++;
+                continue;
+            }
+
+            lib::list_add_prev(&done_list, &src->list);
+            migrated++;
+        }
+
+        flags = lib::local_irq_save();
+        this->lock.Lock();
+
+        this->compact_stat.pages_migrated += migrated;
+        this->compact_stat.pages_failed += failed;
+
+        while (!lib::list_empty(&done_list)) {
+            src = lib::list_entry(done_list.next, &Page::list);
+            lib::list_del(&src->list);
+            this->__free_page_direct(src, 0);
+        }
+    }
+
+    /* give back targets that are not used */
+    while (!lib::list_empty(&free_list)) {
+        dst = lib::list_entry(free_list.next, &Page::list);
+        lib::list_del(&dst->list);
+        this->__free_page_direct(dst, 0);
+    }
+
+    if (!success) {
+        success = this->__compact_suitable(order);
+    }
+
+    if (success) {
+        this->compact_stat.successes++;
+    }
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return success;
+}
+
+auto PagePool::GetCompactStat(CompactStat *stat) -> void
+{
+    *stat = this->compact_stat;
+}
+
+/* set types of pageblocks in [start, end) and move free pages there, the caller should hold the lock */
+auto PagePool::__set_range_type(pfn_t start, pfn_t end, base::size_t migrate_type) -> void
+{
+    for (pfn_t pfn = start; pfn < end; pfn += PAGEBLOCK_PAGES) {
+        set_pageblock_type(pfn_to_page(pfn), migrate_type);
+    }
+
+    this->__move_free_pages(start, end, migrate_type);
+}
+
+/* head of the free block covering the pfn, the caller should hold the lock */
+auto PagePool::__find_free_block(pfn_t pfn) -> Page *
+{
+    Page *p;
+
+    for (base::size_t order = 0; order < MAX_PAGE_ORDER; order++) {
+        p = pfn_to_page(pfn & ~((1UL << order) - 1));
+
+        if (p->type == PAGE_NORMAL_MEM && p->pool == this
+            && p->is_head && p->is_free && p->order >= order) {
+            return p;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Migrate movable pages in [start, end) out, which is in isolated pageblocks,
+ * returning the number of pages that are still in use.
+ */
+auto PagePool::__migrate_contig_range(pfn_t start, pfn_t end) -> base::size_t
+{
+    base::size_t flags, busy = 0, migrated;
+    lib::ListHead migrate_list;
+    pfn_t pfn = start;
+    Page *p, *dst;
+
+    while (pfn < end) {
+        lib::list_head_init(&migrate_list);
+        migrated = 0;
+
+        flags = lib::local_irq_save();
+        this->lock.Lock();
+
+        for (base::size_t nr = 0; pfn < end && nr < COMPACT_CLUSTER_MAX; ) {
+            p = this->__find_free_block(pfn);
+            if (p) {
+                pfn = page_to_pfn(p) + (1UL << p->order);
+                continue;
+            }
+
+            p = pfn_to_page(pfn++);
+
+            /* slub pages share the field with `mops`, so they're filtered first */
+            if (p->is_head && p->order == 0 && !p->kc && p->mops && p->mops->isolate(p)) {
+                lib::list_add_prev(&migrate_list, &p->list);
+                nr++;
+            } else {
+                busy++;
+            }
+        }
+
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+
+        /* targets are taken outside, as isolated pages are off the freelists */
+        while (!lib::list_empty(&migrate_list)) {
+            p = lib::list_entry(migrate_list.next, &Page::list);
+            lib::list_del(&p->list);
+
+            dst = this->__alloc_pages(0, MIGRATE_MOVABLE);
+            if (!dst) {
+                p->mops->putback(p);
+                busy++;
+                continue;
+            }
+
+            if (p->mops->migrate(dst, p) < 0) {
+                this->__free_pages(dst, 0, false);
+                p->mops->putback(p);
+                busy++;
+                continue;
+            }
+
+            this->__free_pages(p, 0, false);
+            migrated++;
+        }
+
+        count_mm_event(MM_STAT_CMA_MIGRATED, migrated);
+    }
+
+    return busy;
+}
+
+/**
+ * Take free pages in [start, end) as allocated order-0 pages, pages of the
+ * free blocks out of the range are freed again. The caller should hold the lock.
+ */
+auto PagePool::__take_contig_range(pfn_t start, pfn_t end) -> int
+{
+    base::size_t order;
+    pfn_t pfn, head;
+    Page *p;
+
+    for (pfn = start; pfn < end; pfn = page_to_pfn(p) + (1UL << p->order)) {
+        p = this->__find_free_block(pfn);
+        if (!p) {
+            return -EBUSY;
+        }
+    }
+
+    for (pfn = start; pfn < end; ) {
+        p = this->__find_free_block(pfn);
+        head = page_to_pfn(p);
+        order = p->order;
+
+        this->__freelist_del(p, order);
+
+        for (auto i = 0; i < (1 << order); i++) {
+            this->__reinit_page(&p[i], 0, false);
+        }
+
+        for (auto i = 0; i < (1 << order); i++) {
+            if ((head + i) < start || (head + i) >= end) {
+                this->__free_page_direct(&p[i], 0);
+            }
+        }
+
+        pfn = head + (1UL << order);
+    }
+
+    return 0;
+}
+
+/**
+ * Turn `nr` free pages at the top of the pool into CMA pageblocks, returning
+ * the start through `start`. It should be called at booting stage, when the
+ * memory is still mostly free.
+ */
+auto PagePool::ReserveCMA(base::size_t nr, pfn_t *start) -> int
+{
+    base::size_t flags, found = 0;
+    pfn_t pfn;
+    Page *p;
+
+    nr = (nr + CMA_BLOCK_PAGES - 1) & ~(CMA_BLOCK_PAGES - 1);
+    if (!nr) {
+        return -EINVAL;
+    }
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    /* look for free blocks of the max order next to each other */
+    pfn = this->end_pfn & ~(CMA_BLOCK_PAGES - 1);
+    while (found < nr && pfn >= (this->start_pfn + CMA_BLOCK_PAGES)) {
+        pfn -= CMA_BLOCK_PAGES;
+        p = pfn_to_page(pfn);
+
+        if (p->type == PAGE_NORMAL_MEM && p->pool == this && p->is_head && p->is_free
+            && p->order == CMA_BLOCK_ORDER && get_pageblock_type(p) != MIGRATE_CMA) {
+            found += CMA_BLOCK_PAGES;
+        } else {
+            found = 0;
+        }
+    }
+
+    if (found < nr) {
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+        return -ENOMEM;
+    }
+
+    this->__set_range_type(pfn, pfn + nr, MIGRATE_CMA);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    *start = pfn;
+
+    return 0;
+}
+
+/**
+ * Take pages in [start, end) of CMA pageblocks as allocated order-0 pages,
+ * migrating movable pages there out. It fails with -EBUSY if some of them
+ * are used by unmovable allocations or are busy all the time.
+ */
+auto PagePool::AllocContigRange(pfn_t start, pfn_t end) -> int
+{
+    pfn_t iso_start = start & ~(CMA_BLOCK_PAGES - 1);
+    pfn_t iso_end = (end + CMA_BLOCK_PAGES - 1) & ~(CMA_BLOCK_PAGES - 1);
+    base::size_t flags;
+    int ret = -EBUSY;
+
+    if (start >= end || start < this->start_pfn || end > this->end_pfn) {
+        return -EINVAL;
+    }
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    for (pfn_t pfn = iso_start; pfn < iso_end; pfn += PAGEBLOCK_PAGES) {
+        base::size_t type = get_pageblock_type(pfn_to_page(pfn));
+
+        if (type != MIGRATE_CMA) {
+            this->lock.UnLock();
+            lib::local_irq_restore(flags);
+            return (type == MIGRATE_ISOLATE) ? -EBUSY : -EINVAL;
+        }
+    }
+
+    this->__set_range_type(iso_start, iso_end, MIGRATE_ISOLATE);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    /* cached pages go back to the isolated freelists, including pre-zeroed movable ones */
+    this->DrainZeroedPages();
+    this->DrainPerCPUPages();
+
+    for (auto i = 0; i < CMA_MIGRATE_RETRY_MAX; i++) {
+        if (!this->__migrate_contig_range(start, end)) {
+            ret = 0;
+            break;
+        }
+    }
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    if (ret == 0) {
+        ret = this->__take_contig_range(start, end);
+    }
+
+    this->__set_range_type(iso_start, iso_end, MIGRATE_CMA);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    if (ret == 0) {
+        count_mm_event(MM_STAT_CMA_ALLOC, end - start);
+    } else {
+        count_mm_event(MM_STAT_CMA_ALLOC_FAIL);
+    }
+
+    return ret;
+}
+
+/* give back pages taken by AllocContigRange() */
+auto PagePool::FreeContigRange(pfn_t start, pfn_t end) -> void
+{
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    for (pfn_t pfn = start; pfn < end; pfn++) {
+        this->__free_page_direct(pfn_to_page(pfn), 0);
+    }
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+}
+
+auto PagePool::FreeCMAPages(void) -> base::size_t
+{
+    return this->free_cma_pages;
+}
+
+auto PagePool::Node(void) -> base::size_t
+{
+    return this->nid;
+}
+
+auto PagePool::AllocPages(base::size_t order, gfp_t flags) -> Page *
+{
+    PagePool *pool = this;
+
+    return alloc_pages_from(&pool, 1, order, flags);
+}
+
+auto PagePool::FreePages(Page *page, base::size_t order) -> void
+{
+    this->__free_pages(page, order, false);
+}
+
+/* for pages that are not likely to be in CPU cache, e.g. written by DMA */
+auto PagePool::FreePagesCold(Page *page, base::size_t order) -> void
+{
+    this->__free_pages(page, order, true);
+}
+
+auto PagePool::GetFreeAreaStat(FreeAreaStat *stat) -> void
+{
+    base::size_t flags;
+
+    stat->free_pages = 0;
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+        stat->free_blocks[order] = 0;
+    }
+
+    for (auto type = 0; type < MIGRATE_TYPES; type++) {
+        stat->free_pages_type[type] = 0;
+
+        for (auto order = 0; order < MAX_PAGE_ORDER; order++) {
+            stat->free_blocks[order] += this->free_area_nr[type][order];
+            stat->free_pages_type[type] += (this->free_area_nr[type][order] << order);
+        }
+
+        stat->free_pages += stat->free_pages_type[type];
+    }
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    /* pcp lists are not protected by the lock, so it's just a rough sum */
+    stat->pcp_pages = 0;
+    for (base::size_t cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        PerCPUPages *pcp = this->pcp.Of(cpu);
+
+        for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+            for (auto order = 0; order <= PCP_MAX_ORDER; order++) {
+                stat->pcp_pages += pcp->count[type][order] << order;
+            }
+        }
+    }
+}
+
+/* return all pages cached on local CPU to the buddy */
+auto PagePool::DrainPerCPUPages(void) -> void
+{
+    PerCPUPages *pcp;
+    base::size_t flags;
+
+    flags = lib::local_irq_save();
+
+    pcp = this->pcp.This();
+    for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+        for (auto order = 0; order <= PCP_MAX_ORDER; order++) {
+            this->__drain_pcp_list(pcp, type, order, pcp->count[type][order]);
+        }
+    }
+
+    lib::local_irq_restore(flags);
+}
+
+/* check whether we still have `mark` free pages after allocating */
+auto PagePool::WatermarkOk(base::size_t order, base::size_t mark) -> bool
+{
+    /* lockless, it's just an estimation */
+    return this->free_pages >= (mark + (1UL << order));
+}
+
+/* allocate without reclaiming, fail if it goes below the watermark */
+auto PagePool::TryAllocPages(base::size_t order, base::size_t migrate_type, base::size_t mark) -> Page *
+{
+    Page *p;
+
+    if (!this->WatermarkOk(order, mark)) {
+        return nullptr;
+    }
+
+    /* free pages of CMA can't serve others, lockless as well */
+    if (migrate_type != MIGRATE_MOVABLE
+        && (this->free_pages - this->free_cma_pages) < (mark + (1UL << order))) {
+        return nullptr;
+    }
+
+    p = this->__alloc_pages(order, migrate_type);
+
+    /* start reclaiming in background before we really get short */
+    if (p && this->free_pages < this->watermark[WMARK_LOW]) {
+        this->WakeupReclaim();
+    }
+
+    return p;
+}
+
+auto PagePool::Watermark(base::size_t wmark) -> base::size_t
+{
+    return this->watermark[wmark];
+}
+
+auto PagePool::SetWatermarks(base::size_t min) -> void
+{
+    this->watermark[WMARK_MIN] = min;
+    this->watermark[WMARK_LOW] = min + min / 4;
+    this->watermark[WMARK_HIGH] = min + min / 2;
+}
+
+auto PagePool::ManagedPages(void) -> base::size_t
+{
+    return this->managed_pages;
+}
+
+auto PagePool::WakeupReclaim(void) -> void
+{
+    this->reclaim_pending = true;
+}
+
+/* take a pre-zeroed page of `migrate_type`, returning nullptr if there's none */
+auto PagePool::AllocZeroedPage(base::size_t migrate_type) -> Page *
+{
+    base::size_t flags;
+    Page *p = nullptr;
+
+    /* racy check to avoid taking the lock of an empty list */
+    if (!this->zero_nr[migrate_type]) {
+        return nullptr;
+    }
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    if (!lib::list_empty(&this->zero_list[migrate_type])) {
+        p = lib::list_entry(this->zero_list[migrate_type].next, &Page::list);
+        lib::list_del(&p->list);
+        this->zero_nr[migrate_type]--;
+        this->zero_stat.nr--;
+        this->zero_stat.hits++;
+    }
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return p;
+}
+
+/* zero pages allocated from the pool, for __GFP_ZERO allocations missing pre-zeroed pages */
+auto PagePool::ClearPages(Page *page, base::size_t order) -> void
+{
+    for (auto i = 0; i < (1 << order); i++) {
+        clear_page((void*) page_to_virt(&page[i]));
+    }
+
+    /* it's just statistics, so we don't take the lock */
+    this->zero_stat.misses += (1 << order);
+}
+
+/**
+ * Zero free pages and keep them in the pool until it's full, only when
+ * we're over the high watermark, returning the number of zeroed pages.
+ * The pool is shared evenly by migrate types, and pages of each type are
+ * taken from pageblocks of that type.
+ * Non-temporal stores are used as the pages won't be touched soon.
+ */
+auto PagePool::RefillZeroedPages(void) -> base::size_t
+{
+    base::size_t target, zeroed = 0, flags;
+    base::uint64_t start_tsc;
+    Page *p;
+
+    target = this->managed_pages >> ZERO_POOL_RATIO_SHIFT;
+    if (target > ZERO_POOL_MAX) {
+        target = ZERO_POOL_MAX;
+    }
+
+    target /= MIGRATE_PCPTYPES;
+
+    for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+        while (this->zero_nr[type] < target) {
+            p = this->TryAllocPages(0, type, this->watermark[WMARK_HIGH]);
+            if (!p) {
+                return zeroed;
+            }
+
+            start_tsc = rdtsc();
+            clear_page_nt((void*) page_to_virt(p));
+
+            flags = lib::local_irq_save();
+            this->lock.Lock();
+
+            this->zero_stat.zero_cycles += rdtsc() - start_tsc;
+            this->zero_stat.zeroed_pages++;
+            lib::list_add_prev(&this->zero_list[type], &p->list);
+            this->zero_nr[type]++;
+            this->zero_stat.nr++;
+
+            this->lock.UnLock();
+            lib::local_irq_restore(flags);
+
+            zeroed++;
+        }
+    }
+
+    return zeroed;
+}
+
+/* give pre-zeroed pages back to the buddy, returning the number of them */
+auto PagePool::DrainZeroedPages(void) -> base::size_t
+{
+    base::size_t flags, nr = 0;
+    Page *p;
+
+    for (;;) {
+        flags = lib::local_irq_save();
+        this->lock.Lock();
+
+        p = nullptr;
+        for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+            if (!lib::list_empty(&this->zero_list[type])) {
+                p = lib::list_entry(this->zero_list[type].next, &Page::list);
+                lib::list_del(&p->list);
+                this->zero_nr[type]--;
+                this->zero_stat.nr--;
+                break;
+            }
+        }
+
+        this->lock.UnLock();
+        lib::local_irq_restore(flags);
+
+        if (!p) {
+            break;
+        }
+
+        this->FreePagesCold(p, 0);
+        nr++;
+    }
+
+    return nr;
+}
+
+auto PagePool::GetZeroPoolStat(ZeroPoolStat *stat) -> void
+{
+    *stat = this->zero_stat;
+}
+
+/* direct reclaim, called by the allocator on shortage */
+auto PagePool::ReclaimPages(base::size_t order) -> bool
+{
+    return this->__reclaim_memory(order);
+}
+
+/* background reclaim, run until we're back over the high watermark */
+auto PagePool::BalancePages(void) -> base::size_t
+{
+    base::size_t old_free = this->free_pages, reclaimed;
+
+    if (!this->reclaim_pending) {
+        return 0;
+    }
+
+    this->__reclaim_memory(0);
+    reclaimed = (this->free_pages > old_free) ? (this->free_pages - old_free) : 0;
+
+    /* stop if we're balanced or there is nothing more to reclaim */
+    if (this->free_pages >= this->watermark[WMARK_HIGH] || !reclaimed) {
+        this->reclaim_pending = false;
+    }
+
+    return reclaimed;
+}
+
+auto PagePool::Init(base::size_t nid) -> void
+{
+    this->nid = nid;
+
+    for (auto type = 0; type < MIGRATE_TYPES; type++) {
+        for (auto i = 0; i < MAX_PAGE_ORDER; i++) {
+            lib::list_head_init(&this->freelist[type][i]);
+            this->free_area_nr[type][i] = 0;
+        }
+
+        this->free_area_map[type] = 0;
+    }
+
+    this->managed_pages = 0;
+    this->free_pages = 0;
+    this->free_cma_pages = 0;
+    this->reclaim_pending = false;
+
+    this->start_pfn = ~0UL;
+    this->end_pfn = 0;
+    this->compact_stat = { 0, 0, 0, 0 };
+
+    for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+        lib::list_head_init(&this->zero_list[type]);
+        this->zero_nr[type] = 0;
+    }
+
+    this->zero_stat = { 0, 0, 0, 0, 0 };
+    for (auto i = 0; i < WMARK_NR; i++) {
+        this->watermark[i] = 0;
+    }
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        PerCPUPages *pcp = this->pcp.Of(cpu);
+
+        for (auto type = 0; type < MIGRATE_PCPTYPES; type++) {
+            for (auto order = 0; order <= PCP_MAX_ORDER; order++) {
+                lib::list_head_init(&pcp->lists[type][order]);
+                pcp->count[type][order] = 0;
+            }
+        }
+    }
+
+    this->lock.Reset();
+}
+
+auto PagePool::__span_pfn_range(pfn_t start, pfn_t end) -> void
+{
+    if (start < this->start_pfn) {
+        this->start_pfn = start;
+    }
+
+    if (end > this->end_pfn) {
+        this->end_pfn = end;
+    }
+}
+
+auto PagePool::AddPages(Page *page, base::size_t order) -> void
+{
+    for (auto i = 0; i < (1 << order); i++) {
+        page[i].pool = this;  /* shoudl NOT be changed after initialization */
+        page[i].is_head = false;
+    }
+
+    /* bypass the pcp lists, as it's for booting stage only */
+    this->lock.Lock();
+    this->__free_page_direct(page, order);
+    this->managed_pages += (1UL << order);
+    this->__span_pfn_range(page_to_pfn(page), page_to_pfn(page) + (1UL << order));
+    this->lock.UnLock();
+}
+
+/**
+ * Add free pages in [start, end) in one locked pass.
+ * Each block is inserted at the largest naturally aligned order directly,
+ * and no merging is needed as buddies of them are not fully free in range.
+ * Pageblocks that are entirely free start as movable, while the others keep
+ * being unmovable, as they're shared with memory used at booting stage.
+ */
+auto PagePool::AddPagesRange(pfn_t start, pfn_t end) -> base::size_t
+{
+    base::size_t order, flags;
+    pfn_t pfn = start;
+    Page *p;
+
+    flags = lib::local_irq_save();
+    this->lock.Lock();
+
+    for (pfn = (start + PAGEBLOCK_PAGES - 1) & ~(PAGEBLOCK_PAGES - 1);
+         (pfn + PAGEBLOCK_PAGES) <= end;
+         pfn += PAGEBLOCK_PAGES) {
+        set_pageblock_type(pfn_to_page(pfn), MIGRATE_MOVABLE);
+    }
+
+    pfn = start;
+    while (pfn < end) {
+        order = MAX_PAGE_ORDER - 1;
+
+        while ((pfn & ((1UL << order) - 1)) || (pfn + (1UL << order) > end)) {
+            order--;
+        }
+
+        p = pfn_to_page(pfn);
+        for (auto i = 0; i < (1 << order); i++) {
+            p[i].pool = this;   /* shoudl NOT be changed after initialization */
+            p[i].is_head = false;
+        }
+
+        this->__reinit_page(p, order, true);
+        this->__freelist_add(p, order, get_pageblock_type(p), true);
+
+        pfn += (1UL << order);
+    }
+
+    this->managed_pages += end - start;
+    this->__span_pfn_range(start, end);
+
+    this->lock.UnLock();
+    lib::local_irq_restore(flags);
+
+    return end - start;
+}
+
+struct ShrinkerList {
+    lib::ListHead head;
+    lib::atomic::SpinLock lock;
+};
+
+/* to avoid calling global initializer, we manually point it to mem */
+static base::uint8_t GloblShrinkerListMem[sizeof(ShrinkerList)];
+static ShrinkerList *GloblShrinkerList = (ShrinkerList*) &GloblShrinkerListMem;
+
+auto shrinker_init(void) -> void
+{
+    lib::list_head_init(&GloblShrinkerList->head);
+    GloblShrinkerList->lock.Reset();
+}
+
+auto register_shrinker(Shrinker *shrinker) -> void
+{
+    GloblShrinkerList->lock.Lock();
+    lib::list_add_prev(&GloblShrinkerList->head, &shrinker->list);
+    GloblShrinkerList->lock.UnLock();
+}
+
+auto unregister_shrinker(Shrinker *shrinker) -> void
+{
+    GloblShrinkerList->lock.Lock();
+    lib::list_del(&shrinker->list);
+    GloblShrinkerList->lock.UnLock();
+}
+
+/* ask shrinkers to free `nr` pages on the node, returning the freed number */
+auto shrink_slab(base::size_t nid, base::size_t nr) -> base::size_t
+{
+    base::size_t freed = 0;
+    Shrinker *shrinker;
+
+    GloblShrinkerList->lock.Lock();
+
+    for (auto l = GloblShrinkerList->head.next; l != &GloblShrinkerList->head && freed < nr; l = l->next) {
+        shrinker = lib::list_entry(l, &Shrinker::list);
+
+        if (shrinker->count(shrinker, nid)) {
+            freed += shrinker->scan(shrinker, nid, nr - freed);
+        }
+    }
+
+    GloblShrinkerList->lock.UnLock();
+
+    return freed;
+}
+
+/**
+ * Allocate from pools in the fallback order:
+ * 1. any pool that stays above its LOW watermark
+ * 2. wake up background reclaim, then dip into reserves down to MIN
+ *    (MIN/2 for atomic allocations)
+ * 3. reclaim (and compact for high-order requests) directly and retry once,
+ *    only if the caller is allowed to
+ * Atomic allocations never reclaim directly, they fail instead.
+ */
+auto alloc_pages_from(PagePool **pools, base::size_t pool_nr, base::size_t order, gfp_t flags) -> Page *
+{
+    base::size_t migrate_type = gfp_migrate_type(flags);
+    Page *p = nullptr;
+    base::size_t mark;
+
+    if (order >= MAX_PAGE_ORDER) {
+        return nullptr;
+    }
+
+    /* pre-zeroed pages are out of the buddy, so watermarks don't matter */
+    if (order == 0 && (flags & __GFP_ZERO)) {
+        for (base::size_t i = 0; i < pool_nr; i++) {
+            if (pools[i] && (p = pools[i]->AllocZeroedPage(migrate_type))) {
+                count_mm_event(MM_STAT_PGALLOC);
+                return p;
+            }
+        }
+    }
+
+    for (base::size_t i = 0; i < pool_nr; i++) {
+        if (pools[i] && (p = pools[i]->TryAllocPages(order, migrate_type, pools[i]->Watermark(WMARK_LOW)))) {
+            goto out;
+        }
+    }
+
+    for (base::size_t i = 0; i < pool_nr; i++) {
+        if (pools[i]) {
+            pools[i]->WakeupReclaim();
+        }
+    }
+
+    for (base::size_t i = 0; i < pool_nr; i++) {
+        if (!pools[i]) {
+            continue;
+        }
+
+        mark = pools[i]->Watermark(WMARK_MIN);
+        if (flags & __GFP_ATOMIC) {
+            mark /= 2;
+        }
+
+        if ((p = pools[i]->TryAllocPages(order, migrate_type, mark))) {
+            goto out;
+        }
+    }
+
+    if ((flags & __GFP_ATOMIC) || !(flags & __GFP_RECLAIM)) {
+        goto fail;
+    }
+
+    for (base::size_t i = 0; i < pool_nr; i++) {
+        if (!pools[i] || !pools[i]->ReclaimPages(order)) {
+            continue;
+        }
+
+        if ((p = pools[i]->TryAllocPages(order, migrate_type, pools[i]->Watermark(WMARK_MIN)))) {
+            goto out;
+        }
+    }
+
+fail:
+    count_mm_event(MM_STAT_PGALLOC_FAIL);
+
+    return nullptr;
+
+out:
+    if (flags & __GFP_ZERO) {
+        p->pool->ClearPages(p, order);
+    }
+
+    count_mm_event(MM_STAT_PGALLOC, 1UL << order);
+
+    return p;
+}
+
+/* allocate from all zones allowed by the flags, the node's local zones first */
+auto alloc_pages_node(base::size_t nid, base::size_t order, gfp_t flags) -> Page *
+{
+    base::size_t first = (flags & __GFP_DMA32) ? PAGE_POOL_TYPE_DMA32 : PAGE_POOL_TYPE_NORMAL;
+    PagePoolZonelist *zonelist;
+
+    if (nid >= numa_node_nr) {
+        nid = numa_node_id();
+    }
+
+    zonelist = &GloblPagePoolZonelists[nid][first];
+
+    return alloc_pages_from(zonelist->pools,
+                            (flags & __GFP_THISNODE) ? zonelist->local_nr : zonelist->pool_nr,
+                            order,
+                            flags);
+}
+
+auto alloc_pages(base::size_t order, gfp_t flags = GFP_KERNEL) -> Page *
+{
+    return alloc_pages_node(numa_node_id(), order, flags);
+}
+
+auto free_pages(Page *p, base::size_t order) -> void
+{
+    if (p) {
+        p->pool->FreePages(p, order);
+    }
+}
+
+/* background reclaim entry, run when there is nothing else to do */
+auto balance_page_pools(void) -> void
+{
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            node_page_pool(nid, i)->BalancePages();
+        }
+    }
+}
+
+/* refill pre-zeroed pages of all pools, it should be called at idle time */
+auto refill_zeroed_pages(void) -> base::size_t
+{
+    base::size_t zeroed = 0;
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            zeroed += node_page_pool(nid, i)->RefillZeroedPages();
+        }
+    }
+
+    return zeroed;
+}
+
+/**
+ * Sort pools by their distance to the node, pools on the same node keep
+ * their original order. Empty slots are skipped, returning the number of
+ * pools stored to `dst`.
+ */
+auto sort_pools_by_node(PagePool **dst, PagePool **src, base::size_t nr, base::size_t nid) -> base::size_t
+{
+    base::size_t sorted = 0, dist;
+    PagePool *pool;
+
+    for (base::size_t i = 0; i < nr; i++) {
+        if (!(pool = src[i])) {
+            continue;
+        }
+
+        dist = node_distance(nid, pool->Node());
+
+        /* insertion sort, as there're only a few pools */
+        base::size_t j = sorted;
+        for (; j > 0 && node_distance(nid, dst[j - 1]->Node()) > dist; j--) {
+            dst[j] = dst[j - 1];
+        }
+
+        dst[j] = pool;
+        sorted++;
+    }
+
+    return sorted;
+}
+
+/* build zonelists of each node, pools without memory are not included */
+auto build_page_pool_zonelists(void) -> void
+{
+    PagePool *pools[MAX_NUMNODES * PAGE_POOL_TYPE_NR];
+    PagePoolZonelist *zonelist;
+    base::size_t nr;
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto first = 0; first < PAGE_POOL_TYPE_NR; first++) {
+            zonelist = &GloblPagePoolZonelists[nid][first];
+
+            nr = 0;
+            for (base::size_t node = 0; node < numa_node_nr; node++) {
+                for (auto type = first; type < PAGE_POOL_TYPE_NR; type++) {
+                    if (node_page_pool(node, type)->ManagedPages()) {
+                        pools[nr++] = node_page_pool(node, type);
+                    }
+                }
+            }
+
+            zonelist->pool_nr = sort_pools_by_node(zonelist->pools, pools, nr, nid);
+
+            zonelist->local_nr = 0;
+            while (zonelist->local_nr < zonelist->pool_nr
+                   && zonelist->pools[zonelist->local_nr]->Node() == nid) {
+                zonelist->local_nr++;
+            }
+        }
+    }
+}
+
+static auto int_sqrt(base::size_t x) -> base::size_t
+{
+    base::size_t r = 0;
+
+    for (base::size_t bit = 1UL << 62; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+    }
+
+    return r;
+}
+
+/**
+ * Reserve sqrt(16 * total memory in KB) KB (clamped to [128KB, 64MB]) as the
+ * sum of MIN watermarks, shared by pools in proportion to their sizes.
+ */
+auto setup_page_pool_watermarks(void) -> void
+{
+    base::size_t total = 0, min_free_kb, min_free;
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            total += node_page_pool(nid, i)->ManagedPages();
+        }
+    }
+
+    min_free_kb = int_sqrt(total * (PAGE_SIZE / 1024) * 16);
+    if (min_free_kb < 128) {
+        min_free_kb = 128;
+    } else if (min_free_kb > 65536) {
+        min_free_kb = 65536;
+    }
+
+    min_free = min_free_kb / (PAGE_SIZE / 1024);
+
+    for (base::size_t nid = 0; nid < numa_node_nr; nid++) {
+        for (auto i = 0; i < PAGE_POOL_TYPE_NR; i++) {
+            PagePool *pool = node_page_pool(nid, i);
+
+            pool->SetWatermarks(total ? (min_free * pool->ManagedPages() / total) : 0);
+        }
+    }
 }
 
 };
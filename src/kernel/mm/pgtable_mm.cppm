@@ -0,0 +1,906 @@
+export module kernel.mm:pgtable;
+
+import :layout;
+import :pages;
+import :types;
+import kernel.base;
+import kernel.lib;
+
+#include <closureos/compiler.h>
+#include <closureos/errno.h>
+#include <asm/page.h>
+#include <asm/page_types.h>
+#include <asm/tlbflush.h>
+
+export namespace mm {
+
+/**
+ * TLB invalidations collected during one page table operation.
+ *
+ * Addresses are flushed one by one with invlpg at the end of the operation,
+ * or with a full flush if there are too many of them. Page table pages that
+ * are released by unmapping are freed only after the flush is done, so that
+ * no stale paging-structure cache could still point to them.
+ */
+
+inline constexpr base::size_t TLB_GATHER_MAX_NR = 32;
+
+struct TLBGather {
+    virt_addr_t addrs[TLB_GATHER_MAX_NR];
+    base::size_t nr;
+    bool flush_all;
+    lib::ListHead freed_tables;
+};
+
+auto tlb_gather_init(TLBGather *tlb) -> void
+{
+    tlb->nr = 0;
+    tlb->flush_all = false;
+    lib::list_head_init(&tlb->freed_tables);
+}
+
+auto tlb_gather_add(TLBGather *tlb, virt_addr_t va) -> void
+{
+    if (tlb->flush_all) {
+        return;
+    }
+
+    if (tlb->nr == TLB_GATHER_MAX_NR) {
+        tlb->flush_all = true;
+        return;
+    }
+
+    tlb->addrs[tlb->nr++] = va;
+}
+
+auto tlb_gather_add_table(TLBGather *tlb, Page *table) -> void
+{
+    lib::list_add_next(&tlb->freed_tables, &table->list);
+}
+
+auto tlb_gather_finish(TLBGather *tlb) -> void
+{
+    if (tlb->flush_all) {
+        flush_tlb_all();
+    } else {
+        for (base::size_t i = 0; i < tlb->nr; i++) {
+            flush_tlb_one(tlb->addrs[i]);
+        }
+    }
+
+    while (!lib::list_empty(&tlb->freed_tables)) {
+        Page *table = lib::list_entry(tlb->freed_tables.next, &Page::list);
+
+        lib::list_del(&table->list);
+        table->pool->FreePages(table, 0);
+    }
+
+    tlb_gather_init(tlb);
+}
+
+/**
+ * Runtime page table manager.
+ *
+ * All operations work on ranges: upper level tables are looked up once for
+ * each slot they cover instead of walking from the root for every page, and
+ * all invalidations of one operation are flushed together.
+ * Only 4K pages are created, while existing 2M and 1G pages (e.g. the direct
+ * mapping area) are split if an operation covers them only partially.
+ */
+
+class PageTable {
+public:
+    auto Init(phys_addr_t root) -> void;
+    auto Root(void) -> phys_addr_t;
+
+    auto MapRange(virt_addr_t va, phys_addr_t pa, base::size_t size, page_attr_t attr) -> int;
+    auto UnmapRange(virt_addr_t va, base::size_t size) -> int;
+    auto UnmapRange(virt_addr_t va, base::size_t size, TLBGather *tlb) -> int;
+    auto ProtectRange(virt_addr_t va, base::size_t size, page_attr_t attr) -> int;
+
+    auto Translate(virt_addr_t va, phys_addr_t *pa) -> int;
+    auto RemapPage(virt_addr_t va, phys_addr_t old_pa, phys_addr_t new_pa) -> int;
+
+private:
+    phys_addr_t root;
+    pgd_t *pgd;
+    lib::atomic::SpinLock lock;
+
+    auto __alloc_table(void) -> phys_addr_t;
+    auto __split_pud(pud_t *pud, virt_addr_t va, TLBGather *tlb) -> int;
+    auto __split_pmd(pmd_t *pmd, virt_addr_t va, TLBGather *tlb) -> int;
+
+    auto __map_pte_range(pmd_t *pmd, virt_addr_t va, virt_addr_t end, phys_addr_t &pa, page_attr_t attr) -> int;
+    auto __map_pmd_range(pud_t *pud, virt_addr_t va, virt_addr_t end, phys_addr_t &pa, page_attr_t attr) -> int;
+    auto __map_pud_range(pgd_t *pgd, virt_addr_t va, virt_addr_t end, phys_addr_t &pa, page_attr_t attr) -> int;
+
+    auto __unmap_pte_range(pmd_t *pmd, virt_addr_t va, virt_addr_t end, TLBGather *tlb) -> void;
+    auto __unmap_pmd_range(pud_t *pud, virt_addr_t va, virt_addr_t end, TLBGather *tlb) -> int;
+    auto __unmap_pud_range(pgd_t *pgd, virt_addr_t va, virt_addr_t end, TLBGather *tlb) -> int;
+    auto __unmap_range(virt_addr_t va, virt_addr_t end, TLBGather *tlb) -> int;
+
+    auto __protect_pte_range(pmd_t *pmd, virt_addr_t va, virt_addr_t end, page_attr_t attr, TLBGather *tlb) -> void;
+    auto __protect_pmd_range(pud_t *pud, virt_addr_t va, virt_addr_t end, page_attr_t attr, TLBGather *tlb) -> int;
+    auto __protect_pud_range(pgd_t *pgd, virt_addr_t va, virt_addr_t end, page_attr_t attr, TLBGather *tlb) -> int;
+};
+
+base::uint8_t GloblKernPageTableMem[sizeof(PageTable)]; /* to avoid calling global initializer, we manually point it to mem */
+PageTable *GloblKernPageTable = (PageTable*) &GloblKernPageTableMem;
+
+/* helpers for walking */
+
+__always_inline auto pgtable_entry_table(base::uint64_t entry) -> base::uint64_t*
+{
+    return (base::uint64_t*) phys_to_virt(entry & PTE_PFN_MASK);
+}
+
+__always_inline auto pgtable_entry_is_large(base::uint64_t entry) -> bool
+{
+    return (entry & PDE_ATTR_PS) != 0;
+}
+
+/* end of the slot (in size of `slot_sz`) containing va, clipped to `end` */
+__always_inline auto pgtable_slot_end(virt_addr_t va, virt_addr_t end, base::size_t slot_sz) -> virt_addr_t
+{
+    virt_addr_t next = (va + slot_sz) & ~(slot_sz - 1);
+
+    /* next might be wrapped to 0 at the top of address space */
+    return (next - 1 < end - 1) ? next : end;
+}
+
+__always_inline auto pgtable_slot_covered(virt_addr_t va, virt_addr_t end, base::size_t slot_sz) -> bool
+{
+    return !(va & (slot_sz - 1)) && (end - va) >= slot_sz;
+}
+
+auto PageTable::Init(phys_addr_t root) -> void
+{
+    this->root = root & PTE_PFN_MASK;
+    this->pgd = (pgd_t*) phys_to_virt(this->root);
+    this->lock.Reset();
+}
+
+auto PageTable::Root(void) -> phys_addr_t
+{
+    return this->root;
+}
+
+/* allocate a zeroed page for page table, 0 for failure */
+auto PageTable::__alloc_table(void) -> phys_addr_t
+{
+    Page *page = alloc_pages(0, GFP_KERNEL | __GFP_ZERO);
+
+    if (!page) {
+        return 0;
+    }
+
+    return page_to_phys(page);
+}
+
+/* split a 1G page into 512 2M pages with the same attributes */
+auto PageTable::__split_pud(pud_t *pud, virt_addr_t va, TLBGather *tlb) -> int
+{
+    phys_addr_t pa = *pud & PTE_PFN_MASK & ~(PUD_PAGE_SIZE - 1);
+    page_attr_t attr = *pud & ~PTE_PFN_MASK;
+    phys_addr_t table = this->__alloc_table();
+    pmd_t *pmd;
+
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    pmd = (pmd_t*) phys_to_virt(table);
+    for (auto i = 0; i < PT_ENTRY_NR; i++) {
+        pmd[i] = (pa + i * PMD_PAGE_SIZE) | attr;
+    }
+
+    *pud = table | PDE_DEFAULT | (attr & PTE_ATTR_US);
+
+    /* invlpg on any address of a large page drops the whole translation */
+    tlb_gather_add(tlb, va & ~(PUD_PAGE_SIZE - 1));
+
+    return 0;
+}
+
+/* split a 2M page into 512 4K pages with the same attributes */
+auto PageTable::__split_pmd(pmd_t *pmd, virt_addr_t va, TLBGather *tlb) -> int
+{
+    phys_addr_t pa = *pmd & PTE_PFN_MASK & ~(PMD_PAGE_SIZE - 1);
+    page_attr_t attr = *pmd & ~PTE_PFN_MASK & ~((page_attr_t) PDE_ATTR_PS);
+    phys_addr_t table = this->__alloc_table();
+    pte_t *pte;
+
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    pte = (pte_t*) phys_to_virt(table);
+    for (auto i = 0; i < PT_ENTRY_NR; i++) {
+        pte[i] = (pa + i * PAGE_SIZE) | attr;
+    }
+
+    *pmd = table | PDE_DEFAULT | (attr & PTE_ATTR_US);
+
+    tlb_gather_add(tlb, va & ~(PMD_PAGE_SIZE - 1));
+
+    return 0;
+}
+
+/**
+ * Map operations.
+ * `pa` is advanced with each mapped page, so that the caller knows how much
+ * has been done if we fail in the middle.
+ * Entries to be mapped are not present before, so no flush is needed.
+ */
+
+auto PageTable::__map_pte_range(pmd_t *pmd,
+                                virt_addr_t va,
+                                virt_addr_t end,
+                                phys_addr_t &pa,
+                                page_attr_t attr) -> int
+{
+    pte_t *pte = pgtable_entry_table(*pmd);
+
+    for (; va != end; va += PAGE_SIZE) {
+        if (pte[PTE_ENTRY(va)] & PTE_ATTR_P) {
+            return -EEXIST;
+        }
+
+        pte[PTE_ENTRY(va)] = pa | attr;
+        pa += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+auto PageTable::__map_pmd_range(pud_t *pud,
+                                virt_addr_t va,
+                                virt_addr_t end,
+                                phys_addr_t &pa,
+                                page_attr_t attr) -> int
+{
+    pmd_t *pmd = pgtable_entry_table(*pud);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pmd_t *entry = &pmd[PMD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, PMD_PAGE_SIZE);
+
+        if (!*entry) {
+            phys_addr_t table = this->__alloc_table();
+
+            if (!table) {
+                return -ENOMEM;
+            }
+
+            *entry = table | PDE_DEFAULT | (attr & PTE_ATTR_US);
+        } else if (pgtable_entry_is_large(*entry)) {
+            return -EEXIST;
+        }
+
+        if ((ret = this->__map_pte_range(entry, va, next, pa, attr)) < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+auto PageTable::__map_pud_range(pgd_t *pgd,
+                                virt_addr_t va,
+                                virt_addr_t end,
+                                phys_addr_t &pa,
+                                page_attr_t attr) -> int
+{
+    pud_t *pud = pgtable_entry_table(*pgd);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pud_t *entry = &pud[PUD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, PUD_PAGE_SIZE);
+
+        if (!*entry) {
+            phys_addr_t table = this->__alloc_table();
+
+            if (!table) {
+                return -ENOMEM;
+            }
+
+            *entry = table | PDE_DEFAULT | (attr & PTE_ATTR_US);
+        } else if (pgtable_entry_is_large(*entry)) {
+            return -EEXIST;
+        }
+
+        if ((ret = this->__map_pmd_range(entry, va, next, pa, attr)) < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Unmap operations.
+ * A PTE or PMD table is released if the range covers all of it, tables
+ * allocated at booting stage are not from the buddy and simply left there.
+ * PUD tables are kept, as they could be shared between address spaces.
+ * Splitting a partially covered large page may fail for lack of memory.
+ */
+
+auto PageTable::__unmap_pte_range(pmd_t *pmd,
+                                  virt_addr_t va,
+                                  virt_addr_t end,
+                                  TLBGather *tlb) -> void
+{
+    pte_t *pte = pgtable_entry_table(*pmd);
+
+    for (; va != end; va += PAGE_SIZE) {
+        if (pte[PTE_ENTRY(va)] & PTE_ATTR_P) {
+            tlb_gather_add(tlb, va);
+        }
+
+        pte[PTE_ENTRY(va)] = 0;
+    }
+}
+
+auto PageTable::__unmap_pmd_range(pud_t *pud,
+                                  virt_addr_t va,
+                                  virt_addr_t end,
+                                  TLBGather *tlb) -> int
+{
+    pmd_t *pmd = pgtable_entry_table(*pud);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pmd_t *entry = &pmd[PMD_ENTRY(va)];
+        Page *table;
+
+        next = pgtable_slot_end(va, end, PMD_PAGE_SIZE);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if (pgtable_entry_is_large(*entry)) {
+            if (pgtable_slot_covered(va, next, PMD_PAGE_SIZE)) {
+                tlb_gather_add(tlb, va);
+                *entry = 0;
+                continue;
+            }
+
+            if ((ret = this->__split_pmd(entry, va, tlb)) < 0) {
+                return ret;
+            }
+        }
+
+        this->__unmap_pte_range(entry, va, next, tlb);
+
+        if (pgtable_slot_covered(va, next, PMD_PAGE_SIZE)) {
+            table = phys_to_page(*entry & PTE_PFN_MASK);
+            if (table->pool) {
+                *entry = 0;
+                tlb_gather_add_table(tlb, table);
+            }
+        }
+    }
+
+    return 0;
+}
+
+auto PageTable::__unmap_pud_range(pgd_t *pgd,
+                                  virt_addr_t va,
+                                  virt_addr_t end,
+                                  TLBGather *tlb) -> int
+{
+    pud_t *pud = pgtable_entry_table(*pgd);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pud_t *entry = &pud[PUD_ENTRY(va)];
+        Page *table;
+
+        next = pgtable_slot_end(va, end, PUD_PAGE_SIZE);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if (pgtable_entry_is_large(*entry)) {
+            if (pgtable_slot_covered(va, next, PUD_PAGE_SIZE)) {
+                tlb_gather_add(tlb, va);
+                *entry = 0;
+                continue;
+            }
+
+            if ((ret = this->__split_pud(entry, va, tlb)) < 0) {
+                return ret;
+            }
+        }
+
+        if ((ret = this->__unmap_pmd_range(entry, va, next, tlb)) < 0) {
+            return ret;
+        }
+
+        if (pgtable_slot_covered(va, next, PUD_PAGE_SIZE)) {
+            table = phys_to_page(*entry & PTE_PFN_MASK);
+            if (table->pool) {
+                *entry = 0;
+                tlb_gather_add_table(tlb, table);
+            }
+        }
+    }
+
+    return 0;
+}
+
+auto PageTable::__unmap_range(virt_addr_t va, virt_addr_t end, TLBGather *tlb) -> int
+{
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pgd_t *entry = &this->pgd[PGD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, 1UL << PGD_OFFSET);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if ((ret = this->__unmap_pud_range(entry, va, next, tlb)) < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Protect operations.
+ * Holes in the range are skipped, large pages covered entirely are kept.
+ */
+
+auto PageTable::__protect_pte_range(pmd_t *pmd,
+                                    virt_addr_t va,
+                                    virt_addr_t end,
+                                    page_attr_t attr,
+                                    TLBGather *tlb) -> void
+{
+    pte_t *pte = pgtable_entry_table(*pmd);
+
+    for (; va != end; va += PAGE_SIZE) {
+        pte_t *entry = &pte[PTE_ENTRY(va)];
+        pte_t new_entry;
+
+        if (!(*entry & PTE_ATTR_P)) {
+            continue;
+        }
+
+        new_entry = (*entry & PTE_PFN_MASK) | attr;
+        if (new_entry != *entry) {
+            *entry = new_entry;
+            tlb_gather_add(tlb, va);
+        }
+    }
+}
+
+auto PageTable::__protect_pmd_range(pud_t *pud,
+                                    virt_addr_t va,
+                                    virt_addr_t end,
+                                    page_attr_t attr,
+                                    TLBGather *tlb) -> int
+{
+    pmd_t *pmd = pgtable_entry_table(*pud);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pmd_t *entry = &pmd[PMD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, PMD_PAGE_SIZE);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if (pgtable_entry_is_large(*entry)) {
+            if (pgtable_slot_covered(va, next, PMD_PAGE_SIZE)) {
+                *entry = (*entry & PTE_PFN_MASK) | attr | PDE_ATTR_PS;
+                tlb_gather_add(tlb, va);
+                continue;
+            }
+
+            if ((ret = this->__split_pmd(entry, va, tlb)) < 0) {
+                return ret;
+            }
+        }
+
+        this->__protect_pte_range(entry, va, next, attr, tlb);
+    }
+
+    return 0;
+}
+
+auto PageTable::__protect_pud_range(pgd_t *pgd,
+                                    virt_addr_t va,
+                                    virt_addr_t end,
+                                    page_attr_t attr,
+                                    TLBGather *tlb) -> int
+{
+    pud_t *pud = pgtable_entry_table(*pgd);
+    virt_addr_t next;
+    int ret;
+
+    for (; va != end; va = next) {
+        pud_t *entry = &pud[PUD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, PUD_PAGE_SIZE);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if (pgtable_entry_is_large(*entry)) {
+            if (pgtable_slot_covered(va, next, PUD_PAGE_SIZE)) {
+                *entry = (*entry & PTE_PFN_MASK) | attr | PDE_ATTR_PS;
+                tlb_gather_add(tlb, va);
+                continue;
+            }
+
+            if ((ret = this->__split_pud(entry, va, tlb)) < 0) {
+                return ret;
+            }
+        }
+
+        if ((ret = this->__protect_pmd_range(entry, va, next, attr, tlb)) < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Map [pa, pa + size) to [va, va + size) with 4K pages.
+ * Nothing will be mapped on failure.
+ */
+auto PageTable::MapRange(virt_addr_t va,
+                         phys_addr_t pa,
+                         base::size_t size,
+                         page_attr_t attr) -> int
+{
+    virt_addr_t start = va, end = va + size, next;
+    phys_addr_t curr_pa = pa;
+    TLBGather tlb;
+    int ret = 0;
+
+    if ((va | pa | size) & ~PAGE_MASK || !size || (end - 1) < va) {
+        return -EINVAL;
+    }
+
+    attr = (attr & ~PTE_PFN_MASK) | PTE_ATTR_P;
+
+    this->lock.Lock();
+
+    for (; va != end; va = next) {
+        pgd_t *entry = &this->pgd[PGD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, 1UL << PGD_OFFSET);
+
+        if (!*entry) {
+            phys_addr_t table = this->__alloc_table();
+
+            if (!table) {
+                ret = -ENOMEM;
+                break;
+            }
+
+            *entry = table | PDE_DEFAULT | (attr & PTE_ATTR_US);
+        }
+
+        if ((ret = this->__map_pud_range(entry, va, next, curr_pa, attr)) < 0) {
+            break;
+        }
+    }
+
+    if (ret < 0 && curr_pa != pa) {
+        tlb_gather_init(&tlb);
+        this->__unmap_range(start, start + (curr_pa - pa), &tlb);
+        tlb_gather_finish(&tlb);
+    }
+
+    this->lock.UnLock();
+
+    return ret;
+}
+
+auto PageTable::UnmapRange(virt_addr_t va, base::size_t size) -> int
+{
+    virt_addr_t end = va + size;
+    TLBGather tlb;
+    int ret;
+
+    if ((va | size) & ~PAGE_MASK || !size || (end - 1) < va) {
+        return -EINVAL;
+    }
+
+    tlb_gather_init(&tlb);
+
+    this->lock.Lock();
+    ret = this->__unmap_range(va, end, &tlb);
+    tlb_gather_finish(&tlb);
+    this->lock.UnLock();
+
+    return ret;
+}
+
+/**
+ * Unmap without flushing, invalidations and freed tables are collected into
+ * `tlb`, so that the flush could be deferred and batched by the caller with
+ * tlb_gather_finish(). The range must not be reused before that.
+ */
+auto PageTable::UnmapRange(virt_addr_t va, base::size_t size, TLBGather *tlb) -> int
+{
+    virt_addr_t end = va + size;
+    int ret;
+
+    if ((va | size) & ~PAGE_MASK || !size || (end - 1) < va) {
+        return -EINVAL;
+    }
+
+    this->lock.Lock();
+    ret = this->__unmap_range(va, end, tlb);
+    this->lock.UnLock();
+
+    return ret;
+}
+
+/**
+ * Change attributes of mapped pages in [va, va + size), large pages will be
+ * split if they are partially covered. Pages that have been changed before a
+ * failure are kept changed.
+ */
+auto PageTable::ProtectRange(virt_addr_t va, base::size_t size, page_attr_t attr) -> int
+{
+    virt_addr_t end = va + size, next;
+    TLBGather tlb;
+    int ret = 0;
+
+    if ((va | size) & ~PAGE_MASK || !size || (end - 1) < va) {
+        return -EINVAL;
+    }
+
+    attr = (attr & ~PTE_PFN_MASK & ~((page_attr_t) PDE_ATTR_PS)) | PTE_ATTR_P;
+
+    tlb_gather_init(&tlb);
+
+    this->lock.Lock();
+
+    for (; va != end; va = next) {
+        pgd_t *entry = &this->pgd[PGD_ENTRY(va)];
+
+        next = pgtable_slot_end(va, end, 1UL << PGD_OFFSET);
+
+        if (!*entry) {
+            continue;
+        }
+
+        if ((ret = this->__protect_pud_range(entry, va, next, attr, &tlb)) < 0) {
+            break;
+        }
+    }
+
+    tlb_gather_finish(&tlb);
+
+    this->lock.UnLock();
+
+    return ret;
+}
+
+/* look up the physical address that `va` is mapped to */
+auto PageTable::Translate(virt_addr_t va, phys_addr_t *pa) -> int
+{
+    pgd_t pgd_entry;
+    pud_t pud_entry;
+    pmd_t pmd_entry;
+    pte_t pte_entry;
+    int ret = -EFAULT;
+
+    this->lock.Lock();
+
+    pgd_entry = this->pgd[PGD_ENTRY(va)];
+    if (!(pgd_entry & PDE_ATTR_P)) {
+        goto out;
+    }
+
+    pud_entry = pgtable_entry_table(pgd_entry)[PUD_ENTRY(va)];
+    if (!(pud_entry & PDE_ATTR_P)) {
+        goto out;
+    }
+
+    if (pgtable_entry_is_large(pud_entry)) {
+        *pa = (pud_entry & PTE_PFN_MASK & ~(PUD_PAGE_SIZE - 1)) + (va & (PUD_PAGE_SIZE - 1));
+        ret = 0;
+        goto out;
+    }
+
+    pmd_entry = pgtable_entry_table(pud_entry)[PMD_ENTRY(va)];
+    if (!(pmd_entry & PDE_ATTR_P)) {
+        goto out;
+    }
+
+    if (pgtable_entry_is_large(pmd_entry)) {
+        *pa = (pmd_entry & PTE_PFN_MASK & ~(PMD_PAGE_SIZE - 1)) + (va & (PMD_PAGE_SIZE - 1));
+        ret = 0;
+        goto out;
+    }
+
+    pte_entry = pgtable_entry_table(pmd_entry)[PTE_ENTRY(va)];
+    if (!(pte_entry & PTE_ATTR_P)) {
+        goto out;
+    }
+
+    *pa = (pte_entry & PTE_PFN_MASK) + (va & ~PAGE_MASK);
+    ret = 0;
+
+out:
+    this->lock.UnLock();
+
+    return ret;
+}
+
+/**
+ * Switch the 4K page mapped at `va` from `old_pa` to `new_pa`, keeping its
+ * attributes, for migrating the page.
+ */
+auto PageTable::RemapPage(virt_addr_t va, phys_addr_t old_pa, phys_addr_t new_pa) -> int
+{
+    TLBGather tlb;
+    pgd_t pgd_entry;
+    pud_t pud_entry;
+    pmd_t pmd_entry;
+    pte_t *pte;
+    int ret = -EFAULT;
+
+    va &= PAGE_MASK;
+    tlb_gather_init(&tlb);
+
+    this->lock.Lock();
+
+    pgd_entry = this->pgd[PGD_ENTRY(va)];
+    if (!(pgd_entry & PDE_ATTR_P)) {
+        goto out;
+    }
+
+    pud_entry = pgtable_entry_table(pgd_entry)[PUD_ENTRY(va)];
+    if (!(pud_entry & PDE_ATTR_P) || pgtable_entry_is_large(pud_entry)) {
+        goto out;
+    }
+
+    pmd_entry = pgtable_entry_table(pud_entry)[PMD_ENTRY(va)];
+    if (!(pmd_entry & PDE_ATTR_P) || pgtable_entry_is_large(pmd_entry)) {
+        goto out;
+    }
+
+    pte = &pgtable_entry_table(pmd_entry)[PTE_ENTRY(va)];
+    if (!(*pte & PTE_ATTR_P)) {
+        goto out;
+    }
+
+    if ((*pte & PTE_PFN_MASK) != (old_pa & PAGE_MASK)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    *pte = (*pte & ~PTE_PFN_MASK) | (new_pa & PAGE_MASK);
+    tlb_gather_add(&tlb, va);
+    ret = 0;
+
+out:
+    this->lock.UnLock();
+
+    tlb_gather_finish(&tlb);
+
+    return ret;
+}
+
+/**
+ * Movable operations for pages mapped into the kernel page table, the owner
+ * sets `mops_private` to the virtual address the page is mapped at.
+ * An isolated page is marked by holding `page->lock`, the owner should take
+ * it and clear `mops` before freeing the page (see kern_mapped_page_release()).
+ */
+
+static auto kern_mapped_page_isolate(Page *page) -> bool
+{
+    if (!page->lock.TryLock()) {
+        return false;
+    }
+
+    /* the owner is freeing it */
+    if (!page->mops) {
+        page->lock.UnLock();
+        return false;
+    }
+
+    return true;
+}
+
+static auto kern_mapped_page_migrate(Page *dst, Page *src) -> int
+{
+    virt_addr_t va = src->mops_private;
+    base::size_t flags;
+    int ret;
+
+    /* no one could touch the page between copying and remapping, as we're UP now */
+    flags = lib::local_irq_save();
+
+    copy_page((void*) page_to_virt(dst), (void*) page_to_virt(src));
+
+    /* the owner may free `dst` as soon as it's mapped */
+    dst->mops = src->mops;
+    dst->mops_private = va;
+
+    ret = GloblKernPageTable->RemapPage(va, page_to_phys(src), page_to_phys(dst));
+    if (ret == 0) {
+        /* `src` is freed by compaction, the owner waiting on it will find `dst` */
+        src->mops = nullptr;
+        src->lock.UnLock();
+    } else {
+        dst->mops = nullptr;
+    }
+
+    lib::local_irq_restore(flags);
+
+    return ret;
+}
+
+static auto kern_mapped_page_putback(Page *page) -> void
+{
+    page->lock.UnLock();
+}
+
+extern const MovableOps KernMappedPageOps = {
+    .isolate = kern_mapped_page_isolate,
+    .migrate = kern_mapped_page_migrate,
+    .putback = kern_mapped_page_putback,
+};
+
+/**
+ * Stop compaction from taking the page mapped at `va`, returning it so that
+ * the owner could free it, or nullptr if nothing is mapped there. It waits
+ * for the page to be migrated or put back if it's isolated now.
+ */
+auto kern_mapped_page_release(virt_addr_t va) -> Page*
+{
+    phys_addr_t pa;
+    Page *page;
+
+    for (;;) {
+        if (GloblKernPageTable->Translate(va, &pa) < 0) {
+            return nullptr;
+        }
+
+        page = phys_to_page(pa);
+        page->lock.Lock();
+
+        /* it has been migrated while we're waiting */
+        if (GloblKernPageTable->Translate(va, &pa) < 0 || phys_to_page(pa) != page) {
+            page->lock.UnLock();
+            continue;
+        }
+
+        page->mops = nullptr;
+        page->lock.UnLock();
+
+        return page;
+    }
+}
+
+};
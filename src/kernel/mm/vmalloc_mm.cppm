@@ -0,0 +1,889 @@
+export module kernel.mm:vmalloc;
+
+import :heap;
+import :layout;
+import :pages;
+import :pgtable;
+import :types;
+import kernel.base;
+import kernel.lib;
+
+#include <closureos/compiler.h>
+#include <closureos/errno.h>
+#include <asm/page_types.h>
+
+export namespace mm {
+
+/**
+ * Virtually contiguous memory allocator for the dynamic mapping region.
+ *
+ * - free ranges are kept in an rbtree sorted by address, augmented with the
+ *   largest free size of each subtree, so that the lowest fitting range could
+ *   be found in O(log n) without walking through all of them
+ * - busy ranges are kept in another rbtree for looking up on freeing
+ * - freed ranges are unmapped without flushing TLB and put on a purge list,
+ *   they're flushed all at once and given back to the free tree when there
+ *   are too many of them, or when we run out of free ranges
+ * - small mappings (vm_map_ram) are carved from per-CPU vmap blocks, so that
+ *   most of them don't need to touch the trees
+ */
+
+enum vmap_area_flags {
+    VMAP_AREA_VMALLOC   = (1 << 0), /* backed by pages allocated by us */
+    VMAP_AREA_MAP       = (1 << 1), /* backed by pages from the caller */
+    VMAP_AREA_IOREMAP   = (1 << 2), /* backed by MMIO */
+    VMAP_AREA_BLOCK     = (1 << 3), /* a vmap block for small mappings */
+};
+
+struct VMapArea {
+    virt_addr_t va_start;
+    virt_addr_t va_end;
+    lib::RBNode rb_node;    /* in the free tree or the busy tree */
+    lib::ListHead list;     /* in the free list or the purge list */
+    base::size_t subtree_max_size;  /* used only in the free tree */
+    base::size_t flags;
+    void *private_data;
+};
+
+/* max number of pages waiting for TLB flushing before we purge them */
+inline constexpr base::size_t VMAP_LAZY_MAX_PAGES = ((32UL << 20) >> PAGE_SHIFT);
+
+/* vmap blocks are aligned to their sizes */
+inline constexpr base::size_t VMAP_BLOCK_PAGES = 64;
+inline constexpr base::size_t VMAP_BLOCK_SIZE = (VMAP_BLOCK_PAGES << PAGE_SHIFT);
+inline constexpr base::size_t VMAP_BLOCK_MAX_PAGES = (VMAP_BLOCK_PAGES / 4);
+
+/**
+ * Ranges are handed out from a block in a bump way, and the block is freed
+ * after all of them are given back and it's no longer used by its CPU.
+ */
+struct VMapBlock {
+    VMapArea *va;
+    base::size_t free_offset;   /* pages that have been handed out */
+    base::size_t dirty;         /* pages that have been given back */
+    bool active;                /* still the current block of its CPU */
+    lib::atomic::SpinLock lock;
+};
+
+struct VMapBlockCPU {
+    VMapBlock *block;
+};
+
+__always_inline auto vmap_area_size(VMapArea *va) -> base::size_t
+{
+    return va->va_end - va->va_start;
+}
+
+__always_inline auto vmap_rb_entry(lib::RBNode *node) -> VMapArea*
+{
+    return lib::rb_entry(node, &VMapArea::rb_node);
+}
+
+/* callbacks for maintaining `subtree_max_size` of the free tree */
+
+static auto vmap_subtree_max(lib::RBNode *node) -> base::size_t
+{
+    return node ? vmap_rb_entry(node)->subtree_max_size : 0;
+}
+
+static auto vmap_compute_subtree_max(VMapArea *va) -> base::size_t
+{
+    base::size_t max = vmap_area_size(va), child;
+
+    if ((child = vmap_subtree_max(va->rb_node.left)) > max) {
+        max = child;
+    }
+
+    if ((child = vmap_subtree_max(va->rb_node.right)) > max) {
+        max = child;
+    }
+
+    return max;
+}
+
+static auto vmap_augment_propagate(lib::RBNode *node, lib::RBNode *stop) -> void
+{
+    while (node != stop) {
+        VMapArea *va = vmap_rb_entry(node);
+        base::size_t max = vmap_compute_subtree_max(va);
+
+        /* ancestors won't change if this one doesn't */
+        if (va->subtree_max_size == max) {
+            break;
+        }
+
+        va->subtree_max_size = max;
+        node = lib::rb_parent(node);
+    }
+}
+
+static auto vmap_augment_copy(lib::RBNode *old_node, lib::RBNode *new_node) -> void
+{
+    vmap_rb_entry(new_node)->subtree_max_size = vmap_rb_entry(old_node)->subtree_max_size;
+}
+
+static auto vmap_augment_rotate(lib::RBNode *old_node, lib::RBNode *new_node) -> void
+{
+    VMapArea *old_va = vmap_rb_entry(old_node);
+
+    vmap_rb_entry(new_node)->subtree_max_size = old_va->subtree_max_size;
+    old_va->subtree_max_size = vmap_compute_subtree_max(old_va);
+}
+
+static const lib::RBAugmentCallbacks vmap_augment_callbacks = {
+    .propagate = vmap_augment_propagate,
+    .copy = vmap_augment_copy,
+    .rotate = vmap_augment_rotate,
+};
+
+class VMapAllocator {
+public:
+    auto Init(virt_addr_t start, virt_addr_t end) -> void;
+
+    auto AllocArea(base::size_t size, base::size_t align, base::size_t flags) -> VMapArea*;
+    auto RemoveArea(virt_addr_t addr, base::size_t flags = 0) -> VMapArea*;
+    auto FreeArea(VMapArea *va) -> void;
+    auto Purge(void) -> void;
+
+    auto BlockAlloc(base::size_t nr) -> virt_addr_t;
+    auto BlockFree(virt_addr_t addr, base::size_t nr) -> void;
+
+private:
+    virt_addr_t start, end;
+
+    lib::RBRoot free_root;
+    lib::ListHead free_list;    /* sorted by address, for merging */
+    lib::RBRoot busy_root;
+
+    lib::ListHead purge_list;
+    base::size_t lazy_pages;
+    TLBGather purge_tlb;
+
+    lib::atomic::SpinLock lock;
+
+    lib::PerCPU<VMapBlockCPU> cpu_block;
+
+    auto __find_lowest_match(base::size_t size, base::size_t align) -> VMapArea*;
+    auto __link_free(VMapArea *va) -> void;
+    auto __unlink_free(VMapArea *va) -> void;
+    auto __insert_free(VMapArea *va) -> void;
+    auto __clip_free(VMapArea *va, virt_addr_t start, base::size_t size, VMapArea **spare) -> void;
+
+    auto __insert_busy(VMapArea *va) -> void;
+    auto __find_busy(virt_addr_t addr) -> VMapArea*;
+
+    auto __free_area_lazy(VMapArea *va) -> void;
+    auto __purge(void) -> void;
+
+    auto __block_release(VMapBlock *vb) -> void;
+};
+
+/* to avoid calling global initializer, we manually point it to mem */
+base::uint8_t GloblVMapAllocatorMem[sizeof(VMapAllocator)];
+VMapAllocator *GloblVMapAllocator = (VMapAllocator*) &GloblVMapAllocatorMem;
+
+static auto vmap_area_alloc(void) -> VMapArea*
+{
+    return (VMapArea*) kmalloc<sizeof(VMapArea)>();
+}
+
+static auto vmap_area_free(VMapArea *va) -> void
+{
+    if (va) {
+        GloblKHeapPool->Free(va);
+    }
+}
+
+auto VMapAllocator::Init(virt_addr_t start, virt_addr_t end) -> void
+{
+    VMapArea *va;
+
+    this->start = start;
+    this->end = end;
+
+    lib::rb_root_init(&this->free_root);
+    lib::list_head_init(&this->free_list);
+    lib::rb_root_init(&this->busy_root);
+
+    lib::list_head_init(&this->purge_list);
+    this->lazy_pages = 0;
+    tlb_gather_init(&this->purge_tlb);
+
+    this->lock.Reset();
+
+    for (auto cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        this->cpu_block.Of(cpu)->block = nullptr;
+    }
+
+    va = vmap_area_alloc();
+    if (!va) {
+        return ;
+    }
+
+    va->va_start = start;
+    va->va_end = end;
+    this->__link_free(va);
+}
+
+/**
+ * Find the free range with the lowest address that could hold `size` bytes
+ * aligned to `align`. We search for (size + align - 1) so that any range in
+ * a subtree with enough max size fits, no backtracking is needed.
+ */
+auto VMapAllocator::__find_lowest_match(base::size_t size, base::size_t align) -> VMapArea*
+{
+    base::size_t length = size + align - 1;
+    lib::RBNode *node = this->free_root.node;
+    VMapArea *va;
+
+    while (node) {
+        va = vmap_rb_entry(node);
+
+        if (vmap_subtree_max(node->left) >= length) {
+            node = node->left;
+            continue;
+        }
+
+        if (vmap_area_size(va) >= length) {
+            return va;
+        }
+
+        if (vmap_subtree_max(node->right) >= length) {
+            node = node->right;
+            continue;
+        }
+
+        break;
+    }
+
+    return nullptr;
+}
+
+/* link the range into the free tree and the free list, without merging */
+auto VMapAllocator::__link_free(VMapArea *va) -> void
+{
+    lib::RBNode **link = &this->free_root.node, *parent = nullptr;
+    VMapArea *tmp = nullptr;
+
+    while (*link) {
+        parent = *link;
+        tmp = vmap_rb_entry(parent);
+
+        if (va->va_start < tmp->va_start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    lib::rb_link_node(&va->rb_node, parent, link);
+
+    /* the parent is the neighbour of a leaf in address order */
+    if (!parent) {
+        lib::list_add_next(&this->free_list, &va->list);
+    } else if (link == &parent->left) {
+        lib::list_add_prev(&tmp->list, &va->list);
+    } else {
+        lib::list_add_next(&tmp->list, &va->list);
+    }
+
+    va->subtree_max_size = vmap_area_size(va);
+    vmap_augment_propagate(parent, nullptr);
+    lib::rb_insert_augmented(&va->rb_node, &this->free_root, &vmap_augment_callbacks);
+}
+
+auto VMapAllocator::__unlink_free(VMapArea *va) -> void
+{
+    lib::rb_erase_augmented(&va->rb_node, &this->free_root, &vmap_augment_callbacks);
+    lib::list_del(&va->list);
+}
+
+/* give the range back to the free tree, merging with its neighbours */
+auto VMapAllocator::__insert_free(VMapArea *va) -> void
+{
+    VMapArea *sibling;
+
+    this->__link_free(va);
+
+    if (va->list.next != &this->free_list) {
+        sibling = lib::list_entry(va->list.next, &VMapArea::list);
+
+        if (sibling->va_start == va->va_end) {
+            this->__unlink_free(va);
+            sibling->va_start = va->va_start;
+            vmap_augment_propagate(&sibling->rb_node, nullptr);
+            vmap_area_free(va);
+            va = sibling;
+        }
+    }
+
+    if (va->list.prev != &this->free_list) {
+        sibling = lib::list_entry(va->list.prev, &VMapArea::list);
+
+        if (sibling->va_end == va->va_start) {
+            this->__unlink_free(va);
+            sibling->va_end = va->va_end;
+            vmap_augment_propagate(&sibling->rb_node, nullptr);
+            vmap_area_free(va);
+        }
+    }
+}
+
+/* cut [start, start + size) out of the free range `va` */
+auto VMapAllocator::__clip_free(VMapArea *va, virt_addr_t start, base::size_t size, VMapArea **spare) -> void
+{
+    virt_addr_t end = start + size;
+    VMapArea *left;
+
+    if (start == va->va_start && end == va->va_end) {
+        this->__unlink_free(va);
+        vmap_area_free(va);
+    } else if (start == va->va_start) {
+        va->va_start = end;
+        vmap_augment_propagate(&va->rb_node, nullptr);
+    } else if (end == va->va_end) {
+        va->va_end = start;
+        vmap_augment_propagate(&va->rb_node, nullptr);
+    } else {
+        /* split into two, the left part takes the spare one */
+        left = *spare;
+        *spare = nullptr;
+
+        left->va_start = va->va_start;
+        left->va_end = start;
+
+        va->va_start = end;
+        vmap_augment_propagate(&va->rb_node, nullptr);
+
+        this->__link_free(left);
+    }
+}
+
+auto VMapAllocator::__insert_busy(VMapArea *va) -> void
+{
+    lib::RBNode **link = &this->busy_root.node, *parent = nullptr;
+
+    while (*link) {
+        parent = *link;
+
+        if (va->va_start < vmap_rb_entry(parent)->va_start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    lib::rb_link_node(&va->rb_node, parent, link);
+    lib::rb_insert_color(&va->rb_node, &this->busy_root);
+}
+
+/* find the busy range containing the address */
+auto VMapAllocator::__find_busy(virt_addr_t addr) -> VMapArea*
+{
+    lib::RBNode *node = this->busy_root.node;
+    VMapArea *va;
+
+    while (node) {
+        va = vmap_rb_entry(node);
+
+        if (addr < va->va_start) {
+            node = node->left;
+        } else if (addr >= va->va_end) {
+            node = node->right;
+        } else {
+            return va;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Allocate a range of `size` bytes aligned to `align` (power of 2), lazily
+ * freed ranges are purged if there's no enough space.
+ */
+auto VMapAllocator::AllocArea(base::size_t size, base::size_t align, base::size_t flags) -> VMapArea*
+{
+    VMapArea *va, *busy, *spare;
+    virt_addr_t addr;
+    bool purged = false;
+
+    size = PAGE_ALIGN(size);
+    if (!size || (align & (align - 1))) {
+        return nullptr;
+    }
+
+    if (align < PAGE_SIZE) {
+        align = PAGE_SIZE;
+    }
+
+    /* spare one is for splitting a free range, allocated before locking */
+    busy = vmap_area_alloc();
+    spare = vmap_area_alloc();
+    if (!busy || !spare) {
+        vmap_area_free(busy);
+        vmap_area_free(spare);
+        return nullptr;
+    }
+
+    this->lock.Lock();
+
+redo:
+    va = this->__find_lowest_match(size, align);
+    if (!va) {
+        if (!purged && !lib::list_empty(&this->purge_list)) {
+            this->__purge();
+            purged = true;
+            goto redo;
+        }
+
+        this->lock.UnLock();
+        vmap_area_free(busy);
+        vmap_area_free(spare);
+        return nullptr;
+    }
+
+    addr = (va->va_start + align - 1) & ~(align - 1);
+    this->__clip_free(va, addr, size, &spare);
+
+    busy->va_start = addr;
+    busy->va_end = addr + size;
+    busy->flags = flags;
+    busy->private_data = nullptr;
+    this->__insert_busy(busy);
+
+    this->lock.UnLock();
+
+    vmap_area_free(spare);
+
+    return busy;
+}
+
+/* take the busy range starting at `addr` out, only if it has all of `flags` */
+auto VMapAllocator::RemoveArea(virt_addr_t addr, base::size_t flags) -> VMapArea*
+{
+    VMapArea *va;
+
+    this->lock.Lock();
+
+    va = this->__find_busy(addr);
+    if (va && va->va_start == addr && (va->flags & flags) == flags) {
+        lib::rb_erase(&va->rb_node, &this->busy_root);
+    } else {
+        va = nullptr;
+    }
+
+    this->lock.UnLock();
+
+    return va;
+}
+
+/* unmap the range without flushing, it'll be reused only after purging */
+auto VMapAllocator::__free_area_lazy(VMapArea *va) -> void
+{
+    GloblKernPageTable->UnmapRange(va->va_start, vmap_area_size(va), &this->purge_tlb);
+
+    lib::list_add_prev(&this->purge_list, &va->list);
+    this->lazy_pages += vmap_area_size(va) >> PAGE_SHIFT;
+
+    if (this->lazy_pages > VMAP_LAZY_MAX_PAGES) {
+        this->__purge();
+    }
+}
+
+/* free a range that has been taken out by RemoveArea() */
+auto VMapAllocator::FreeArea(VMapArea *va) -> void
+{
+    this->lock.Lock();
+    this->__free_area_lazy(va);
+    this->lock.UnLock();
+}
+
+/* flush TLB for all lazily freed ranges at once, and make them reusable */
+auto VMapAllocator::__purge(void) -> void
+{
+    VMapArea *va;
+
+    tlb_gather_finish(&this->purge_tlb);
+
+    while (!lib::list_empty(&this->purge_list)) {
+        va = lib::list_entry(this->purge_list.next, &VMapArea::list);
+        lib::list_del(&va->list);
+        this->__insert_free(va);
+    }
+
+    this->lazy_pages = 0;
+}
+
+auto VMapAllocator::Purge(void) -> void
+{
+    this->lock.Lock();
+    this->__purge();
+    this->lock.UnLock();
+}
+
+/**
+ * Allocate `nr` pages of address space from the per-CPU vmap block,
+ * returning 0 on failure.
+ */
+auto VMapAllocator::BlockAlloc(base::size_t nr) -> virt_addr_t
+{
+    VMapBlockCPU *vbc;
+    VMapBlock *vb;
+    VMapArea *va;
+    virt_addr_t addr = 0;
+    base::size_t flags;
+    bool release;
+
+    if (!nr || nr > VMAP_BLOCK_MAX_PAGES) {
+        return 0;
+    }
+
+    flags = lib::local_irq_save();
+
+    vbc = this->cpu_block.This();
+    vb = vbc->block;
+
+    if (vb) {
+        vb->lock.Lock();
+
+        if ((vb->free_offset + nr) <= VMAP_BLOCK_PAGES) {
+            addr = vb->va->va_start + (vb->free_offset << PAGE_SHIFT);
+            vb->free_offset += nr;
+            vb->lock.UnLock();
+            goto out;
+        }
+
+        /* retire the exhausted block, it's freed after all ranges are back */
+        vb->active = false;
+        release = (vb->dirty == vb->free_offset);
+        vb->lock.UnLock();
+
+        vbc->block = nullptr;
+
+        if (release) {
+            this->__block_release(vb);
+        }
+    }
+
+    vb = (VMapBlock*) kmalloc<sizeof(VMapBlock)>();
+    if (!vb) {
+        goto out;
+    }
+
+    va = this->AllocArea(VMAP_BLOCK_SIZE, VMAP_BLOCK_SIZE, VMAP_AREA_BLOCK);
+    if (!va) {
+        GloblKHeapPool->Free(vb);
+        goto out;
+    }
+
+    va->private_data = vb;
+
+    vb->va = va;
+    vb->free_offset = nr;
+    vb->dirty = 0;
+    vb->active = true;
+    vb->lock.Reset();
+
+    vbc->block = vb;
+    addr = va->va_start;
+
+out:
+    lib::local_irq_restore(flags);
+
+    return addr;
+}
+
+auto VMapAllocator::BlockFree(virt_addr_t addr, base::size_t nr) -> void
+{
+    VMapBlock *vb;
+    VMapArea *va;
+    bool release;
+
+    this->lock.Lock();
+
+    va = this->__find_busy(addr);
+    if (!va || !(va->flags & VMAP_AREA_BLOCK)) {
+        this->lock.UnLock();
+        return ;
+    }
+
+    /* ranges in a block are never reused, so the flush could be deferred too */
+    GloblKernPageTable->UnmapRange(addr, nr << PAGE_SHIFT, &this->purge_tlb);
+
+    this->lock.UnLock();
+
+    vb = (VMapBlock*) va->private_data;
+
+    vb->lock.Lock();
+    vb->dirty += nr;
+    release = !vb->active && (vb->dirty == vb->free_offset);
+    vb->lock.UnLock();
+
+    if (release) {
+        this->__block_release(vb);
+    }
+}
+
+auto VMapAllocator::__block_release(VMapBlock *vb) -> void
+{
+    VMapArea *va = vb->va;
+
+    this->lock.Lock();
+    lib::rb_erase(&va->rb_node, &this->busy_root);
+    this->__free_area_lazy(va);
+    this->lock.UnLock();
+
+    GloblKHeapPool->Free(vb);
+}
+
+/**
+ * Public interfaces.
+ * Areas except vmap blocks have a guard page at the end, which is unmapped
+ * to catch overflows.
+ */
+
+__always_inline auto is_vmalloc_addr(const void *addr) -> bool
+{
+    return (virt_addr_t) addr >= KERN_DYNAMIC_MAP_REGION_BASE
+            && (virt_addr_t) addr <= KERN_DYNAMIC_MAP_REGION_END;
+}
+
+/* page mapped at the vmalloc address, nullptr if it's not mapped */
+auto vmalloc_to_page(const void *addr) -> Page*
+{
+    phys_addr_t pa;
+
+    if (GloblKernPageTable->Translate((virt_addr_t) addr, &pa) < 0) {
+        return nullptr;
+    }
+
+    return phys_to_page(pa);
+}
+
+static auto vmap_pages_range(virt_addr_t addr, Page **pages, base::size_t nr, page_attr_t attr) -> int
+{
+    int ret;
+
+    for (base::size_t i = 0; i < nr; i++) {
+        ret = GloblKernPageTable->MapRange(addr + (i << PAGE_SHIFT),
+                                           page_to_phys(pages[i]),
+                                           PAGE_SIZE,
+                                           attr);
+        if (ret < 0) {
+            if (i) {
+                GloblKernPageTable->UnmapRange(addr, i << PAGE_SHIFT);
+            }
+
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Free pages mapped in a vmalloc area, they're looked up through the page
+ * table as they might have been migrated by compaction.
+ * NOTE: it shouldn't be called in interrupt context, as it waits for pages
+ * being migrated by compaction.
+ */
+static auto vmalloc_free_pages(VMapArea *va) -> void
+{
+    Page *page;
+
+    for (virt_addr_t addr = va->va_start; addr < va->va_end; addr += PAGE_SIZE) {
+        if ((page = kern_mapped_page_release(addr))) {
+            free_pages(page, 0);
+        }
+    }
+}
+
+/* map pages supplied by the caller into a virtually contiguous range */
+auto vmap(Page **pages, base::size_t nr, page_attr_t attr = PTE_ATTR_RW) -> void*
+{
+    VMapArea *va;
+
+    va = GloblVMapAllocator->AllocArea((nr + 1) << PAGE_SHIFT, PAGE_SIZE, VMAP_AREA_MAP);
+    if (!va) {
+        return nullptr;
+    }
+
+    if (vmap_pages_range(va->va_start, pages, nr, attr) < 0) {
+        GloblVMapAllocator->RemoveArea(va->va_start);
+        GloblVMapAllocator->FreeArea(va);
+        return nullptr;
+    }
+
+    return (void*) va->va_start;
+}
+
+auto vunmap(const void *addr) -> void
+{
+    VMapArea *va = GloblVMapAllocator->RemoveArea((virt_addr_t) addr, VMAP_AREA_MAP);
+
+    if (va) {
+        GloblVMapAllocator->FreeArea(va);
+    }
+}
+
+/**
+ * Allocate virtually contiguous memory backed by single pages, which are
+ * movable so that they won't pin down pageblocks for high-order allocations.
+ */
+auto vmalloc(base::size_t size, gfp_t flags = GFP_KERNEL) -> void*
+{
+    base::size_t nr = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    virt_addr_t addr;
+    VMapArea *va;
+    Page *page;
+
+    if (!nr) {
+        return nullptr;
+    }
+
+    va = GloblVMapAllocator->AllocArea((nr + 1) << PAGE_SHIFT, PAGE_SIZE, VMAP_AREA_VMALLOC);
+    if (!va) {
+        return nullptr;
+    }
+
+    for (base::size_t i = 0; i < nr; i++) {
+        addr = va->va_start + (i << PAGE_SHIFT);
+
+        page = alloc_pages(0, flags | __GFP_MOVABLE);
+        if (!page) {
+            goto err;
+        }
+
+        if (GloblKernPageTable->MapRange(addr, page_to_phys(page), PAGE_SIZE, PTE_ATTR_RW) < 0) {
+            free_pages(page, 0);
+            goto err;
+        }
+
+        page->mops = &KernMappedPageOps;
+        page->mops_private = addr;
+    }
+
+    return (void*) va->va_start;
+
+err:
+    GloblVMapAllocator->RemoveArea(va->va_start);
+    vmalloc_free_pages(va);
+    GloblVMapAllocator->FreeArea(va);
+
+    return nullptr;
+}
+
+auto vzalloc(base::size_t size) -> void*
+{
+    return vmalloc(size, GFP_KERNEL | __GFP_ZERO);
+}
+
+auto vfree(const void *addr) -> void
+{
+    VMapArea *va;
+
+    if (!addr) {
+        return ;
+    }
+
+    /* ranges of vmap() are left alone, they're still busy */
+    va = GloblVMapAllocator->RemoveArea((virt_addr_t) addr, VMAP_AREA_VMALLOC);
+    if (!va) {
+        return ;
+    }
+
+    vmalloc_free_pages(va);
+    GloblVMapAllocator->FreeArea(va);
+}
+
+/* fast mapping for a few pages, through per-CPU vmap blocks */
+auto vm_map_ram(Page **pages, base::size_t nr, page_attr_t attr = PTE_ATTR_RW) -> void*
+{
+    virt_addr_t addr;
+
+    if (nr > VMAP_BLOCK_MAX_PAGES) {
+        return vmap(pages, nr, attr);
+    }
+
+    addr = GloblVMapAllocator->BlockAlloc(nr);
+    if (!addr) {
+        return nullptr;
+    }
+
+    if (vmap_pages_range(addr, pages, nr, attr) < 0) {
+        GloblVMapAllocator->BlockFree(addr, nr);
+        return nullptr;
+    }
+
+    return (void*) addr;
+}
+
+auto vm_unmap_ram(const void *addr, base::size_t nr) -> void
+{
+    if (nr > VMAP_BLOCK_MAX_PAGES) {
+        vunmap(addr);
+    } else {
+        GloblVMapAllocator->BlockFree((virt_addr_t) addr, nr);
+    }
+}
+
+/* map MMIO with caching disabled */
+auto ioremap(phys_addr_t phys, base::size_t size) -> void*
+{
+    phys_addr_t offset = phys & ~PAGE_MASK;
+    VMapArea *va;
+
+    size = PAGE_ALIGN(size + offset);
+    if (!size) {
+        return nullptr;
+    }
+
+    va = GloblVMapAllocator->AllocArea(size + PAGE_SIZE, PAGE_SIZE, VMAP_AREA_IOREMAP);
+    if (!va) {
+        return nullptr;
+    }
+
+    if (GloblKernPageTable->MapRange(va->va_start,
+                                     phys & PAGE_MASK,
+                                     size,
+                                     PTE_ATTR_RW | PTE_ATTR_PCD | PTE_ATTR_PWT) < 0) {
+        GloblVMapAllocator->RemoveArea(va->va_start);
+        GloblVMapAllocator->FreeArea(va);
+        return nullptr;
+    }
+
+    return (void*) (va->va_start + offset);
+}
+
+auto iounmap(const void *addr) -> void
+{
+    VMapArea *va = GloblVMapAllocator->RemoveArea((virt_addr_t) addr & PAGE_MASK, VMAP_AREA_IOREMAP);
+
+    if (va) {
+        GloblVMapAllocator->FreeArea(va);
+    }
+}
+
+/* try physically contiguous memory first, and fall back to vmalloc */
+auto kvmalloc(base::size_t size) -> void*
+{
+    void *obj = GloblKHeapPool->Malloc(size);
+
+    if (!obj) {
+        obj = vmalloc(size);
+    }
+
+    return obj;
+}
+
+auto kvfree(const void *addr) -> void
+{
+    if (is_vmalloc_addr(addr)) {
+        vfree(addr);
+    } else if (addr) {
+        GloblKHeapPool->Free((void*) addr);
+    }
+}
+
+};
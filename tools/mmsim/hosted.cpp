@@ -0,0 +1,38 @@
+/**
+ * What kernel.mm expects from the rest of the kernel, provided by the host
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+extern "C" {
+
+/* root of the kernel page table, which lies in the fake physical memory */
+uint64_t hosted_cr3;
+
+void boot_putchar(uint16_t ch)
+{
+    putchar(ch);
+}
+
+void boot_printstr(const char *str)
+{
+    fputs(str, stdout);
+}
+
+void boot_puts(const char *str)
+{
+    puts(str);
+}
+
+void boot_printnum(int64_t n)
+{
+    printf("%lld", (long long) n);
+}
+
+void boot_printhex(uint64_t n)
+{
+    printf("%llx", (unsigned long long) n);
+}
+
+};
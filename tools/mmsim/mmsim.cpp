@@ -0,0 +1,832 @@
+/**
+ * mmsim - run kernel.mm in a host process
+ *
+ * The buddy system, slab caches and the heap are built against a fake
+ * physical memory arena mmap()'d from the host, and each thread of the
+ * process is taken as a CPU. Workers allocate objects following the given
+ * size mix, and free each of them after a random lifetime counted in their
+ * own operations, then throughput, latency and fragmentation are reported.
+ */
+
+import kernel.base;
+import kernel.lib;
+import kernel.mm;
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <barrier>
+#include <chrono>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <x86intrin.h>
+
+extern "C" uint64_t hosted_cr3;
+
+/* pfn 0 holds the root of the kernel page table, others are free */
+static constexpr size_t HOSTED_RESERVED_PAGES = 1;
+
+static constexpr size_t SIZE_CLASS_MAX_NR = 32;
+
+/* ops of worker 0 between two adaptations of kmalloc size classes */
+static constexpr size_t ADAPT_INTERVAL = 1 << 16;
+
+enum sim_target {
+    SIM_TARGET_HEAP = 0,
+    SIM_TARGET_CACHE,
+    SIM_TARGET_PAGES,
+};
+
+static const char *sim_target_name[] = {
+    "heap",
+    "cache",
+    "pages",
+};
+
+struct SizeClass {
+    size_t size;
+    size_t weight;
+    size_t order;               /* for SIM_TARGET_PAGES */
+    mm::KMemCache *kc;          /* for SIM_TARGET_CACHE */
+    char name[32];
+};
+
+struct SimConfig {
+    size_t threads;
+    size_t nodes;
+    size_t memory_mb;
+    size_t ops;                 /* per thread */
+    double lifetime;            /* mean of object lifetime in ops, 0 to free at once */
+    sim_target target;
+    bool touch;
+    bool dump;                  /* print statistics of kernel.mm at the end */
+    bool adapt;                 /* adapt kmalloc size classes while running */
+    const char *profile_in;     /* kmalloc size profile to build size classes from */
+    const char *profile_out;    /* file to record the kmalloc size profile to */
+    unsigned seed;
+    SizeClass classes[SIZE_CLASS_MAX_NR];
+    size_t class_nr;
+};
+
+/**
+ * Log-linear histogram of latency in TSC cycles, values are put into one of
+ * the 8 sub-buckets of their power of 2, so the error is less than 12.5%.
+ */
+struct LatencyHistogram {
+    static constexpr size_t SUB_BITS = 3;
+    static constexpr size_t BUCKET_NR = 64 << SUB_BITS;
+
+    size_t count[BUCKET_NR];
+    size_t total;
+    uint64_t max;
+
+    static auto Index(uint64_t v) -> size_t
+    {
+        size_t msb;
+
+        if (v < (1UL << SUB_BITS)) {
+            return v;
+        }
+
+        msb = 63 - __builtin_clzl(v);
+
+        return ((msb - SUB_BITS + 1) << SUB_BITS)
+                + ((v >> (msb - SUB_BITS)) & ((1UL << SUB_BITS) - 1));
+    }
+
+    /* the largest value that goes to the bucket */
+    static auto Upper(size_t idx) -> uint64_t
+    {
+        size_t shift;
+
+        if (idx < (1UL << SUB_BITS)) {
+            return idx;
+        }
+
+        shift = (idx >> SUB_BITS) - 1;
+
+        return ((((1UL << SUB_BITS) | (idx & ((1UL << SUB_BITS) - 1))) + 1) << shift) - 1;
+    }
+
+    auto Record(uint64_t v) -> void
+    {
+        this->count[Index(v)]++;
+        this->total++;
+        if (v > this->max) {
+            this->max = v;
+        }
+    }
+
+    auto Merge(const LatencyHistogram *h) -> void
+    {
+        for (size_t i = 0; i < BUCKET_NR; i++) {
+            this->count[i] += h->count[i];
+        }
+
+        this->total += h->total;
+        if (h->max > this->max) {
+            this->max = h->max;
+        }
+    }
+
+    auto Percentile(double p) const -> uint64_t
+    {
+        size_t target = (size_t) (this->total * p / 100.0), seen = 0;
+
+        for (size_t i = 0; i < BUCKET_NR; i++) {
+            seen += this->count[i];
+            if (seen > target) {
+                return Upper(i) < this->max ? Upper(i) : this->max;
+            }
+        }
+
+        return this->max;
+    }
+};
+
+struct LiveObject {
+    size_t death;
+    void *ptr;
+    size_t cls;
+
+    auto operator>(const LiveObject &other) const -> bool
+    {
+        return this->death > other.death;
+    }
+};
+
+struct WorkerStat {
+    LatencyHistogram alloc_lat;
+    LatencyHistogram free_lat;
+    size_t allocs;
+    size_t frees;
+    size_t fails;
+    size_t live_bytes;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    std::vector<LiveObject> live;   /* objects still alive at the end of the run */
+};
+
+static SimConfig sim_config = {
+    .threads = 4,
+    .nodes = 1,
+    .memory_mb = 512,
+    .ops = 1000000,
+    .lifetime = 1000,
+    .target = SIM_TARGET_HEAP,
+    .touch = false,
+    .dump = false,
+    .adapt = false,
+    .profile_in = nullptr,
+    .profile_out = nullptr,
+    .seed = 1,
+};
+
+static const char *default_mix = "16:20,32:20,64:20,128:15,256:10,512:6,1024:4,2048:3,4096:2";
+
+static char *arena;
+
+/**
+ * Fake physical memory
+ */
+
+static auto arena_init(const SimConfig *cfg) -> int
+{
+    size_t page_nr = cfg->memory_mb << (20 - mm::PAGE_SHIFT), node_pages;
+    mm::Page *pgdb;
+
+    arena = (char*) mmap(nullptr,
+                         page_nr << mm::PAGE_SHIFT,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1,
+                         0);
+    pgdb = (mm::Page*) mmap(nullptr,
+                            page_nr * sizeof(mm::Page),
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1,
+                            0);
+    if (arena == MAP_FAILED || pgdb == MAP_FAILED) {
+        return -1;
+    }
+
+    /* just as what the booting stage does */
+    for (size_t pfn = 0; pfn < page_nr; pfn++) {
+        lib::list_head_init(&pgdb[pfn].list);
+        pgdb[pfn].lock.Reset();
+        pgdb[pfn].type = mm::PAGE_NORMAL_MEM;
+        lib::atomic::atomic_set(&pgdb[pfn].ref_count, pfn < HOSTED_RESERVED_PAGES ? 0 : -1);
+    }
+
+    mm::physmem_base = (mm::virt_addr_t) arena;
+    mm::vmremap_base = mm::KERN_DYNAMIC_MAP_REGION_BASE;
+    mm::pgdb_base = pgdb;
+    mm::pgdb_page_nr = page_nr;
+
+    mm::boot_free_ranges[0] = { HOSTED_RESERVED_PAGES, page_nr };
+    mm::boot_free_range_nr = 1;
+
+    /* nodes split the memory evenly, and CPUs are spread among them */
+    if (cfg->nodes > 1) {
+        node_pages = page_nr / cfg->nodes;
+
+        for (size_t nid = 0; nid < cfg->nodes; nid++) {
+            mm::numa_node_ranges[nid] = {
+                nid * node_pages,
+                nid == cfg->nodes - 1 ? page_nr : (nid + 1) * node_pages,
+                nid
+            };
+        }
+
+        mm::numa_node_nr = cfg->nodes;
+        mm::numa_node_range_nr = cfg->nodes;
+    }
+
+    for (size_t cpu = 0; cpu < lib::NR_CPUS; cpu++) {
+        mm::numa_cpu_node[cpu] = cpu % cfg->nodes;
+    }
+
+    /* an empty root page table */
+    memset(arena, 0, mm::PAGE_SIZE);
+    hosted_cr3 = 0;
+
+    return 0;
+}
+
+static auto for_each_page_pool(void (*fn)(mm::PagePool *pool, void *data), void *data) -> void
+{
+    mm::PagePool *pool;
+
+    for (size_t nid = 0; nid < mm::numa_node_nr; nid++) {
+        for (size_t type = 0; type < mm::PAGE_POOL_TYPE_NR; type++) {
+            pool = mm::node_page_pool(nid, type);
+            if (pool->ManagedPages()) {
+                fn(pool, data);
+            }
+        }
+    }
+}
+
+/* pages on pcp lists are taken as used, give them back before counting */
+static auto drain_all_pcp(const SimConfig *cfg) -> void
+{
+    size_t cpu = lib::hosted_cpu_id();
+
+    for (size_t i = 0; i < cfg->threads; i++) {
+        lib::hosted_cpu_id() = i;
+        for_each_page_pool([](mm::PagePool *pool, void *) { pool->DrainPerCPUPages(); }, nullptr);
+    }
+
+    lib::hosted_cpu_id() = cpu;
+}
+
+struct FreeAreaSummary {
+    size_t managed_pages;
+    mm::FreeAreaStat area;      /* of all pools */
+};
+
+static auto get_free_area_summary(FreeAreaSummary *summary) -> void
+{
+    memset(summary, 0, sizeof(*summary));
+
+    for_each_page_pool([](mm::PagePool *pool, void *data) {
+        FreeAreaSummary *summary = (FreeAreaSummary*) data;
+        mm::FreeAreaStat stat;
+
+        pool->GetFreeAreaStat(&stat);
+
+        summary->managed_pages += pool->ManagedPages();
+        summary->area.free_pages += stat.free_pages;
+        for (size_t order = 0; order < mm::MAX_PAGE_ORDER; order++) {
+            summary->area.free_blocks[order] += stat.free_blocks[order];
+        }
+    }, summary);
+}
+
+/* fraction of free memory that can't be used for an allocation of `order`, as the kernel computes it */
+static auto unusable_index(const FreeAreaSummary *summary, size_t order) -> double
+{
+    return mm::unusable_free_index(&summary->area, order) / 1000.0;
+}
+
+/**
+ * Workload
+ */
+
+static auto sim_alloc(const SimConfig *cfg, size_t cls) -> void*
+{
+    const SizeClass *sc = &cfg->classes[cls];
+    mm::Page *page;
+
+    switch (cfg->target) {
+    case SIM_TARGET_HEAP:
+        return mm::GloblKHeapPool->Malloc(sc->size);
+    case SIM_TARGET_CACHE:
+        return mm::kmem_cache_alloc(sc->kc);
+    case SIM_TARGET_PAGES:
+        page = mm::alloc_pages(sc->order);
+        return page ? (void*) mm::page_to_virt(page) : nullptr;
+    }
+
+    return nullptr;
+}
+
+static auto sim_free(const SimConfig *cfg, size_t cls, void *ptr) -> void
+{
+    const SizeClass *sc = &cfg->classes[cls];
+
+    switch (cfg->target) {
+    case SIM_TARGET_HEAP:
+        mm::GloblKHeapPool->Free(ptr);
+        break;
+    case SIM_TARGET_CACHE:
+        mm::kmem_cache_free(sc->kc, ptr);
+        break;
+    case SIM_TARGET_PAGES:
+        mm::free_pages(mm::virt_to_page((mm::virt_addr_t) ptr), sc->order);
+        break;
+    }
+}
+
+static auto sim_worker(const SimConfig *cfg, size_t cpu, WorkerStat *stat, std::barrier<> *sync) -> void
+{
+    std::priority_queue<LiveObject, std::vector<LiveObject>, std::greater<LiveObject>> live;
+    std::mt19937_64 rng(cfg->seed * 1000003 + cpu);
+    std::exponential_distribution<double> lifetime(cfg->lifetime > 0 ? 1.0 / cfg->lifetime : 1.0);
+    std::vector<double> weights;
+    uint64_t start_tsc;
+    LiveObject obj;
+    size_t cls;
+
+    lib::hosted_cpu_id() = cpu;
+
+    for (size_t i = 0; i < cfg->class_nr; i++) {
+        weights.push_back((double) cfg->classes[i].weight);
+    }
+
+    std::discrete_distribution<size_t> size_mix(weights.begin(), weights.end());
+
+    sync->arrive_and_wait();
+    stat->start = std::chrono::steady_clock::now();
+
+    for (size_t op = 0; op < cfg->ops; op++) {
+        while (!live.empty() && live.top().death <= op) {
+            obj = live.top();
+            live.pop();
+
+            start_tsc = __rdtsc();
+            sim_free(cfg, obj.cls, obj.ptr);
+            stat->free_lat.Record(__rdtsc() - start_tsc);
+
+            stat->frees++;
+            stat->live_bytes -= cfg->classes[obj.cls].size;
+        }
+
+        cls = size_mix(rng);
+
+        start_tsc = __rdtsc();
+        obj.ptr = sim_alloc(cfg, cls);
+        stat->alloc_lat.Record(__rdtsc() - start_tsc);
+
+        if (!obj.ptr) {
+            stat->fails++;
+            continue;
+        }
+
+        if (cfg->touch) {
+            memset(obj.ptr, (int) cpu, cfg->classes[cls].size);
+        } else {
+            *(volatile char*) obj.ptr = (char) cpu;
+        }
+
+        obj.cls = cls;
+        obj.death = op + (cfg->lifetime > 0 ? (size_t) lifetime(rng) : 0);
+        live.push(obj);
+
+        stat->allocs++;
+        stat->live_bytes += cfg->classes[cls].size;
+
+        /* as the idle loop of the kernel does, but only one CPU is needed */
+        if (cfg->adapt && cpu == 0 && !(op & (ADAPT_INTERVAL - 1))) {
+            mm::kmalloc_adapt_size_classes();
+        }
+    }
+
+    stat->end = std::chrono::steady_clock::now();
+
+    while (!live.empty()) {
+        stat->live.push_back(live.top());
+        live.pop();
+    }
+}
+
+/**
+ * Reports
+ */
+
+static auto tsc_per_ns(void) -> double
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_tsc = __rdtsc();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    return (double) (__rdtsc() - start_tsc) / ns.count();
+}
+
+static auto print_latency(const char *name, const LatencyHistogram *h, double tsc_ns) -> void
+{
+    printf("    %-6s %10lu %10lu %10lu %10lu %10lu %10lu    (p99 %.0f ns)\n",
+           name,
+           h->Percentile(50),
+           h->Percentile(90),
+           h->Percentile(99),
+           h->Percentile(99.9),
+           h->Percentile(99.99),
+           h->max,
+           h->Percentile(99) / tsc_ns);
+}
+
+static auto print_fragmentation(const char *when, const FreeAreaSummary *s, const FreeAreaSummary *base) -> void
+{
+    printf("[*] buddy %s: %lu free of %lu managed pages, %lu held since start\n",
+           when,
+           s->area.free_pages,
+           s->managed_pages,
+           base->area.free_pages - s->area.free_pages);
+
+    printf("    free blocks by order:");
+    for (size_t order = 0; order < mm::MAX_PAGE_ORDER; order++) {
+        printf(" %lu", s->area.free_blocks[order]);
+    }
+    printf("\n");
+
+    printf("    unusable free index: order 3 %.3f, order %lu %.3f, order %lu %.3f\n",
+           unusable_index(s, 3),
+           mm::PAGEBLOCK_ORDER,
+           unusable_index(s, mm::PAGEBLOCK_ORDER),
+           mm::MAX_PAGE_ORDER - 1,
+           unusable_index(s, mm::MAX_PAGE_ORDER - 1));
+}
+
+/**
+ * Options
+ */
+
+static auto parse_mix(SimConfig *cfg, const char *mix) -> int
+{
+    const char *p = mix;
+    char *end;
+
+    cfg->class_nr = 0;
+
+    while (*p) {
+        SizeClass *sc;
+
+        if (cfg->class_nr == SIZE_CLASS_MAX_NR) {
+            return -1;
+        }
+
+        sc = &cfg->classes[cfg->class_nr++];
+        sc->size = strtoul(p, &end, 0);
+        sc->weight = 1;
+        if (end == p || !sc->size) {
+            return -1;
+        }
+
+        p = end;
+        if (*p == ':') {
+            sc->weight = strtoul(p + 1, &end, 0);
+            if (end == p + 1) {
+                return -1;
+            }
+            p = end;
+        }
+
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+
+    return cfg->class_nr ? 0 : -1;
+}
+
+static auto setup_size_classes(SimConfig *cfg) -> int
+{
+    for (size_t i = 0; i < cfg->class_nr; i++) {
+        SizeClass *sc = &cfg->classes[i];
+
+        sc->order = 0;
+        while ((mm::PAGE_SIZE << sc->order) < sc->size) {
+            sc->order++;
+        }
+
+        if (sc->order >= mm::MAX_PAGE_ORDER) {
+            fprintf(stderr, "size %lu is too large\n", sc->size);
+            return -1;
+        }
+
+        if (cfg->target == SIM_TARGET_CACHE) {
+            snprintf(sc->name, sizeof(sc->name), "mmsim-%lu", sc->size);
+            sc->kc = mm::kmem_cache_create(sc->name, sc->size);
+            if (!sc->kc) {
+                fprintf(stderr, "failed to create cache of size %lu\n", sc->size);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* a profile is lines of "{ size, count },", to be included by the kernel as well */
+static auto load_size_profile(const char *path) -> int
+{
+    std::vector<mm::KMallocProfileEntry> profile;
+    mm::KMallocProfileEntry entry;
+    char line[128];
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, " { %lu , %lu }", &entry.size, &entry.count) == 2) {
+            profile.push_back(entry);
+        }
+    }
+
+    fclose(fp);
+
+    printf("[*] %lu size classes spawned from %lu entries of %s\n",
+           mm::kmalloc_load_size_profile(profile.data(), profile.size()),
+           profile.size(),
+           path);
+
+    return 0;
+}
+
+static auto save_size_profile(const char *path) -> int
+{
+    std::vector<mm::KMallocProfileEntry> profile(mm::KMALLOC_SIZE_INDEX_NR);
+    size_t nr;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    nr = mm::GloblKHeapPool->GetSizeProfile(profile.data(), profile.size());
+    for (size_t i = 0; i < nr; i++) {
+        fprintf(fp, "{ %lu, %lu },\n", profile[i].size, profile[i].count);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+static auto usage(const char *prog) -> void
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  -t, --threads N     worker threads, each is taken as a CPU (default: %lu)\n"
+           "  -n, --nodes N       NUMA nodes the memory is split into (default: %lu)\n"
+           "  -m, --memory MiB    size of the fake physical memory (default: %lu)\n"
+           "  -o, --ops N         allocations done by each worker (default: %lu)\n"
+           "  -l, --lifetime N    mean lifetime of objects in ops, 0 to free at once (default: %.0f)\n"
+           "  -s, --mix MIX       size mix as \"size:weight,...\" (default: \"%s\")\n"
+           "  -T, --target NAME   allocator to run: heap, cache or pages (default: heap)\n"
+           "  -w, --touch         write the whole object after allocation\n"
+           "  -r, --seed N        seed of the workload (default: %u)\n"
+           "  -d, --dump          print statistics of the allocators at the end\n"
+           "  -a, --adapt         adapt kmalloc size classes while running\n"
+           "  -p, --profile-in F  build kmalloc size classes from a recorded profile\n"
+           "  -P, --profile-out F record sampled kmalloc sizes as a profile\n"
+           "  -h, --help          show this message\n",
+           prog,
+           sim_config.threads,
+           sim_config.nodes,
+           sim_config.memory_mb,
+           sim_config.ops,
+           sim_config.lifetime,
+           default_mix,
+           sim_config.seed);
+}
+
+static auto parse_options(SimConfig *cfg, int argc, char **argv) -> int
+{
+    static const struct option long_options[] = {
+        { "threads",  required_argument, nullptr, 't' },
+        { "nodes",    required_argument, nullptr, 'n' },
+        { "memory",   required_argument, nullptr, 'm' },
+        { "ops",      required_argument, nullptr, 'o' },
+        { "lifetime", required_argument, nullptr, 'l' },
+        { "mix",      required_argument, nullptr, 's' },
+        { "target",   required_argument, nullptr, 'T' },
+        { "touch",    no_argument,       nullptr, 'w' },
+        { "seed",     required_argument, nullptr, 'r' },
+        { "dump",     no_argument,       nullptr, 'd' },
+        { "adapt",       no_argument,       nullptr, 'a' },
+        { "profile-in",  required_argument, nullptr, 'p' },
+        { "profile-out", required_argument, nullptr, 'P' },
+        { "help",     no_argument,       nullptr, 'h' },
+        { nullptr,    0,                 nullptr, 0   },
+    };
+    const char *mix = default_mix;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:n:m:o:l:s:T:wr:dap:P:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 't':
+            cfg->threads = strtoul(optarg, nullptr, 0);
+            break;
+        case 'n':
+            cfg->nodes = strtoul(optarg, nullptr, 0);
+            break;
+        case 'm':
+            cfg->memory_mb = strtoul(optarg, nullptr, 0);
+            break;
+        case 'o':
+            cfg->ops = strtoul(optarg, nullptr, 0);
+            break;
+        case 'l':
+            cfg->lifetime = strtod(optarg, nullptr);
+            break;
+        case 's':
+            mix = optarg;
+            break;
+        case 'T':
+            if (!strcmp(optarg, "heap")) {
+                cfg->target = SIM_TARGET_HEAP;
+            } else if (!strcmp(optarg, "cache")) {
+                cfg->target = SIM_TARGET_CACHE;
+            } else if (!strcmp(optarg, "pages")) {
+                cfg->target = SIM_TARGET_PAGES;
+            } else {
+                return -1;
+            }
+            break;
+        case 'w':
+            cfg->touch = true;
+            break;
+        case 'r':
+            cfg->seed = strtoul(optarg, nullptr, 0);
+            break;
+        case 'd':
+            cfg->dump = true;
+            break;
+        case 'a':
+            cfg->adapt = true;
+            break;
+        case 'p':
+            cfg->profile_in = optarg;
+            break;
+        case 'P':
+            cfg->profile_out = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (!cfg->threads || cfg->threads > lib::NR_CPUS
+        || !cfg->nodes || cfg->nodes > mm::MAX_NUMNODES
+        || cfg->memory_mb < 16 || cfg->lifetime < 0) {
+        return -1;
+    }
+
+    return parse_mix(cfg, mix);
+}
+
+int main(int argc, char **argv)
+{
+    SimConfig *cfg = &sim_config;
+    std::vector<WorkerStat> stats;
+    std::vector<std::thread> workers;
+    FreeAreaSummary base, peak, after;
+    LatencyHistogram alloc_lat = {}, free_lat = {};
+    size_t allocs = 0, frees = 0, fails = 0, live_bytes = 0, held_pages;
+    double tsc_ns, seconds;
+
+    if (parse_options(cfg, argc, argv) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (arena_init(cfg) < 0) {
+        perror("mmap");
+        return 1;
+    }
+
+    lib::hosted_cpu_id() = 0;
+    mm::mm_core_init();
+
+    if (setup_size_classes(cfg) < 0) {
+        return 1;
+    }
+
+    if (cfg->profile_in && load_size_profile(cfg->profile_in) < 0) {
+        return 1;
+    }
+
+    drain_all_pcp(cfg);
+    get_free_area_summary(&base);
+
+    printf("[*] mmsim: target %s, %lu threads, %lu ops each, mean lifetime %.0f ops, %lu MiB on %lu nodes\n",
+           sim_target_name[cfg->target],
+           cfg->threads,
+           cfg->ops,
+           cfg->lifetime,
+           cfg->memory_mb,
+           cfg->nodes);
+
+    stats.resize(cfg->threads);
+
+    std::barrier<> sync(cfg->threads);
+    for (size_t i = 0; i < cfg->threads; i++) {
+        workers.emplace_back(sim_worker, cfg, i, &stats[i], &sync);
+    }
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    auto start = stats[0].start, end = stats[0].end;
+    for (auto &s : stats) {
+        alloc_lat.Merge(&s.alloc_lat);
+        free_lat.Merge(&s.free_lat);
+        allocs += s.allocs;
+        frees += s.frees;
+        fails += s.fails;
+        live_bytes += s.live_bytes;
+        start = s.start < start ? s.start : start;
+        end = s.end > end ? s.end : end;
+    }
+
+    tsc_ns = tsc_per_ns();
+    seconds = std::chrono::duration<double>(end - start).count();
+
+    printf("[*] throughput: %.3f Mops/s, %lu allocs and %lu frees in %.3f s, %lu failed\n",
+           (allocs + frees) / seconds / 1e6,
+           allocs,
+           frees,
+           seconds,
+           fails);
+
+    printf("[*] latency in TSC cycles (%.2f per ns):\n", tsc_ns);
+    printf("    %-6s %10s %10s %10s %10s %10s %10s\n", "", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    print_latency("alloc", &alloc_lat, tsc_ns);
+    print_latency("free", &free_lat, tsc_ns);
+
+    /* fragmentation with objects still alive */
+    drain_all_pcp(cfg);
+    get_free_area_summary(&peak);
+    held_pages = base.area.free_pages - peak.area.free_pages;
+
+    print_fragmentation("at the end", &peak, &base);
+    printf("    %lu bytes alive, %.1f%% of memory held by the allocator\n",
+           live_bytes,
+           held_pages ? 100.0 * live_bytes / (held_pages << mm::PAGE_SHIFT) : 100.0);
+
+    /* memory that is not given back after all objects are freed */
+    for (size_t i = 0; i < cfg->threads; i++) {
+        lib::hosted_cpu_id() = i;
+        for (auto &obj : stats[i].live) {
+            sim_free(cfg, obj.cls, obj.ptr);
+        }
+    }
+
+    lib::hosted_cpu_id() = 0;
+    drain_all_pcp(cfg);
+    get_free_area_summary(&after);
+    print_fragmentation("after freeing all", &after, &base);
+
+    if (cfg->dump) {
+        mm::mm_stat_dump();
+    }
+
+    if (cfg->profile_out && save_size_profile(cfg->profile_out) < 0) {
+        return 1;
+    }
+
+    return 0;
+}